@@ -1,5 +1,7 @@
 #include "headers/bsp.hpp"
 #include "headers/bspdefs.hpp"
+#include "headers/snapshot.hpp"
+#include "headers/validate.hpp"
 #include <iostream>
 #include <stdlib.h>
 #include <vector>
@@ -27,8 +29,6 @@
 #define USAGE \
 "Usage: %s BSP_INPUT\n"
 
-#define PROP_VERSION 10
-
 std::ostream& operator<<(std::ostream& os, const dbrushside_t& brushside) {
     os << "planenum: " << brushside.planenum << ", texture info: " << brushside.texinfo << ", displacement info: " << brushside.dispinfo << ", bevel: " << (brushside.bevel == 1 ? "true" : "false");
     return os;
@@ -52,14 +52,24 @@ int main (int argc, char **argv)
         printf(USAGE, argv[0]);
         return 1;
     }
-    Bsp input(argv[1]);
 
-    input.SelectLump<dbrush_t>(LUMP_BRUSHES);
-    std::vector<dbrush_t> brushes = input.GetAllLumpElements<dbrush_t>();
-    int brushnum = input.GetElementCount();
-    input.SelectLump<dbrushside_t>(LUMP_BRUSHSIDES);
-    std::vector<dbrushside_t> brushsides = input.GetAllLumpElements<dbrushside_t>();
-    int brushsidenum = input.GetElementCount();
+    // Nothing below checks indices, broken maps are rejected before the Bsp reads anything.
+    {
+        BspSnapshot snapshot(argv[1]);
+        BspValidator validator;
+        if (validator.Validate(snapshot) != 0)
+        {
+            validator.PrintReport(stderr);
+            return 1;
+        }
+    }
+    Bsp input(argv[1], File::BACKEND_MMAP_READ);
+
+    // Views point straight into the mapped file, nothing is copied.
+    LumpView<dbrush_t> brushes = input.GetLumpView<dbrush_t>(LUMP_BRUSHES);
+    int brushnum = brushes.size();
+    LumpView<dbrushside_t> brushsides = input.GetLumpView<dbrushside_t>(LUMP_BRUSHSIDES);
+    int brushsidenum = brushsides.size();
 
     int brushid = 0;
     for (const auto& brush : brushes)
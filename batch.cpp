@@ -0,0 +1,368 @@
+#include "headers/bspdefs.hpp"
+#include "headers/bspversion.hpp"
+#include "headers/snapshot.hpp"
+#include "headers/threadpool.hpp"
+#include <algorithm>
+#include <cstdarg>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#define USAGE \
+"Usage: %s [-j THREADS] [-a ANALYSES] [-l LIST] [-o OUTPUT] [BSP_OR_DIRECTORY...]\n" \
+"  ANALYSES is a comma separated list of lumps, brushes, gamelumps, vis (default: all of them)\n" \
+"  LIST is a file with one path per line, - for stdin. Directories are searched for .bsp files.\n" \
+"  One JSON object per map and line goes to OUTPUT (default: stdout), in input order.\n"
+
+// Analyses, bits of the -a mask.
+enum
+{
+    ANALYSIS_LUMPS = 1,
+    ANALYSIS_BRUSHES = 2,
+    ANALYSIS_GAMELUMPS = 4,
+    ANALYSIS_VIS = 8,
+    ANALYSIS_ALL = 15,
+};
+
+static int ParseAnalyses(const char *list) {
+    int mask = 0;
+    std::string names(list);
+    size_t start = 0;
+    while (start <= names.size())
+    {
+        size_t end = names.find(',', start);
+        if (end == std::string::npos)
+            end = names.size();
+        std::string name = names.substr(start, end - start);
+        if (name == "lumps")
+            mask |= ANALYSIS_LUMPS;
+        else if (name == "brushes")
+            mask |= ANALYSIS_BRUSHES;
+        else if (name == "gamelumps")
+            mask |= ANALYSIS_GAMELUMPS;
+        else if (name == "vis")
+            mask |= ANALYSIS_VIS;
+        else if (name == "all")
+            mask |= ANALYSIS_ALL;
+        else
+            return -1;
+        start = end + 1;
+    }
+    return mask;
+}
+
+// Paths of the files in a directory tree ending in .bsp, sorted so runs are reproducible.
+static void CollectDirectory(const char *path, std::vector<std::string> &paths) {
+    std::vector<std::string> found;
+    std::error_code error;
+    for (std::filesystem::recursive_directory_iterator it(path, error), end; !error && it != end; it.increment(error))
+    {
+        if (!it->is_regular_file(error))
+            continue;
+        std::string extension = it->path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (extension == ".bsp")
+            found.push_back(it->path().string());
+    }
+    if (error)
+        fprintf(stderr, "%s: %s\n", path, error.message().c_str());
+    std::sort(found.begin(), found.end());
+    paths.insert(paths.end(), found.begin(), found.end());
+}
+
+static bool CollectList(const char *list, std::vector<std::string> &paths) {
+    FILE *input = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (input == nullptr)
+    {
+        perror(list);
+        return false;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), input) != nullptr)
+    {
+        size_t length = strcspn(line, "\r\n");
+        line[length] = '\0';
+        if (length > 0)
+            paths.push_back(line);
+    }
+    if (input != stdin)
+        fclose(input);
+    return true;
+}
+
+// Asks the kernel to start reading a map in the background, so it's cached by the time a worker opens it.
+static void Prefetch(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+}
+
+static void AppendEscaped(std::string &out, const char *text) {
+    out += '"';
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            out += '\\';
+            out += *c;
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*c);
+            out += escape;
+        }
+        else
+            out += *c;
+    }
+    out += '"';
+}
+
+static void AppendFormat(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void AppendFormat(std::string &out, const char *format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length > 0)
+        out.append(buffer, std::min((size_t)length, sizeof(buffer) - 1));
+}
+
+// Bytes of lump n, compressed lumps are only read for their real size. -1 if it can't be decompressed.
+static long long LumpSize(const BspSnapshot &bsp, int n) {
+    if (!bsp.IsLumpCompressed(n))
+        return bsp.GetLump(n).filelen > 0 ? bsp.GetLump(n).filelen : 0;
+    std::vector<char> data;
+    if (!bsp.ReadLump(n, data))
+        return -1;
+    return (long long)data.size();
+}
+
+// "name":count, null if it's unknown.
+static void AppendCount(std::string &out, const char *name, long long count) {
+    if (count < 0)
+        AppendFormat(out, ",\"%s\":null", name);
+    else
+        AppendFormat(out, ",\"%s\":%lld", name, count);
+}
+
+// Runs the analyses on one map into a JSON line. Files that aren't readable bsps get an error instead,
+// File aborts on open failures so they're checked here first.
+static void AnalyzeMap(const std::string &path, int analyses, std::string &out) {
+    out.clear();
+    out += "{\"path\":";
+    AppendEscaped(out, path.c_str());
+
+    struct stat info;
+    dheader_t header;
+    memset(&header, 0, sizeof(dheader_t));
+    int fd = open(path.c_str(), O_RDONLY);
+    bool readable = fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    if (readable && ((size_t)info.st_size < sizeof(dheader_t) || pread(fd, &header, sizeof(dheader_t), 0) != sizeof(dheader_t)))
+        header.ident = 0;
+    if (fd >= 0)
+        close(fd);
+    if (!readable || header.ident != IDBSPHEADER)
+    {
+        out += readable ? ",\"error\":\"not a bsp\"}\n" : ",\"error\":\"unreadable\"}\n";
+        return;
+    }
+
+    // Lumps outside the file are a broken map, not something to read around.
+    NormalizeBspHeader(header, DetectBspProfile(header, info.st_size));
+    for (int n = 0; n < HEADER_LUMPS; n++)
+    {
+        const lump_t &lump = header.lumps[n];
+        if (lump.fileofs < 0 || lump.filelen < 0 || (long long)lump.fileofs + lump.filelen > (long long)info.st_size)
+        {
+            AppendFormat(out, ",\"error\":\"lump %d outside the file\"}\n", n);
+            return;
+        }
+    }
+
+    BspSnapshot bsp(path.c_str());
+    AppendFormat(out, ",\"size\":%lld,\"version\":%d,\"profile\":\"%s\",\"revision\":%d",
+        (long long)info.st_size, bsp.GetBspVersion(), GetBspProfileName(bsp.GetProfile()), bsp.GetMapRevision());
+
+    if (analyses & ANALYSIS_LUMPS)
+    {
+        // Only the lumps with data, by index.
+        out += ",\"lumps\":[";
+        bool first = true;
+        for (int n = 0; n < HEADER_LUMPS; n++)
+        {
+            lump_t lump = bsp.GetLump(n);
+            if (lump.filelen <= 0)
+                continue;
+            AppendFormat(out, "%s{\"index\":%d,\"offset\":%d,\"length\":%d,\"version\":%d,\"compressed\":%s}",
+                first ? "" : ",", n, lump.fileofs, lump.filelen, lump.version, bsp.IsLumpCompressed(n) ? "true" : "false");
+            first = false;
+        }
+        out += "]";
+    }
+    if (analyses & ANALYSIS_BRUSHES)
+    {
+        long long brushes = LumpSize(bsp, LUMP_BRUSHES), brushsides = LumpSize(bsp, LUMP_BRUSHSIDES);
+        AppendCount(out, "brushes", brushes < 0 ? -1 : brushes / (long long)sizeof(dbrush_t));
+        AppendCount(out, "brushsides", brushsides < 0 ? -1 : brushsides / (long long)sizeof(dbrushside_t));
+    }
+    if (analyses & ANALYSIS_GAMELUMPS)
+    {
+        out += ",\"gamelumps\":[";
+        std::vector<dgamelump_t> gamelumps = bsp.GetAllGameLumps();
+        for (size_t i = 0; i < gamelumps.size(); i++)
+        {
+            const dgamelump_t &gamelump = gamelumps[i];
+            char id[5] = {((char *)&gamelump.id)[3], ((char *)&gamelump.id)[2], ((char *)&gamelump.id)[1], ((char *)&gamelump.id)[0], '\0'};
+            for (int c = 0; c < 4; c++)
+            {
+                if ((unsigned char)id[c] < 0x20 || (unsigned char)id[c] > 0x7E)
+                    id[c] = '?';
+            }
+            out += i == 0 ? "{\"id\":" : ",{\"id\":";
+            AppendEscaped(out, id);
+            AppendFormat(out, ",\"version\":%d,\"flags\":%d,\"size\":%d}", gamelump.version, gamelump.flags, gamelump.filelen);
+        }
+        out += "]";
+    }
+    if (analyses & ANALYSIS_VIS)
+    {
+        std::vector<char> vis;
+        int clusters = 0;
+        if (!bsp.ReadLump(LUMP_VISIBILITY, vis))
+            clusters = -1;
+        else if (vis.size() >= sizeof(int))
+            memcpy(&clusters, vis.data(), sizeof(int));
+        AppendCount(out, "visclusters", clusters);
+    }
+    out += "}\n";
+}
+
+// Results come in out of order, each one is written as soon as everything before it has been.
+class OrderedWriter
+{
+private:
+    FILE *output;
+    std::vector<std::string> results;
+    std::vector<char> ready;
+    size_t next;
+    std::mutex lock;
+
+public:
+    OrderedWriter(FILE *new_output, size_t count) : output(new_output), results(count), ready(count, 0), next(0) {}
+
+    void Put(size_t index, std::string &result) {
+        std::lock_guard<std::mutex> guard(lock);
+        results[index].swap(result);
+        ready[index] = 1;
+        for (; next < results.size() && ready[next]; next++)
+        {
+            fwrite(results[next].data(), 1, results[next].size(), output);
+            std::string().swap(results[next]);
+        }
+    }
+};
+
+int main (int argc, char **argv)
+{
+    size_t threads = 0;
+    int analyses = ANALYSIS_ALL;
+    const char *output_path = nullptr;
+    std::vector<std::string> paths;
+    int option;
+    while ((option = getopt(argc, argv, "j:a:l:o:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'j':
+            threads = (size_t)atoi(optarg);
+            break;
+        case 'a':
+            analyses = ParseAnalyses(optarg);
+            if (analyses < 0)
+            {
+                fprintf(stderr, "Unknown analysis in %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            if (!CollectList(optarg, paths))
+                return 1;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        default:
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        struct stat info;
+        if (stat(argv[i], &info) == 0 && S_ISDIR(info.st_mode))
+            CollectDirectory(argv[i], paths);
+        else
+            paths.push_back(argv[i]);
+    }
+    if (paths.empty())
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    FILE *output = output_path != nullptr ? fopen(output_path, "w") : stdout;
+    if (output == nullptr)
+    {
+        perror(output_path);
+        return 1;
+    }
+
+    // Every map is a task. While a worker parses map i the kernel is already reading map i + lookahead.
+    ThreadPool pool(threads);
+    size_t lookahead = pool.GetThreadCount() * 2;
+    for (size_t i = 0; i < paths.size() && i < lookahead; i++)
+        Prefetch(paths[i]);
+    OrderedWriter writer(output, paths.size());
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        pool.Submit([&, i]() {
+            if (i + lookahead < paths.size())
+                Prefetch(paths[i + lookahead]);
+            // One broken map only fails its own line.
+            std::string result;
+            try
+            {
+                AnalyzeMap(paths[i], analyses, result);
+            }
+            catch (const std::exception &error)
+            {
+                result = "{\"path\":";
+                AppendEscaped(result, paths[i].c_str());
+                result += ",\"error\":";
+                AppendEscaped(result, error.what());
+                result += "}\n";
+            }
+            writer.Put(i, result);
+        });
+    }
+    pool.Wait();
+
+    if (output != stdout)
+        fclose(output);
+    else
+        fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,804 @@
+#include "headers/bsp.hpp"
+#include "headers/bspdefs.hpp"
+#include "headers/bspgen.hpp"
+#include "headers/entities.hpp"
+#include "headers/lightmap.hpp"
+#include "headers/pointleaf.hpp"
+#include "headers/snapshot.hpp"
+#include "headers/validate.hpp"
+#include "headers/worldlights.hpp"
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define USAGE \
+"Usage: %s [-g GRID] [-l LIGHTMAP_SIZE] [-p PAKFILE_MB] [-s SEED] [-j JSON_OUTPUT] BSP_INPUT [ITERATIONS]\n" \
+"  -g writes a synthetic GRID x GRID box map (BspGenerator) to BSP_INPUT first, -l and -p scale it up.\n" \
+"  -j writes every result as JSON to JSON_OUTPUT (- for stdout, the text report then goes to stderr).\n"
+
+typedef std::chrono::steady_clock benchclock;
+
+// Every number the benchmarks print is also recorded here by name, for the JSON output.
+struct BenchResult
+{
+    std::string name;
+    double value;
+    const char *unit;
+};
+
+static std::vector<BenchResult> results;
+static FILE *report = stdout;
+
+static void Record(const std::string &name, double value, const char *unit = "ms") {
+    results.push_back(BenchResult{name, value, unit});
+}
+
+static double ElapsedMs(benchclock::time_point start) {
+    return std::chrono::duration<double, std::milli>(benchclock::now() - start).count();
+}
+
+// Touches every byte so the mmap backend actually has to fault the pages in.
+static size_t Checksum(const char *data, size_t size) {
+    size_t sum = 0;
+    for (size_t i = 0; i < size; i++)
+        sum += (unsigned char)data[i];
+    return sum;
+}
+
+static const char* BackendName(int backend) {
+    switch (backend)
+    {
+    case File::BACKEND_MMAP_READ:
+        return "mmap-read";
+    case File::BACKEND_MMAP_WRITE:
+        return "mmap-write";
+    default:
+        return "stdio";
+    }
+}
+
+static void BenchBackend(const char *path, int backend, int iterations) {
+    double open_ms = 0, select_ms = 0, elements_ms = 0, view_ms = 0, random_ms = 0;
+    size_t bytes = 0, sum = 0;
+
+    for (int it = 0; it < iterations; it++)
+    {
+        benchclock::time_point start = benchclock::now();
+        Bsp input(path, backend);
+        open_ms += ElapsedMs(start);
+
+        // Every lump once, sequentially.
+        start = benchclock::now();
+        for (int n = 0; n < HEADER_LUMPS; n++)
+        {
+            input.SelectLump<char>(n);
+            sum += Checksum(input.GetLumpData(), input.GetLumpDataSize());
+            bytes += input.GetLumpDataSize();
+        }
+        select_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        input.SelectLump<dbrushside_t>(LUMP_BRUSHSIDES);
+        std::vector<dbrushside_t> brushsides = input.GetAllLumpElements<dbrushside_t>();
+        input.SelectLump<dplane_t>(LUMP_PLANES);
+        std::vector<dplane_t> planes = input.GetAllLumpElements<dplane_t>();
+        elements_ms += ElapsedMs(start);
+        sum += brushsides.size() + planes.size();
+
+        // Plane lookups through the brushsides, the usual access pattern of a walker.
+        start = benchclock::now();
+        for (const auto &side : brushsides)
+        {
+            dplane_t plane = input.GetLumpElement<dplane_t>(side.planenum);
+            sum += (size_t)plane.type;
+        }
+        random_ms += ElapsedMs(start);
+
+        // Same walk without copies, only zero-copy when mapped.
+        start = benchclock::now();
+        input.SelectLump<dbrushside_t>(LUMP_BRUSHSIDES);
+        for (const auto &side : input.GetLumpView<dbrushside_t>())
+            sum += side.planenum;
+        view_ms += ElapsedMs(start);
+    }
+
+    fprintf(report, "%-10s open %9.3f ms  select+touch %9.3f ms (%.1f MB/s)  GetAllLumpElements %9.3f ms  GetLumpView %9.3f ms  GetLumpElement %9.3f ms  [%zu]\n",
+        BackendName(backend),
+        open_ms / iterations,
+        select_ms / iterations,
+        select_ms > 0 ? (bytes / (1024.0 * 1024.0)) / (select_ms / 1000.0) : 0.0,
+        elements_ms / iterations,
+        view_ms / iterations,
+        random_ms / iterations,
+        sum);
+    std::string prefix = std::string("backend.") + BackendName(backend) + ".";
+    Record(prefix + "open", open_ms / iterations);
+    Record(prefix + "SelectLump", select_ms / iterations);
+    Record(prefix + "GetAllLumpElements", elements_ms / iterations);
+    Record(prefix + "GetLumpView", view_ms / iterations);
+    Record(prefix + "GetLumpElement", random_ms / iterations);
+}
+
+// Version and lump size checks only, like an indexing job does.
+static void BenchOpenModes(const char *path, int iterations) {
+    const int opens = 100;
+    for (int mode : {Bsp::OPEN_EAGER, Bsp::OPEN_HEADER_ONLY})
+    {
+        size_t sum = 0;
+        benchclock::time_point start = benchclock::now();
+        for (int it = 0; it < iterations * opens; it++)
+        {
+            Bsp input(path, File::BACKEND_STDIO, mode);
+            sum += input.GetBspVersion() + input.GetLump(LUMP_PAKFILE).filelen;
+        }
+        double ms = ElapsedMs(start);
+        fprintf(report, "open %-12s %9.3f ms per open  [%zu]\n", mode == Bsp::OPEN_EAGER ? "eager" : "header-only", ms / (iterations * opens), sum);
+        Record(mode == Bsp::OPEN_EAGER ? "open.eager" : "open.header-only", ms / (iterations * opens));
+    }
+}
+
+// Switches back and forth between brushes and brushsides like basic.cpp does, with and without the lump cache.
+static void BenchLumpCache(const char *path, int iterations) {
+    const int switches = 100;
+    for (size_t budget : {(size_t)0, (size_t)256 * 1024 * 1024})
+    {
+        Bsp input(path);
+        input.SetLumpCacheBudget(budget);
+        benchclock::time_point start = benchclock::now();
+        for (int it = 0; it < iterations * switches; it++)
+        {
+            input.SelectLump<dbrush_t>(LUMP_BRUSHES);
+            input.SelectLump<dbrushside_t>(LUMP_BRUSHSIDES);
+        }
+        double ms = ElapsedMs(start);
+        fprintf(report, "lump cache %-8s %9.3f ms per %d switches  hits %zu misses %zu\n",
+            budget ? "on" : "off", ms / iterations, switches * 2,
+            input.GetLumpCache().GetHits(), input.GetLumpCache().GetMisses());
+        Record(budget ? "lumpcache.on" : "lumpcache.off", ms / iterations);
+    }
+}
+
+// Plain recursion over the lumps as they are, what a lookup looks like without PointLeafTree.
+static int NaiveFindLeaf(const std::vector<dnode_t> &nodes, const std::vector<dplane_t> &planes, int index, const Vector &point) {
+    if (index < 0)
+        return -(index + 1);
+    const dnode_t &node = nodes[index];
+    const dplane_t &plane = planes[node.planenum];
+    float d = point.x * plane.normal.x + point.y * plane.normal.y + point.z * plane.normal.z - plane.dist;
+    return NaiveFindLeaf(nodes, planes, node.children[d < 0.0f], point);
+}
+
+// Random points inside the world, looked up one by one with recursion, with FindLeaf() and with FindLeaves().
+static void BenchPointLeaf(const char *path, int iterations) {
+    const size_t count = 1 << 20;
+    Bsp input(path, File::BACKEND_MMAP_READ);
+    input.SelectLump<dnode_t>(LUMP_NODES);
+    std::vector<dnode_t> nodes = input.GetAllLumpElements<dnode_t>();
+    input.SelectLump<dplane_t>(LUMP_PLANES);
+    std::vector<dplane_t> planes = input.GetAllLumpElements<dplane_t>();
+    input.SelectLump<dmodel_t>(LUMP_MODELS);
+    dmodel_t world = input.GetLumpElement<dmodel_t>(0);
+
+    PointLeafTree tree;
+    benchclock::time_point start = benchclock::now();
+    if (nodes.empty() || tree.Build(input) != 0)
+    {
+        fprintf(report, "point to leaf: no valid tree\n");
+        return;
+    }
+    double build_ms = ElapsedMs(start);
+
+    std::vector<Vector> points(count);
+    srand(1);
+    for (Vector &point : points)
+    {
+        point.x = world.mins.x + (world.maxs.x - world.mins.x) * (rand() / (float)RAND_MAX);
+        point.y = world.mins.y + (world.maxs.y - world.mins.y) * (rand() / (float)RAND_MAX);
+        point.z = world.mins.z + (world.maxs.z - world.mins.z) * (rand() / (float)RAND_MAX);
+    }
+
+    std::vector<int> naive(count), single(count), batched(count);
+    double naive_ms = 0, single_ms = 0, batched_ms = 0;
+    for (int it = 0; it < iterations; it++)
+    {
+        start = benchclock::now();
+        for (size_t i = 0; i < count; i++)
+            naive[i] = NaiveFindLeaf(nodes, planes, world.headnode, points[i]);
+        naive_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        for (size_t i = 0; i < count; i++)
+            single[i] = tree.FindLeaf(points[i]);
+        single_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        tree.FindLeaves(points.data(), count, batched.data());
+        batched_ms += ElapsedMs(start);
+    }
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < count; i++)
+        mismatches += naive[i] != single[i] || naive[i] != batched[i];
+    fprintf(report, "point to leaf %zu points, build %9.3f ms  recursion %9.3f ms  FindLeaf %9.3f ms  FindLeaves %9.3f ms  mismatches %zu\n",
+        count, build_ms, naive_ms / iterations, single_ms / iterations, batched_ms / iterations, mismatches);
+    Record("pointleaf.build", build_ms);
+    Record("pointleaf.recursion", naive_ms / iterations);
+    Record("pointleaf.FindLeaf", single_ms / iterations);
+    Record("pointleaf.FindLeaves", batched_ms / iterations);
+    Record("pointleaf.mismatches", (double)mismatches, "count");
+}
+
+// Character by character with a copy of every key and value, what parsing looks like without EntityList.
+static size_t NaiveParseEntities(const char *data, size_t size, std::vector<std::pair<std::string, std::string>> &pairs) {
+    pairs.clear();
+    size_t entities = 0;
+    std::string token, key;
+    bool haskey = false;
+    for (size_t i = 0; i < size && data[i] != '\0'; i++)
+    {
+        if (data[i] == '{')
+            entities++;
+        if (data[i] != '"')
+            continue;
+        token.clear();
+        for (i++; i < size && data[i] != '"'; i++)
+        {
+            if (data[i] == '\\' && i + 1 < size)
+                token += data[i++];
+            token += data[i];
+        }
+        if (haskey)
+            pairs.emplace_back(key, token);
+        else
+            key = token;
+        haskey = !haskey;
+    }
+    return entities;
+}
+
+// The entity lump repeated to at least 16 MB, parsed naively and with EntityList.
+static void BenchEntities(const char *path, int iterations) {
+    Bsp input(path, File::BACKEND_MMAP_READ);
+    std::vector<char> lump;
+    input.ReadLump(LUMP_ENTITIES, lump);
+    size_t length = strnlen(lump.data(), lump.size());
+    if (length == 0)
+    {
+        fprintf(report, "entities: empty entity lump\n");
+        return;
+    }
+    std::string text;
+    while (text.size() < (16u << 20))
+        text.append(lump.data(), length);
+
+    std::vector<std::pair<std::string, std::string>> naive_pairs;
+    EntityList entities;
+    size_t naive_count = 0, pair_count = 0;
+    double naive_ms = 0, parse_ms = 0;
+    for (int it = 0; it < iterations; it++)
+    {
+        benchclock::time_point start = benchclock::now();
+        naive_count = NaiveParseEntities(text.data(), text.size(), naive_pairs);
+        naive_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        entities.Parse(text.data(), text.size());
+        parse_ms += ElapsedMs(start);
+    }
+    for (size_t e = 0; e < entities.size(); e++)
+        pair_count += entities.GetPairCount(e);
+    fprintf(report, "entities %zu MB, naive %9.3f ms  EntityList %9.3f ms  entities %zu/%zu  pairs %zu/%zu\n",
+        text.size() >> 20, naive_ms / iterations, parse_ms / iterations, naive_count, entities.size(), naive_pairs.size(), pair_count);
+    Record("entities.naive", naive_ms / iterations);
+    Record("entities.EntityList", parse_ms / iterations);
+}
+
+// Every lightmap of the map decoded one ldexp at a time, then with LightmapAtlas (single threaded and on a pool).
+static void BenchLightmaps(const char *path, int iterations) {
+    Bsp input(path, File::BACKEND_MMAP_READ);
+    std::vector<char> lighting, texinfo_data;
+    std::vector<dface_t> faces;
+    input.ReadLump(LUMP_LIGHTING, lighting);
+    input.ReadFaces(faces);
+    input.ReadLump(LUMP_TEXINFO, texinfo_data);
+    std::vector<texinfo_t> texinfos(texinfo_data.size() / sizeof(texinfo_t));
+    memcpy((void *)texinfos.data(), texinfo_data.data(), texinfos.size() * sizeof(texinfo_t));
+
+    LightmapAtlas atlas;
+    atlas.Build(faces.data(), faces.size(), texinfos.data(), texinfos.size(), lighting.size());
+    if (atlas.GetPages().empty())
+    {
+        fprintf(report, "lightmaps: no lighting\n");
+        return;
+    }
+    std::vector<char> naive(atlas.GetAtlasSize(LightmapAtlas::LIGHTMAP_RGBA32F), 0), single(naive.size(), 0), pooled(naive.size(), 0);
+    ThreadPool pool;
+    double naive_ms = 0, single_ms = 0, pooled_ms = 0;
+    size_t texels = 0;
+    for (int it = 0; it < iterations; it++)
+    {
+        benchclock::time_point start = benchclock::now();
+        texels = 0;
+        for (const LightmapPage &page : atlas.GetPages())
+        {
+            size_t count;
+            size_t index = &page - atlas.GetFacePages(page.face, count); // style * maps + bump
+            const ColorRGBExp32 *src = (const ColorRGBExp32 *)(lighting.data() + faces[page.face].lightofs) + index * page.width * page.height;
+            for (int y = 0; y < page.height; y++)
+            {
+                float *dst = (float *)naive.data() + ((size_t)(page.y + y) * atlas.GetWidth() + page.x) * 4;
+                for (int x = 0; x < page.width; x++, src++, dst += 4)
+                {
+                    dst[0] = ldexpf(src->r / 255.0f, src->exponent);
+                    dst[1] = ldexpf(src->g / 255.0f, src->exponent);
+                    dst[2] = ldexpf(src->b / 255.0f, src->exponent);
+                    dst[3] = 1.0f;
+                }
+            }
+            texels += (size_t)page.width * page.height;
+        }
+        naive_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        atlas.Decode(lighting.data(), single.data());
+        single_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        atlas.Decode(lighting.data(), pooled.data(), LightmapAtlas::LIGHTMAP_RGBA32F, &pool);
+        pooled_ms += ElapsedMs(start);
+    }
+    // c / 255 and c * (1 / 255) can round apart by an ulp.
+    double error = 0;
+    for (size_t i = 0; i < naive.size() / sizeof(float); i++)
+    {
+        float a = ((const float *)naive.data())[i], b = ((const float *)single.data())[i];
+        if (a != b)
+            error = std::max(error, fabs((double)a - b) / fabs((double)a));
+    }
+    fprintf(report, "lightmaps %zu texels, naive %9.3f ms  atlas %9.3f ms  pool %9.3f ms  max error %g  same %d\n",
+        texels, naive_ms / iterations, single_ms / iterations, pooled_ms / iterations, error, single == pooled);
+    Record("lightmaps.naive", naive_ms / iterations);
+    Record("lightmaps.atlas", single_ms / iterations);
+    Record("lightmaps.pool", pooled_ms / iterations);
+    Record("lightmaps.error", error, "ratio");
+}
+
+// Lights reaching one point per leaf center, every light checked with GetAttenuation() and through the grid.
+static void BenchWorldLights(const char *path, int iterations) {
+    Bsp input(path, File::BACKEND_MMAP_READ);
+    WorldLights lights;
+    benchclock::time_point start = benchclock::now();
+    lights.Build(input);
+    double build_ms = ElapsedMs(start);
+    std::vector<dleaf_t> leafs;
+    input.ReadLeafs(leafs);
+    if (lights.size() == 0 || leafs.empty())
+    {
+        fprintf(report, "worldlights: no lights\n");
+        return;
+    }
+    std::vector<Vector> points(leafs.size());
+    for (size_t i = 0; i < leafs.size(); i++)
+    {
+        points[i].x = (leafs[i].mins[0] + leafs[i].maxs[0]) * 0.5f;
+        points[i].y = (leafs[i].mins[1] + leafs[i].maxs[1]) * 0.5f;
+        points[i].z = (leafs[i].mins[2] + leafs[i].maxs[2]) * 0.5f;
+    }
+
+    // The brute force pass is quadratic, a slice of the points is enough.
+    size_t naive_points = std::min(points.size(), (size_t)1024);
+    std::vector<size_t> first;
+    std::vector<LightHit> hits;
+    ThreadPool pool;
+    size_t naive_hits = 0, grid_hits = 0;
+    double naive_ms = 0, grid_ms = 0, batched_ms = 0;
+    for (int it = 0; it < iterations; it++)
+    {
+        start = benchclock::now();
+        naive_hits = 0;
+        for (size_t i = 0; i < naive_points; i++)
+        {
+            for (size_t l = 0; l < lights.size(); l++)
+                naive_hits += lights.GetAttenuation(l, points[i]) > 0.0f;
+        }
+        naive_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        hits.clear();
+        for (size_t i = 0; i < naive_points; i++)
+            lights.FindLights(points[i], hits);
+        grid_hits = hits.size();
+        grid_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        lights.FindLightsBatch(points.data(), points.size(), first, hits, 0.0f, &pool);
+        batched_ms += ElapsedMs(start);
+    }
+    fprintf(report, "worldlights %zu, build %9.3f ms  %zu points naive %9.3f ms  grid %9.3f ms  hits %zu/%zu  %zu points batched %9.3f ms\n",
+        lights.size(), build_ms, naive_points, naive_ms / iterations, grid_ms / iterations, naive_hits, grid_hits, points.size(), batched_ms / iterations);
+    Record("worldlights.build", build_ms);
+    Record("worldlights.naive", naive_ms / iterations);
+    Record("worldlights.grid", grid_ms / iterations);
+    Record("worldlights.batched", batched_ms / iterations);
+}
+
+// Raw File paths: Read() in blocks, ReadAt() of random blocks and Backup() of the whole file on both read backends,
+// then Write() and WriteAt() of the same bytes back into the backup (stdio and mmap-write).
+static void BenchFile(const char *path, const std::string &copy, int iterations) {
+    const size_t block = 1 << 16;
+    const int random_blocks = 1024;
+    std::vector<char> buffer(block);
+    size_t sum = 0;
+    for (int backend : {File::BACKEND_STDIO, File::BACKEND_MMAP_READ})
+    {
+        double read_ms = 0, readat_ms = 0, backup_ms = 0;
+        size_t size = 0;
+        for (int it = 0; it < iterations; it++)
+        {
+            File file(path, backend);
+            size = file.GetSize();
+            benchclock::time_point start = benchclock::now();
+            while (file.Read(buffer.data(), block) > 0)
+                sum += (unsigned char)buffer[0];
+            read_ms += ElapsedMs(start);
+
+            srand(it);
+            start = benchclock::now();
+            for (int i = 0; i < random_blocks && size > block; i++)
+                sum += file.ReadAt(buffer.data(), block, (size_t)rand() % (size - block));
+            readat_ms += ElapsedMs(start);
+
+            start = benchclock::now();
+            file.Backup(".bench", 1 << 20, true);
+            backup_ms += ElapsedMs(start);
+        }
+        fprintf(report, "file %-10s Read %9.3f ms (%.1f MB/s)  ReadAt %d x %zu KB %9.3f ms  Backup %9.3f ms\n",
+            BackendName(backend), read_ms / iterations, read_ms > 0 ? (size / (1024.0 * 1024.0)) / (read_ms / iterations / 1000.0) : 0.0,
+            random_blocks, block >> 10, readat_ms / iterations, backup_ms / iterations);
+        std::string prefix = std::string("file.") + BackendName(backend) + ".";
+        Record(prefix + "Read", read_ms / iterations);
+        Record(prefix + "ReadAt", readat_ms / iterations);
+        Record(prefix + "Backup", backup_ms / iterations);
+    }
+
+    for (int backend : {File::BACKEND_STDIO, File::BACKEND_MMAP_WRITE})
+    {
+        double write_ms = 0, writeat_ms = 0;
+        for (int it = 0; it < iterations; it++)
+        {
+            File file(copy.c_str(), backend);
+            size_t size = file.GetSize();
+            benchclock::time_point start = benchclock::now();
+            for (size_t done; (done = file.Read(buffer.data(), block)) > 0;)
+                file.Write(buffer.data(), done);
+            file.Flush();
+            write_ms += ElapsedMs(start);
+
+            srand(it);
+            start = benchclock::now();
+            for (int i = 0; i < random_blocks && size > block; i++)
+            {
+                size_t offset = (size_t)rand() % (size - block);
+                file.ReadAt(buffer.data(), block, offset);
+                file.WriteAt(buffer.data(), block, offset);
+            }
+            file.Flush();
+            writeat_ms += ElapsedMs(start);
+        }
+        fprintf(report, "file %-10s Read+Write %9.3f ms  ReadAt+WriteAt %d x %zu KB %9.3f ms  [%zu]\n",
+            BackendName(backend), write_ms / iterations, random_blocks, block >> 10, writeat_ms / iterations, sum);
+        std::string prefix = std::string("file.") + BackendName(backend) + ".";
+        Record(prefix + "Write", write_ms / iterations);
+        Record(prefix + "WriteAt", writeat_ms / iterations);
+    }
+}
+
+// The Bsp write paths on the backup, every plane written back as it is:
+// one SetLumpElement() per plane, ReadLumpElements() + WriteLumpElements() of the lump and SetLump() of its entry.
+static void BenchLumpWrites(const std::string &copy, int iterations) {
+    for (int backend : {File::BACKEND_STDIO, File::BACKEND_MMAP_WRITE})
+    {
+        double set_ms = 0, read_ms = 0, write_ms = 0, setlump_ms = 0;
+        size_t count = 0;
+        for (int it = 0; it < iterations; it++)
+        {
+            Bsp output(copy.c_str(), backend);
+            output.SelectLump<dplane_t>(LUMP_PLANES);
+            std::vector<dplane_t> planes = output.GetAllLumpElements<dplane_t>();
+            count = planes.size();
+
+            benchclock::time_point start = benchclock::now();
+            for (size_t i = 0; i < planes.size(); i++)
+                output.SetLumpElement(planes[i], i);
+            set_ms += ElapsedMs(start);
+
+            start = benchclock::now();
+            output.SelectLump<dplane_t>(LUMP_PLANES);
+            output.ReadLumpElements(planes.data(), planes.size());
+            read_ms += ElapsedMs(start);
+
+            start = benchclock::now();
+            output.WriteLumpElements(planes.data(), planes.size());
+            write_ms += ElapsedMs(start);
+
+            start = benchclock::now();
+            for (int n = 0; n < HEADER_LUMPS; n++)
+            {
+                output.SelectLump<char>(n);
+                output.SetLump(output.GetLump());
+            }
+            setlump_ms += ElapsedMs(start);
+        }
+        fprintf(report, "lump writes %-10s %zu planes, SetLumpElement %9.3f ms  ReadLumpElements %9.3f ms  WriteLumpElements %9.3f ms  SelectLump+SetLump %9.3f ms\n",
+            BackendName(backend), count, set_ms / iterations, read_ms / iterations, write_ms / iterations, setlump_ms / iterations);
+        std::string prefix = std::string("lumpwrites.") + BackendName(backend) + ".";
+        Record(prefix + "SetLumpElement", set_ms / iterations);
+        Record(prefix + "ReadLumpElements", read_ms / iterations);
+        Record(prefix + "WriteLumpElements", write_ms / iterations);
+        Record(prefix + "SetLump", setlump_ms / iterations);
+    }
+}
+
+// Vis offsets with GetVisData(), the decoded matrix on a fresh Bsp with and without a pool, then every cluster pair.
+static void BenchVis(const char *path, int iterations) {
+    ThreadPool pool;
+    double data_ms = 0, decode_ms = 0, pooled_ms = 0, query_ms = 0;
+    int clusters = 0;
+    size_t visible = 0;
+    for (int it = 0; it < iterations; it++)
+    {
+        Bsp input(path, File::BACKEND_MMAP_READ);
+        benchclock::time_point start = benchclock::now();
+        clusters = (int)input.GetVisData().size();
+        data_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        input.GetVisMatrix();
+        decode_ms += ElapsedMs(start);
+
+        Bsp pooled_input(path, File::BACKEND_MMAP_READ);
+        start = benchclock::now();
+        pooled_input.GetVisMatrix(&pool);
+        pooled_ms += ElapsedMs(start);
+
+        // Capped so big maps stay quadratic in a few thousand clusters at most.
+        const VisMatrix &matrix = input.GetVisMatrix();
+        clusters = matrix.GetClusterCount();
+        int queried = std::min(clusters, 4096);
+        start = benchclock::now();
+        visible = 0;
+        for (int from = 0; from < queried; from++)
+        {
+            for (int to = 0; to < queried; to++)
+                visible += matrix.IsClusterVisible(from, to);
+        }
+        query_ms += ElapsedMs(start);
+    }
+    fprintf(report, "vis %d clusters, GetVisData %9.3f ms  GetVisMatrix %9.3f ms  pool %9.3f ms  IsClusterVisible (all pairs) %9.3f ms  visible %zu\n",
+        clusters, data_ms / iterations, decode_ms / iterations, pooled_ms / iterations, query_ms / iterations, visible);
+    Record("vis.GetVisData", data_ms / iterations);
+    Record("vis.GetVisMatrix", decode_ms / iterations);
+    Record("vis.GetVisMatrix.pool", pooled_ms / iterations);
+    Record("vis.IsClusterVisible", query_ms / iterations);
+}
+
+// The game lump directory and every game lump read through it.
+static void BenchGameLumps(const char *path, int iterations) {
+    const int repeats = 100;
+    double list_ms = 0, read_ms = 0;
+    size_t count = 0, bytes = 0;
+    Bsp input(path, File::BACKEND_MMAP_READ);
+    std::vector<char> data;
+    for (int it = 0; it < iterations; it++)
+    {
+        benchclock::time_point start = benchclock::now();
+        for (int r = 0; r < repeats; r++)
+            count = input.GetAllGameLumps().size();
+        list_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        bytes = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            input.ReadGameLump((int)i, data);
+            bytes += data.size();
+        }
+        read_ms += ElapsedMs(start);
+    }
+    fprintf(report, "game lumps %zu, GetAllGameLumps %9.3f ms per %d  ReadGameLump %9.3f ms  %zu bytes\n",
+        count, list_ms / iterations, repeats, read_ms / iterations, bytes);
+    Record("gamelumps.GetAllGameLumps", list_ms / iterations / repeats);
+    Record("gamelumps.ReadGameLump", read_ms / iterations);
+}
+
+// Every cross reference checked, on a snapshot and on a Bsp, with and without a pool.
+static void BenchValidate(const char *path, int iterations) {
+    ThreadPool pool;
+    double snapshot_ms = 0, pooled_ms = 0, bsp_ms = 0;
+    size_t errors = 0;
+    BspSnapshot snapshot(path);
+    Bsp input(path, File::BACKEND_MMAP_READ);
+    BspValidator validator;
+    for (int it = 0; it < iterations; it++)
+    {
+        benchclock::time_point start = benchclock::now();
+        validator.Validate(snapshot);
+        snapshot_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        validator.Validate(snapshot, &pool);
+        pooled_ms += ElapsedMs(start);
+
+        start = benchclock::now();
+        validator.Validate(input, &pool);
+        bsp_ms += ElapsedMs(start);
+        errors = validator.GetErrorCount();
+    }
+    fprintf(report, "validate snapshot %9.3f ms  pool %9.3f ms  Bsp (mmap) pool %9.3f ms  %zu errors\n",
+        snapshot_ms / iterations, pooled_ms / iterations, bsp_ms / iterations, errors);
+    Record("validate.snapshot", snapshot_ms / iterations);
+    Record("validate.snapshot.pool", pooled_ms / iterations);
+    Record("validate.bsp.pool", bsp_ms / iterations);
+}
+
+// What a tool does from open to done: the whole map read through ReadLump() (with and without PrefetchLumps()
+// on a pool), the tree built, the vis decoded and the game lumps read.
+static void BenchEndToEnd(const char *path, int iterations) {
+    ThreadPool pool;
+    int all[HEADER_LUMPS];
+    for (int n = 0; n < HEADER_LUMPS; n++)
+        all[n] = n;
+    for (int backend : {File::BACKEND_STDIO, File::BACKEND_MMAP_READ})
+    {
+        for (bool prefetch : {false, true})
+        {
+            double ms = 0;
+            size_t bytes = 0;
+            for (int it = 0; it < iterations; it++)
+            {
+                benchclock::time_point start = benchclock::now();
+                Bsp input(path, backend);
+                if (prefetch)
+                {
+                    input.SetLumpCacheBudget((size_t)1 << 30);
+                    input.PrefetchLumps(all, HEADER_LUMPS, pool);
+                }
+                std::vector<char> data;
+                bytes = 0;
+                for (int n = 0; n < HEADER_LUMPS; n++)
+                {
+                    input.ReadLump(n, data);
+                    bytes += data.size();
+                }
+                PointLeafTree tree;
+                tree.Build(input);
+                input.GetVisMatrix(prefetch ? &pool : nullptr);
+                for (int i = 0; i < input.GetGameLumpCount(); i++)
+                {
+                    input.ReadGameLump(i, data);
+                    bytes += data.size();
+                }
+                ms += ElapsedMs(start);
+            }
+            fprintf(report, "end to end %-10s %-11s %9.3f ms (%.1f MB/s)\n", BackendName(backend), prefetch ? "prefetch" : "no prefetch",
+                ms / iterations, ms > 0 ? (bytes / (1024.0 * 1024.0)) / (ms / iterations / 1000.0) : 0.0);
+            Record(std::string("endtoend.") + BackendName(backend) + (prefetch ? ".prefetch" : ""), ms / iterations);
+        }
+    }
+}
+
+static void WriteJson(FILE *output, const char *path, int iterations) {
+    Bsp input(path, File::BACKEND_STDIO, Bsp::OPEN_HEADER_ONLY);
+    fprintf(output, "{\"map\":\"");
+    for (const char *c = path; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', output);
+        if ((unsigned char)*c >= 0x20)
+            fputc(*c, output);
+    }
+    fprintf(output, "\",\"size\":%zu,\"version\":%d,\"iterations\":%d,\"results\":[", input.GetSize(), input.GetBspVersion(), iterations);
+    for (size_t i = 0; i < results.size(); i++)
+        fprintf(output, "%s\n{\"name\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}", i == 0 ? "" : ",", results[i].name.c_str(), results[i].value, results[i].unit);
+    fprintf(output, "\n]}\n");
+}
+
+int main (int argc, char **argv)
+{
+    BspGenOptions generate;
+    bool generating = false;
+    const char *json_path = nullptr;
+    int option;
+    while ((option = getopt(argc, argv, "g:l:p:s:j:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'g':
+            generating = true;
+            generate.grid_x = generate.grid_y = atoi(optarg);
+            break;
+        case 'l':
+            generate.lightmap_size = atoi(optarg);
+            break;
+        case 'p':
+            generate.pakfile_bytes = (size_t)atoll(optarg) << 20;
+            break;
+        case 's':
+            generate.seed = strtoull(optarg, nullptr, 10);
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        default:
+            printf(USAGE, argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1 && argc - optind != 2)
+    {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+    const char *path = argv[optind];
+    int iterations = argc - optind == 2 ? atoi(argv[optind + 1]) : 5;
+    if (iterations < 1)
+        iterations = 1;
+
+    FILE *json = nullptr;
+    if (json_path != nullptr)
+    {
+        json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (json == nullptr)
+        {
+            perror(json_path);
+            return 1;
+        }
+        if (json == stdout)
+            report = stderr;
+    }
+
+    if (generating)
+    {
+        benchclock::time_point start = benchclock::now();
+        int result = BspGenerator(generate).Write(path);
+        if (result != 0)
+        {
+            fprintf(stderr, result == 1 ? "Invalid generator options\n" : "Couldn't write %s\n", path);
+            return 1;
+        }
+        double ms = ElapsedMs(start);
+        fprintf(report, "generated %dx%d boxes in %9.3f ms\n", generate.grid_x, generate.grid_y, ms);
+        Record("generate", ms);
+    }
+
+    BenchBackend(path, File::BACKEND_STDIO, iterations);
+    BenchBackend(path, File::BACKEND_MMAP_READ, iterations);
+    BenchOpenModes(path, iterations);
+    BenchLumpCache(path, iterations);
+    BenchPointLeaf(path, iterations);
+    BenchEntities(path, iterations);
+    BenchLightmaps(path, iterations);
+    BenchWorldLights(path, iterations);
+    BenchVis(path, iterations);
+    BenchGameLumps(path, iterations);
+    BenchValidate(path, iterations);
+    BenchEndToEnd(path, iterations);
+
+    // The write paths only ever touch the backup made by BenchFile().
+    std::string copy = std::string(path) + ".bench";
+    BenchFile(path, copy, iterations);
+    BenchLumpWrites(copy, iterations);
+    unlink(copy.c_str());
+
+    if (json != nullptr)
+    {
+        WriteJson(json, path, iterations);
+        if (json != stdout)
+            fclose(json);
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#ifndef BSP_AMBIENT_H
+#define BSP_AMBIENT_H
+
+#include <cstring>
+#include "bspdefs.hpp"
+#include "bspversion.hpp"
+#include "instrument.hpp"
+#include "lightmap.hpp"
+#include "pointleaf.hpp"
+#include "threadpool.hpp"
+#include <vector>
+
+// Linear RGB light arriving from the 6 sides, +x -x +y -y +z -z like CompressedLightCube.
+struct AmbientCube
+{
+    float color[6][3];
+};
+
+// Per leaf ambient light for lighting entities, what the engine does for props and models.
+// Every sample of the LUMP_LEAF_AMBIENT_* lumps is decoded once into a flat array next to its world position,
+// a lookup then finds the leaf through a PointLeafTree and blends the samples of the leaf by 1 / (distance^2 + 1)
+// like the engine, so the nearest ones dominate. Maps with version 0 leafs have one cube per leaf instead,
+// which is treated as a single sample at the center of the leaf.
+class AmbientLighting
+{
+private:
+    PointLeafTree tree;
+    std::vector<unsigned int> leaf_samples; // first sample of every leaf, leaf_count + 1 entries
+    std::vector<float> positions;           // x, y, z of every sample
+    std::vector<AmbientCube> cubes;         // decoded colors of every sample
+
+    // The blend of the samples of a leaf, false (and black) if it has none.
+    bool Blend(int leaf, const Vector &point, AmbientCube &out) const {
+        memset(&out, 0, sizeof(AmbientCube));
+        if (leaf < 0 || (size_t)leaf + 1 >= leaf_samples.size())
+            return false;
+        unsigned int first = leaf_samples[leaf], last = leaf_samples[leaf + 1];
+        if (first == last)
+            return false;
+        float total = 0.0f;
+        float *dst = &out.color[0][0];
+        for (unsigned int s = first; s < last; s++)
+        {
+            float dx = positions[s * 3] - point.x, dy = positions[s * 3 + 1] - point.y, dz = positions[s * 3 + 2] - point.z;
+            float factor = 1.0f / (dx * dx + dy * dy + dz * dz + 1.0f);
+            total += factor;
+            const float *src = &cubes[s].color[0][0];
+            for (int c = 0; c < 18; c++)
+                dst[c] += src[c] * factor;
+        }
+        float scale = 1.0f / total;
+        for (int c = 0; c < 18; c++)
+            dst[c] *= scale;
+        return true;
+    }
+
+public:
+    // Decodes the samples of every leaf. index has an entry per leaf, leafs without one have no samples.
+    // The tree for lookups comes from Build(Source&) or GetTree().
+    // Returns 0 on success, 1 if an index entry points outside samples (that leaf is left without samples).
+    int Build(const dleaf_t *leafs, size_t leaf_count, const dleafambientindex_t *index, size_t index_count, const dleafambientlighting_t *samples, size_t sample_count, ThreadPool *pool = nullptr) {
+        BSP_TRACE_SCOPE("AmbientLighting::Build");
+        int result = 0;
+        leaf_samples.assign(leaf_count + 1, 0);
+        std::vector<unsigned int> sources; // sample of the lump for every decoded sample
+        sources.reserve(sample_count);
+        for (size_t l = 0; l < leaf_count; l++)
+        {
+            leaf_samples[l] = (unsigned int)sources.size();
+            if (l >= index_count)
+                continue;
+            size_t first = index[l].firstAmbientSample, count = index[l].ambientSampleCount;
+            if (first + count > sample_count)
+            {
+                result = 1;
+                continue;
+            }
+            for (size_t s = first; s < first + count; s++)
+                sources.push_back((unsigned int)s);
+        }
+        leaf_samples[leaf_count] = (unsigned int)sources.size();
+
+        positions.resize(sources.size() * 3);
+        cubes.resize(sources.size());
+        auto decode = [&](size_t l) {
+            const dleaf_t &leaf = leafs[l];
+            for (unsigned int s = leaf_samples[l]; s < leaf_samples[l + 1]; s++)
+            {
+                const dleafambientlighting_t &sample = samples[sources[s]];
+                const byte fraction[3] = {sample.x, sample.y, sample.z};
+                for (int axis = 0; axis < 3; axis++)
+                    positions[s * 3 + axis] = leaf.mins[axis] + (leaf.maxs[axis] - leaf.mins[axis]) * (fraction[axis] * (1.0f / 255.0f));
+                for (int side = 0; side < 6; side++)
+                    DecodeRGBE(sample.cube.m_Color[side], cubes[s].color[side]);
+            }
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, leaf_count, 256, decode);
+        else
+        {
+            for (size_t l = 0; l < leaf_count; l++)
+                decode(l);
+        }
+        return result;
+    }
+
+    // Builds the tree of the world and decodes the samples of a Bsp or BspSnapshot, the HDR ones if hdr is set and they exist.
+    // Returns 0 on success, 1 if the tree is invalid, 2 if the ambient lumps are.
+    template<typename Source>
+    int Build(Source &bsp, bool hdr = false, ThreadPool *pool = nullptr) {
+        std::vector<dleaf_t> leafs;
+        std::vector<CompressedLightCube> leaf_cubes;
+        std::vector<char> index_data, sample_data;
+        bsp.ReadLeafs(leafs, &leaf_cubes);
+        if (hdr)
+        {
+            bsp.ReadLump(LUMP_LEAF_AMBIENT_INDEX_HDR, index_data);
+            bsp.ReadLump(LUMP_LEAF_AMBIENT_LIGHTING_HDR, sample_data);
+        }
+        if (!hdr || index_data.empty())
+        {
+            bsp.ReadLump(LUMP_LEAF_AMBIENT_INDEX, index_data);
+            bsp.ReadLump(LUMP_LEAF_AMBIENT_LIGHTING, sample_data);
+        }
+
+        std::vector<dleafambientindex_t> index(index_data.size() / sizeof(dleafambientindex_t));
+        std::vector<dleafambientlighting_t> samples(sample_data.size() / sizeof(dleafambientlighting_t));
+        memcpy((void *)index.data(), index_data.data(), index.size() * sizeof(dleafambientindex_t));
+        memcpy((void *)samples.data(), sample_data.data(), samples.size() * sizeof(dleafambientlighting_t));
+        if (index.empty() && !leaf_cubes.empty())
+        {
+            // Version 0 leafs, one sample in the middle of every leaf.
+            index.resize(leafs.size());
+            samples.resize(leafs.size());
+            for (size_t l = 0; l < leafs.size(); l++)
+            {
+                index[l].ambientSampleCount = 1;
+                index[l].firstAmbientSample = (unsigned short)l;
+                samples[l].cube = leaf_cubes[l];
+                samples[l].x = samples[l].y = samples[l].z = 128;
+                samples[l].pad = 0;
+            }
+        }
+
+        if (tree.Build(bsp) != 0)
+            return 1;
+        return Build(leafs.data(), leafs.size(), index.data(), index.size(), samples.data(), samples.size(), pool) != 0 ? 2 : 0;
+    }
+
+    inline PointLeafTree& GetTree() {
+        return tree;
+    }
+
+    inline const PointLeafTree& GetTree() const {
+        return tree;
+    }
+
+    inline size_t GetSampleCount() const {
+        return cubes.size();
+    }
+
+    // Decoded samples of a leaf and their positions (x, y, z each), count is 0 if it has none.
+    inline const AmbientCube* GetLeafSamples(int leaf, size_t &count, const float **sample_positions = nullptr) const {
+        if (leaf < 0 || (size_t)leaf + 1 >= leaf_samples.size())
+        {
+            count = 0;
+            return nullptr;
+        }
+        count = leaf_samples[leaf + 1] - leaf_samples[leaf];
+        if (sample_positions != nullptr)
+            *sample_positions = positions.data() + (size_t)leaf_samples[leaf] * 3;
+        return cubes.data() + leaf_samples[leaf];
+    }
+
+    // Ambient cube at point. Returns false (and a black cube) if its leaf has no samples.
+    bool Sample(const Vector &point, AmbientCube &out) const {
+        return Blend(tree.FindLeaf(point), point, out);
+    }
+
+    // Sample() for count points, leafs found several at a time (PointLeafTree::FindLeaves()), blocks spread over the pool.
+    // Points in leafs without samples get black cubes.
+    void SampleBatch(const Vector *points, size_t count, AmbientCube *out, ThreadPool *pool = nullptr) const {
+        const size_t block = 256;
+        size_t blocks = (count + block - 1) / block;
+        auto sample = [&](size_t b) {
+            int leafs[block];
+            size_t first = b * block, n = count - first < block ? count - first : block;
+            tree.FindLeaves(points + first, n, leafs);
+            for (size_t i = 0; i < n; i++)
+                Blend(leafs[i], points[first + i], out[first + i]);
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, blocks, 1, sample);
+        else
+        {
+            for (size_t b = 0; b < blocks; b++)
+                sample(b);
+        }
+    }
+};
+
+#endif // BSP_AMBIENT_H
@@ -0,0 +1,272 @@
+#pragma once
+
+#ifndef BSP_BRUSHMESH_H
+#define BSP_BRUSHMESH_H
+
+#include <cmath>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include "threadpool.hpp"
+#include <vector>
+
+// One side of a brush as a convex polygon.
+struct BrushPolygon
+{
+    int firstvertex;
+    int numvertices;
+    int firstindex;  // triangle fan over the polygon, numvertices - 2 triangles
+    int numindices;
+    int brush;       // index into LUMP_BRUSHES
+    int side;        // index into LUMP_BRUSHSIDES
+    int texinfo;
+};
+
+// Polygons of every brush, made by clipping each side's plane by the other sides.
+// Vertices are stored as separate x, y and z arrays, polygons wind counter-clockwise seen from the outside.
+// Bevel sides don't get polygons and sides that are clipped away entirely are left out.
+struct BrushMesh
+{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<unsigned int> indices;
+    std::vector<BrushPolygon> polygons;
+
+private:
+    // Same limits as the compile tools.
+    static const int MAX_POINTS_ON_WINDING = 64;
+    static const int MAX_BRUSH_SIDES = 128;
+    static constexpr double MAX_COORD = 65536.0;
+    static constexpr double ON_EPSILON = 0.01;
+
+    struct Winding
+    {
+        int count;
+        double points[MAX_POINTS_ON_WINDING][3];
+    };
+
+    // A big square on the plane, wound counter-clockwise seen from the front.
+    static void BaseWinding(const dplane_t &plane, Winding &w) {
+        double normal[3] = {plane.normal.x, plane.normal.y, plane.normal.z};
+        int axis = 0;
+        for (int i = 1; i < 3; i++)
+        {
+            if (fabs(normal[i]) > fabs(normal[axis]))
+                axis = i;
+        }
+        double up[3] = {0, 0, 0};
+        up[axis == 2 ? 0 : 2] = 1.0;
+        double d = up[0] * normal[0] + up[1] * normal[1] + up[2] * normal[2];
+        for (int i = 0; i < 3; i++)
+            up[i] -= d * normal[i];
+        double length = sqrt(up[0] * up[0] + up[1] * up[1] + up[2] * up[2]);
+        double right[3];
+        for (int i = 0; i < 3; i++)
+            up[i] *= MAX_COORD / length;
+        // right = up x normal, so right, up, normal is right handed.
+        right[0] = up[1] * normal[2] - up[2] * normal[1];
+        right[1] = up[2] * normal[0] - up[0] * normal[2];
+        right[2] = up[0] * normal[1] - up[1] * normal[0];
+
+        w.count = 4;
+        for (int i = 0; i < 3; i++)
+        {
+            double origin = normal[i] * plane.dist;
+            w.points[0][i] = origin - right[i] - up[i];
+            w.points[1][i] = origin + right[i] - up[i];
+            w.points[2][i] = origin + right[i] + up[i];
+            w.points[3][i] = origin - right[i] + up[i];
+        }
+    }
+
+    // Keeps the part of w behind the plane. Returns false if nothing is left.
+    static bool Chop(Winding &w, const dplane_t &plane) {
+        double dists[MAX_POINTS_ON_WINDING + 1];
+        int sides[MAX_POINTS_ON_WINDING + 1];
+        int front = 0, back = 0;
+        for (int i = 0; i < w.count; i++)
+        {
+            dists[i] = w.points[i][0] * plane.normal.x + w.points[i][1] * plane.normal.y + w.points[i][2] * plane.normal.z - plane.dist;
+            sides[i] = dists[i] > ON_EPSILON ? 1 : dists[i] < -ON_EPSILON ? -1 : 0;
+            front += sides[i] == 1;
+            back += sides[i] == -1;
+        }
+        if (front == 0)
+            return true;
+        if (back == 0)
+        {
+            w.count = 0;
+            return false;
+        }
+        dists[w.count] = dists[0];
+        sides[w.count] = sides[0];
+
+        Winding result;
+        result.count = 0;
+        for (int i = 0; i < w.count; i++)
+        {
+            const double *p1 = w.points[i];
+            if (result.count >= MAX_POINTS_ON_WINDING)
+                break;
+            if (sides[i] != 1)
+            {
+                memcpy(result.points[result.count++], p1, sizeof(double[3]));
+                if (sides[i] == 0)
+                    continue;
+            }
+            if (sides[i + 1] == 0 || sides[i + 1] == sides[i] || result.count >= MAX_POINTS_ON_WINDING)
+                continue;
+            const double *p2 = w.points[(i + 1) % w.count];
+            double t = dists[i] / (dists[i] - dists[i + 1]);
+            for (int k = 0; k < 3; k++)
+                result.points[result.count][k] = p1[k] + t * (p2[k] - p1[k]);
+            result.count++;
+        }
+        w = result;
+        return w.count >= 3;
+    }
+
+    // Most vertices the polygons of a brush can have, used to reserve its slice of the output.
+    static size_t VertexBound(const dbrush_t &brush) {
+        size_t per_side = brush.numsides + 4 < MAX_POINTS_ON_WINDING ? brush.numsides + 4 : MAX_POINTS_ON_WINDING;
+        return per_side * brush.numsides;
+    }
+
+    static bool IsValid(const dbrush_t &brush, size_t side_count) {
+        return brush.firstside >= 0 && brush.numsides > 0 && brush.numsides <= MAX_BRUSH_SIDES && (size_t)brush.firstside + brush.numsides <= side_count;
+    }
+
+public:
+    // Builds the polygons of every brush, chunk brushes at a time on the pool if one is given.
+    // Brushes with out of range sides are skipped, sides with out of range planes are ignored.
+    void Build(const dbrush_t *brushes, size_t brush_count, const dbrushside_t *sides, size_t side_count, const dplane_t *planes, size_t plane_count, ThreadPool *pool = nullptr, size_t chunk = 64) {
+        BSP_TRACE_SCOPE("BrushMesh::Build");
+        // Every brush gets a slice big enough for its worst case, found with a prefix sum,
+        // the brushes are clipped straight into their slice and the gaps are squeezed out after.
+        std::vector<size_t> vertex_start(brush_count + 1), polygon_start(brush_count + 1);
+        vertex_start[0] = polygon_start[0] = 0;
+        for (size_t b = 0; b < brush_count; b++)
+        {
+            bool valid = IsValid(brushes[b], side_count);
+            vertex_start[b + 1] = vertex_start[b] + (valid ? VertexBound(brushes[b]) : 0);
+            polygon_start[b + 1] = polygon_start[b] + (valid ? brushes[b].numsides : 0);
+        }
+        x.resize(vertex_start[brush_count]);
+        y.resize(vertex_start[brush_count]);
+        z.resize(vertex_start[brush_count]);
+        polygons.resize(polygon_start[brush_count]);
+        std::vector<int> polygon_count(brush_count, 0);
+
+        auto build = [&](size_t b) {
+            const dbrush_t &brush = brushes[b];
+            if (!IsValid(brush, side_count))
+                return;
+            size_t vertex = vertex_start[b];
+            BrushPolygon *out = &polygons[polygon_start[b]];
+            Winding w;
+            for (int i = 0; i < brush.numsides; i++)
+            {
+                const dbrushside_t &side = sides[brush.firstside + i];
+                if (side.bevel || side.planenum >= plane_count)
+                    continue;
+                BaseWinding(planes[side.planenum], w);
+                bool left = true;
+                for (int j = 0; j < brush.numsides && left; j++)
+                {
+                    const dbrushside_t &other = sides[brush.firstside + j];
+                    if (j == i || other.planenum == side.planenum || other.planenum >= plane_count)
+                        continue;
+                    left = Chop(w, planes[other.planenum]);
+                }
+                if (!left || w.count < 3 || vertex + w.count > vertex_start[b + 1])
+                    continue;
+
+                BrushPolygon &polygon = out[polygon_count[b]++];
+                polygon.firstvertex = (int)vertex;
+                polygon.numvertices = w.count;
+                polygon.brush = (int)b;
+                polygon.side = brush.firstside + i;
+                polygon.texinfo = side.texinfo;
+                for (int k = 0; k < w.count; k++, vertex++)
+                {
+                    x[vertex] = (float)w.points[k][0];
+                    y[vertex] = (float)w.points[k][1];
+                    z[vertex] = (float)w.points[k][2];
+                }
+            }
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, brush_count, chunk, build);
+        else
+        {
+            for (size_t b = 0; b < brush_count; b++)
+                build(b);
+        }
+
+        // Squeeze out the unused parts of the slices, everything only moves towards the front.
+        size_t vertex_count = 0, polygon_total = 0, index_count = 0;
+        for (size_t b = 0; b < brush_count; b++)
+        {
+            for (int p = 0; p < polygon_count[b]; p++)
+            {
+                BrushPolygon polygon = polygons[polygon_start[b] + p];
+                memmove(&x[vertex_count], &x[polygon.firstvertex], polygon.numvertices * sizeof(float));
+                memmove(&y[vertex_count], &y[polygon.firstvertex], polygon.numvertices * sizeof(float));
+                memmove(&z[vertex_count], &z[polygon.firstvertex], polygon.numvertices * sizeof(float));
+                polygon.firstvertex = (int)vertex_count;
+                polygon.firstindex = (int)index_count;
+                polygon.numindices = (polygon.numvertices - 2) * 3;
+                polygons[polygon_total++] = polygon;
+                vertex_count += polygon.numvertices;
+                index_count += polygon.numindices;
+            }
+        }
+        x.resize(vertex_count);
+        y.resize(vertex_count);
+        z.resize(vertex_count);
+        polygons.resize(polygon_total);
+
+        indices.resize(index_count);
+        auto fan = [this](size_t p) {
+            const BrushPolygon &polygon = polygons[p];
+            unsigned int *out = &indices[polygon.firstindex];
+            for (int k = 1; k + 1 < polygon.numvertices; k++)
+            {
+                *out++ = polygon.firstvertex;
+                *out++ = polygon.firstvertex + k;
+                *out++ = polygon.firstvertex + k + 1;
+            }
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, polygons.size(), chunk * 4, fan);
+        else
+        {
+            for (size_t p = 0; p < polygons.size(); p++)
+                fan(p);
+        }
+    }
+
+    // Builds from a Bsp or BspSnapshot, compressed lumps included.
+    template<typename Source>
+    void Build(Source &bsp, ThreadPool *pool = nullptr, size_t chunk = 64) {
+        std::vector<char> brush_data, side_data, plane_data;
+        bsp.ReadLump(LUMP_BRUSHES, brush_data);
+        bsp.ReadLump(LUMP_BRUSHSIDES, side_data);
+        bsp.ReadLump(LUMP_PLANES, plane_data);
+
+        std::vector<dbrush_t> brushes(brush_data.size() / sizeof(dbrush_t));
+        std::vector<dbrushside_t> sides(side_data.size() / sizeof(dbrushside_t));
+        std::vector<dplane_t> planes(plane_data.size() / sizeof(dplane_t));
+        memcpy((void *)brushes.data(), brush_data.data(), brushes.size() * sizeof(dbrush_t));
+        memcpy((void *)sides.data(), side_data.data(), sides.size() * sizeof(dbrushside_t));
+        memcpy((void *)planes.data(), plane_data.data(), planes.size() * sizeof(dplane_t));
+        Build(brushes.data(), brushes.size(), sides.data(), sides.size(), planes.data(), planes.size(), pool, chunk);
+    }
+
+    inline size_t GetVertexCount() const {
+        return x.size();
+    }
+};
+
+#endif // BSP_BRUSHMESH_H
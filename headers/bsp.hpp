@@ -5,6 +5,14 @@
 
 #include "fileio.hpp"
 #include "bspdefs.hpp"
+#include "bspversion.hpp"
+#include "instrument.hpp"
+#include "lumpcache.hpp"
+#include "lzma.hpp"
+#include "threadpool.hpp"
+#include "visibility.hpp"
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <vector>
 #include <iostream>
@@ -15,44 +23,259 @@
 #define CPTRCAST(x, TYPE)   \
     ( *(TYPE *)&x )
 
+// Read-only, bounds-checked view over the elements of a lump. Doesn't own or copy anything.
+// Views that failed the size/alignment checks are empty and IsValid() returns false.
+template<typename T>
+class LumpView
+{
+private:
+    const T *elements;
+    size_t count;
+    bool valid;
+
+public:
+    LumpView() : elements(nullptr), count(0), valid(false) {}
+    LumpView(const T *elements, size_t count) : elements(elements), count(count), valid(true) {}
+
+    // Checks the size and alignment of raw lump bytes against T.
+    static LumpView<T> FromBytes(const char *data, size_t size) {
+        if (data == nullptr && size != 0)
+            return LumpView<T>();
+        if (size % sizeof(T) != 0 || (uintptr_t)data % alignof(T) != 0)
+            return LumpView<T>();
+        return LumpView<T>((const T *)data, size / sizeof(T));
+    }
+
+    inline bool IsValid() const {
+        return valid;
+    }
+
+    inline size_t size() const {
+        return count;
+    }
+
+    inline bool empty() const {
+        return count == 0;
+    }
+
+    inline const T* data() const {
+        return elements;
+    }
+
+    inline const T* begin() const {
+        return elements;
+    }
+
+    inline const T* end() const {
+        return elements + count;
+    }
+
+    // Aborts on an out of range index, use Get() to check instead.
+    inline const T& operator[](size_t index) const {
+        if (index >= count)
+        {
+            fprintf(stderr, "LumpView: index %zu out of range (%zu elements)\n", index, count);
+            abort();
+        }
+        return elements[index];
+    }
+
+    // Returns nullptr if the index is out of range.
+    inline const T* Get(size_t index) const {
+        return index < count ? elements + index : nullptr;
+    }
+};
+
+// Bytes of the lump at offset that are actually in the file: cut at the end of the file,
+// 0 if the offset or length (signed header fields) is negative or the offset is past the end.
+inline size_t ClampLumpLength(const File &file, long long offset, long long length) {
+    if (offset < 0 || length < 0 || (unsigned long long)offset >= file.GetSize())
+        return 0;
+    return std::min((size_t)length, file.GetSize() - (size_t)offset);
+}
+
+// Reads length bytes at offset through the mapping or positional I/O, safe to call from several threads.
+// The range is clamped to the file first, see ClampLumpLength().
+// If compressed is set and the data is a valid lzma lump it gets decompressed, otherwise out holds the raw bytes.
+// Returns true if the data was decompressed.
+inline bool ReadLumpBytes(const File &file, long long offset, long long length, bool compressed, std::vector<char> &out) {
+    length = ClampLumpLength(file, offset, length);
+    offset = length > 0 ? offset : 0;
+    const char *mapped = file.GetMappedData(offset, length);
+    if (mapped != nullptr)
+    {
+        if (compressed && LzmaDecompress(mapped, length, out))
+            return true;
+        out.assign(mapped, mapped + length);
+        return false;
+    }
+
+    out.resize(length);
+    out.resize(file.ReadAt<char>(out.data(), length, offset));
+    if (!compressed)
+        return false;
+    std::vector<char> decompressed;
+    if (!LzmaDecompress(out.data(), out.size(), decompressed))
+        return false;
+    out.swap(decompressed);
+    return true;
+}
+
+// Uncompressed size of the lump at offset, 0 if it isn't lzma compressed.
+inline size_t GetLzmaLumpSize(const File &file, size_t offset, size_t length) {
+    lzma_header_t lzma;
+    if (length < sizeof(lzma_header_t) || file.ReadAt(&lzma, 1, offset) != sizeof(lzma_header_t))
+        return 0;
+    return GetLzmaActualSize((const char *)&lzma, sizeof(lzma_header_t));
+}
+
+// Reads a game lump, decompressing it if it's flagged as compressed.
+// Compressed game lumps store the uncompressed size in filelen, the real size comes from the lzma header.
+inline bool ReadGameLumpBytes(const File &file, const dgamelump_t &gamelump, std::vector<char> &out) {
+    if (!(gamelump.flags & GAMELUMPFLAG_COMPRESSED))
+        return ReadLumpBytes(file, gamelump.fileofs, gamelump.filelen, false, out);
+    lzma_header_t lzma;
+    memset(&lzma, 0, sizeof(lzma_header_t));
+    file.ReadAt(&lzma, 1, gamelump.fileofs);
+    return ReadLumpBytes(file, gamelump.fileofs, sizeof(lzma_header_t) + lzma.lzmaSize, true, out);
+}
+
 // TODO: add more handling for the game lump
-// add handling for different versions from other games
+// The header is kept as lump_t whatever the version, see bspversion.hpp.
 class Bsp : public File
 {
 private:
-    char lump_id;
+    int profile; // BSP_PROFILE_*
+    int lump_id; // -1 when no lump is selected
     lump_t lump;
     size_t lumpdata_size;
     size_t lumpdata_off;
     size_t lumpdata_num;
     size_t lumpdata_remain[2]; // How much remains in the lump that hasnt been read/written yet
     dheader_t *header;
-    dgamelumpheader_t *gameheader;
+    dgamelumpheader_t *gameheader; // nullptr until LoadGameHeader()
+    size_t gamelumps_stored; // How many dgamelump_t actually fit in the game lump
     std::vector<char> lumpdata;
+    const char *lumpptr; // Points into the mapping when mapped, into the cache or lumpdata otherwise
+    char *lumpcopy; // Same as lumpptr when it points into our own copy, nullptr when mapped
+    size_t lumpavail; // Bytes behind lumpptr, less than the lump size if the file is truncated
+    LumpCache cache;
+    bool lumpcompressed; // The selected lump is lzma compressed and lumpptr points to the decompressed data
+    VisMatrix vis; // Decoded on first use, dropped when the vis lump is written
+    bool visdecoded;
+
+    // Points lumpptr at the selected lump, straight into the mapping if possible, then the cache.
+    // Compressed lumps are never used straight from the mapping.
+    void LoadLumpData() {
+        lumpcopy = nullptr;
+        lumpavail = lumpdata_size;
+        lumpptr = lumpcompressed ? nullptr : GetMappedData(lumpdata_off, lumpdata_size);
+        if (lumpptr != nullptr)
+            return;
+
+        std::vector<char> *source = cache.Find(lump_id);
+        if (source == nullptr)
+        {
+            // Reuses the capacity of lumpdata when the cache is off.
+            std::vector<char> data;
+            data.swap(lumpdata);
+            ReadLump(lump_id, data);
+            source = cache.Insert(lump_id, data);
+            if (source == nullptr)
+            {
+                // Cache disabled or bigger than the whole budget.
+                lumpdata.swap(data);
+                source = &lumpdata;
+            }
+        }
+        lumpptr = lumpcopy = source->data();
+        lumpavail = source->size();
+    }
+
+    // Moves the selected lump out of the cache so the cache can drop it.
+    void DetachFromCache() {
+        if (lumpcopy == nullptr || lumpcopy == lumpdata.data())
+            return;
+        lumpdata.assign(lumpptr, lumpptr + lumpavail);
+        lumpptr = lumpcopy = lumpdata.data();
+    }
+
+    // Reads the game lump directory on first use.
+    void LoadGameHeader() {
+        if (gameheader != nullptr)
+            return;
+        BSP_IO_LUMP(LUMP_GAME_LUMP);
+        FlushWrites();
+        // A directory outside the file is read as an empty one.
+        const lump_t &gamelump = header->lumps[LUMP_GAME_LUMP];
+        bool inside = gamelump.fileofs >= 0 && gamelump.filelen >= 0 && (size_t)gamelump.fileofs + (size_t)gamelump.filelen <= GetSize();
+        size_t alloc = inside && gamelump.filelen > (int)sizeof(int) ? gamelump.filelen : sizeof(int);
+        char *data = new char[alloc];
+        memset(data, 0, alloc);
+        if (inside)
+            ReadAt<char>(data, std::min(alloc, (size_t)gamelump.filelen), gamelump.fileofs);
+        gameheader = (dgamelumpheader_t *)data;
+        gamelumps_stored = (alloc - sizeof(int)) / sizeof(dgamelump_t);
+    }
+
+    // Positional reads (ReadAt()) bypass the stdio buffer, pending Write()s have to reach the file first.
+    inline void FlushWrites() {
+        if (!IsMapped())
+            Flush();
+    }
+
+    inline void DropVisMatrix() {
+        vis.Clear();
+        visdecoded = false;
+    }
+
+    // Keeps our copy of the selected lump in sync with what was written to the file.
+    void PatchLumpCopy(size_t offset, const void *buffer, size_t bytes) {
+        if (lump_id == LUMP_VISIBILITY && bytes > 0)
+            DropVisMatrix();
+        if (lumpcopy != nullptr && offset <= lumpavail && bytes <= lumpavail - offset)
+            memcpy(lumpcopy + offset, buffer, bytes);
+    }
 
 public:
-    Bsp(const char *__restrict__ path) : File(path)
+    // Open modes for the constructor.
+    enum
+    {
+        OPEN_EAGER = 0,       // Reads the game lump directory and selects the entity lump right away
+        OPEN_HEADER_ONLY = 1, // Only reads the header, no lump is selected and the game lump directory is read on first use
+    };
+
+    // With one of the mmap backends lumps are never copied, GetLumpData() points straight into the file.
+    Bsp(const char *__restrict__ path, int backend = BACKEND_STDIO, int open_mode = OPEN_EAGER) : File(path, backend)
     {
+        BSP_TRACE_SCOPE("Bsp::Bsp");
         header = new dheader_t;
-        Read(header);
-        SetReadPtr(header->lumps[LUMP_GAME_LUMP].fileofs);
-        gameheader = (dgamelumpheader_t *)(new char[header->lumps[LUMP_GAME_LUMP].filelen]);
-        Read<char>((char *)gameheader, header->lumps[LUMP_GAME_LUMP].filelen);
-        RevertReadPtr();
-        lump_id = LUMP_ENTITIES;
-        lump = header->lumps[LUMP_ENTITIES];
-        lumpdata_off = lump.fileofs;
-        lumpdata_remain[READ] = lumpdata_remain[WRITE] = lumpdata_num = lumpdata_size = lump.filelen;
-        SetReadPtr(lumpdata_off);
-        lumpdata.reserve(lumpdata_size);
-        Read(lumpdata.data(), lumpdata_size);
-        RevertReadPtr();
+        memset(header, 0, sizeof(dheader_t));
+        ReadAt(header, 1, 0);
+        profile = DetectBspProfile(*header, GetSize());
+        NormalizeBspHeader(*header, profile);
+        gameheader = nullptr;
+        gamelumps_stored = 0;
+        lump_id = -1;
+        memset(&lump, 0, sizeof(lump_t));
+        lumpdata_off = 0;
+        lumpdata_remain[READ] = lumpdata_remain[WRITE] = lumpdata_num = lumpdata_size = 0;
+        lumpptr = lumpcopy = nullptr;
+        lumpavail = 0;
+        lumpcompressed = false;
+        visdecoded = false;
+        if (open_mode == OPEN_HEADER_ONLY)
+            return;
+
+        LoadGameHeader();
+        SelectLump<char>(LUMP_ENTITIES);
+        RevertWritePtr();
     }
 
     ~Bsp()
     {
         delete header;
-        delete gameheader;
+        delete[] (char *)gameheader;
         header = nullptr;
         gameheader = nullptr;
         lumpdata_size = 0;
@@ -67,19 +290,34 @@ public:
         return header->ident;
     }
 
+    // BSP_PROFILE_* detected from the header.
+    inline int GetProfile() const {
+        return profile;
+    }
+
     // Always use this before interacting with the bsp.
-    // By default, the chosen lump is the entity lump.
+    // By default, the chosen lump is the entity lump (no lump is chosen with OPEN_HEADER_ONLY).
+    // Compressed lumps are decompressed transparently (with BSP_ENABLE_LZMA), the sizes and elements are then
+    // those of the decompressed data, and ReadLumpElements()/WriteLumpElements() don't work on them.
     template<typename T>
     void SelectLump(char n) {
+        BSP_TRACE_SCOPE_LUMP("Bsp::SelectLump", n);
+        FlushWrites();
         lump_id = n;
         lump = header->lumps[n];
-        lumpdata_size = lump.filelen;
+        lumpdata_size = lump.filelen > 0 ? lump.filelen : 0;
         lumpdata_off = lump.fileofs;
+        lumpcompressed = false;
+        if (lump.compressed != 0 && IsLzmaAvailable())
+        {
+            size_t actual = GetLzmaLumpSize(*this, lumpdata_off, lumpdata_size);
+            lumpcompressed = actual != 0 && actual <= GetLzmaSizeLimit(); // Bigger ones are never decompressed
+            if (lumpcompressed)
+                lumpdata_size = actual;
+        }
         lumpdata_num = lumpdata_size / sizeof(T);
-        lumpdata_remain[READ] = lumpdata_remain[WRITE] = lumpdata_size;
-        SetReadPtr(lumpdata_off);
-        lumpdata.reserve(lumpdata_size);
-        Read<char>(lumpdata.data(), lumpdata_size);
+        lumpdata_remain[READ] = lumpdata_remain[WRITE] = lumpcompressed ? 0 : lumpdata_size;
+        LoadLumpData();
         SetReadPtr(lumpdata_off);
         SetWritePtr(lumpdata_off);
     }
@@ -88,6 +326,12 @@ public:
         return lumpdata_size;
     }
 
+    // Raw bytes of the selected lump, GetLumpDataSize() bytes long.
+    // Zero-copy with the mmap backends, otherwise only valid until the next SelectLump().
+    inline const char* GetLumpData() const {
+        return lumpptr;
+    }
+
     inline int GetElementCount() const {
         return lumpdata_num;
     }
@@ -99,6 +343,7 @@ public:
     // This does increase the read pointer by the correct amount.
     template<typename T>
     size_t ReadLumpElements(const T *buffer, size_t elements = 1, size_t offset = 0) {
+        BSP_IO_LUMP(lump_id);
         size_t elem_remain = lumpdata_remain[READ] / sizeof(T);
         offset = CLAMP(offset, 0, elem_remain);
         elements = CLAMP(elements, 0, elem_remain - offset);
@@ -109,16 +354,19 @@ public:
 
     // Offset is calculated by sizeof(T) * offset, its not in raw bytes.
     // Elements is the number of elements, this function is meant to be used with arrays.
-    // Automaticly rewrites the lump if the size (in bytes) of the written elements is different from the size of the previous elements.
+    // Can't change the size of the lump, use BspRelayout (relayout.hpp) for that.
     // Returns the amount of bytes written.
     // Value can be less than expected since this function will make sure to not write data outside of the range of the lump.
     // This does increase the write pointer by the correct amount.
     template<typename T>
     size_t WriteLumpElements(const T *buffer, size_t elements = 1, size_t offset = 0) {
+        BSP_IO_LUMP(lump_id);
         size_t elem_remain = lumpdata_remain[WRITE] / sizeof(T);
         offset = CLAMP(offset, 0, elem_remain);
         elements = CLAMP(elements, 0, elem_remain - offset);
+        size_t lump_offset = GetWritePtr() + offset * sizeof(T) - lumpdata_off;
         size_t written = Write(buffer, elements, offset);
+        PatchLumpCopy(lump_offset, buffer, written);
         lumpdata_remain[WRITE] -= written;
         return written;
     }
@@ -143,12 +391,124 @@ public:
         return lump.compressed;
     }
 
+    // True if lump n is lzma compressed, whether or not lzma support is enabled.
+    bool IsLumpCompressed(int n) const {
+        if (n < 0 || n >= HEADER_LUMPS || header->lumps[n].compressed == 0)
+            return false;
+        return GetLzmaLumpSize(*this, header->lumps[n].fileofs, header->lumps[n].filelen) != 0;
+    }
+
+    // Reads the whole lump n (decompressed) without selecting it or touching the read pointer.
+    // Returns false if the lump is compressed but couldn't be decompressed, out then holds the raw bytes.
+    bool ReadLump(int n, std::vector<char> &out) {
+        if (n < 0 || n >= HEADER_LUMPS)
+        {
+            out.clear();
+            return false;
+        }
+        BSP_TRACE_SCOPE_LUMP("Bsp::ReadLump", n);
+        FlushWrites();
+        const lump_t &target = header->lumps[n];
+        bool compressed = target.compressed != 0;
+        if (!IsMapped())
+            count[READ] += target.filelen;
+        return ReadLumpBytes(*this, target.fileofs, target.filelen, compressed, out) || !compressed || !IsLumpCompressed(n);
+    }
+
+    // Reads the leafs whatever their layout, see ReadBspLeafs(). Returns false if the lump couldn't be read.
+    bool ReadLeafs(std::vector<dleaf_t> &leafs, std::vector<CompressedLightCube> *ambient = nullptr) {
+        std::vector<char> data;
+        bool ok = ReadLump(LUMP_LEAFS, data);
+        ReadBspLeafs(data.data(), data.size(), profile, header->lumps[LUMP_LEAFS].version, leafs, ambient);
+        return ok;
+    }
+
+    // Reads the faces whatever their layout. Returns false if the lump couldn't be read.
+    bool ReadFaces(std::vector<dface_t> &faces) {
+        std::vector<char> data;
+        bool ok = ReadLump(LUMP_FACES, data);
+        ReadBspFaces(data.data(), data.size(), profile, faces);
+        return ok;
+    }
+
+    // Loads several lumps into the lump cache at once. Raw reads happen on this thread in file order,
+    // compressed lumps are then decompressed in parallel on the pool.
+    // Needs the lump cache (SetLumpCacheBudget()). Returns how many of the lumps are cached afterwards.
+    size_t PrefetchLumps(const int *lumps, size_t lump_count, ThreadPool &pool) {
+        if (!cache.IsEnabled())
+            return 0;
+        BSP_TRACE_SCOPE("Bsp::PrefetchLumps");
+        FlushWrites();
+
+        std::vector<int> todo;
+        for (size_t i = 0; i < lump_count; i++)
+        {
+            int n = lumps[i];
+            if (n < 0 || n >= HEADER_LUMPS || cache.Peek(n) != nullptr)
+                continue;
+            if (IsMapped() && !IsLumpCompressed(n))
+                continue; // Already zero-copy
+            todo.push_back(n);
+        }
+        std::sort(todo.begin(), todo.end(), [this](int a, int b) {
+            return header->lumps[a].fileofs < header->lumps[b].fileofs;
+        });
+        todo.erase(std::unique(todo.begin(), todo.end()), todo.end());
+
+        std::vector<std::vector<char>> data(todo.size());
+        std::vector<char> compressed(todo.size(), 0);
+        for (size_t i = 0; i < todo.size(); i++)
+        {
+            const lump_t &target = header->lumps[todo[i]];
+            compressed[i] = target.compressed != 0;
+            if (IsMapped())
+                continue;
+            BSP_IO_LUMP(todo[i]);
+            size_t length = ClampLumpLength(*this, target.fileofs, target.filelen);
+            data[i].resize(length);
+            data[i].resize(ReadAt<char>(data[i].data(), length, length > 0 ? target.fileofs : 0));
+            count[READ] += data[i].size();
+        }
+
+        pool.ParallelFor(0, todo.size(), 1, [&](size_t i) {
+            const lump_t &target = header->lumps[todo[i]];
+            const char *raw = IsMapped() ? GetMappedData(target.fileofs, target.filelen) : data[i].data();
+            size_t raw_size = IsMapped() ? target.filelen : data[i].size();
+            // Mapped lumps outside the file stay empty.
+            if (raw == nullptr)
+                return;
+            std::vector<char> decompressed;
+            if (compressed[i] && LzmaDecompress(raw, raw_size, decompressed))
+                data[i].swap(decompressed);
+            else if (IsMapped())
+                data[i].assign(raw, raw + raw_size);
+        });
+
+        size_t cached = 0;
+        for (size_t i = 0; i < todo.size(); i++)
+            cache.Insert(todo[i], data[i], lumpcopy != nullptr ? lump_id : -1);
+        for (size_t i = 0; i < lump_count; i++)
+        {
+            if (lumps[i] >= 0 && lumps[i] < HEADER_LUMPS && cache.Peek(lumps[i]) != nullptr)
+                cached++;
+        }
+        return cached;
+    }
+
     // Overwrite the currently selected lump with a new one.
     void SetLump(const lump_t& new_lump) {
+        if (lump_id < 0)
+            return;
         SetWritePtr((ssize_t)(&((dheader_t*)0)->lumps[lump_id])); // offsetof(dheader_t, lumps[lump_id])
         lump = new_lump;
-        Write(&new_lump, sizeof(lump_t));
+        lump_t encoded;
+        EncodeBspLump(new_lump, profile, &encoded);
+        Write(&encoded);
         RevertWritePtr();
+        DetachFromCache();
+        cache.Invalidate(lump_id);
+        if (lump_id == LUMP_VISIBILITY)
+            DropVisMatrix();
     }
 
     // Returns the currently selected lump.
@@ -156,13 +516,25 @@ public:
         return lump;
     }
 
+    // Returns the lump_t entry of lump n from the header without selecting it, zeroed if n is out of range.
+    inline lump_t GetLump(int n) const {
+        lump_t result;
+        memset(&result, 0, sizeof(lump_t));
+        if (n >= 0 && n < HEADER_LUMPS)
+            result = header->lumps[n];
+        return result;
+    }
+
     // Basicly equivalent to WriteLumpElements<T>(buffer, 1, index) except it can go backwards and it doesnt change the write pointer.
     // Clamps the index to a valid range.
     template<typename T>
     void SetLumpElement(const T& new_elem, size_t index) {
-        index = CLAMP(index, 0, lumpdata_num);
+        if (lumpdata_num == 0)
+            return;
+        index = CLAMP(index, 0, lumpdata_num - 1);
+        BSP_IO_LUMP(lump_id);
         SetWritePtr(lumpdata_off + index * sizeof(T));
-        Write(new_elem, sizeof(T));
+        PatchLumpCopy(index * sizeof(T), &new_elem, Write(&new_elem));
         RevertWritePtr();
     }
 
@@ -170,30 +542,100 @@ public:
     // Clamps the index to a valid range.
     template<typename T>
     T GetLumpElement(size_t index) {
-        index = CLAMP(index, 0, lumpdata_num);
+        T elem = T();
+        if (lumpdata_num == 0)
+            return elem;
+        index = CLAMP(index, 0, lumpdata_num - 1);
+        if (index * sizeof(T) + sizeof(T) <= lumpavail)
+        {
+            // The mapping or our in-sync copy of the lump, no file access.
+            memcpy(&elem, lumpptr + index * sizeof(T), sizeof(T));
+            return elem;
+        }
+        BSP_IO_LUMP(lump_id);
         SetReadPtr(lumpdata_off + index * sizeof(T));
-        T elem;
-        Read(&elem, sizeof(T));
+        Read(&elem);
         RevertReadPtr();
         return elem;
     }
 
-    // This function can be pretty slow.
+    // View over the selected lump, allocates nothing.
+    // Only valid until the next SelectLump() unless the file is mapped.
+    template<typename T>
+    LumpView<T> GetLumpView() const {
+        return LumpView<T>::FromBytes(lumpptr, lumpavail);
+    }
+
+    // View over any lump without selecting it, straight into the mapping.
+    // Without a mapping this only works for the selected lump and lumps in the cache (valid until the next SelectLump()),
+    // other lumps give an invalid view.
+    template<typename T>
+    LumpView<T> GetLumpView(int n) const {
+        if (n < 0 || n >= HEADER_LUMPS)
+            return LumpView<T>();
+        const lump_t &target = header->lumps[n];
+        if (IsMapped() && !(n == lump_id && lumpcompressed) && !IsLumpCompressed(n))
+            return LumpView<T>::FromBytes(GetMappedData(target.fileofs, target.filelen), target.filelen);
+        if (n == lump_id)
+            return GetLumpView<T>();
+        const std::vector<char> *cached = cache.Peek(n);
+        if (cached != nullptr)
+            return LumpView<T>::FromBytes(cached->data(), cached->size());
+        return LumpView<T>();
+    }
+
+    // Keeps up to bytes of lumps in memory so selecting them again doesn't read the file,
+    // least recently used lumps are dropped first. 0 (the default) disables the cache.
+    // With the mmap backends only compressed lumps go through the cache, the others are never copied.
+    void SetLumpCacheBudget(size_t bytes) {
+        DetachFromCache();
+        cache.SetBudget(bytes);
+    }
+
+    // Budget, usage and hit/miss counters of the lump cache.
+    inline const LumpCache& GetLumpCache() const {
+        return cache;
+    }
+
+    inline void ResetLumpCacheCounters() {
+        cache.ResetCounters();
+    }
+
+    // This function can be pretty slow, GetLumpView() doesn't copy anything.
     // May not work correctly with lumps that use variable length structures.
     template<typename T>
     std::vector<T> GetAllLumpElements() {
         std::vector<T> result(lumpdata_num);
         // TODO: replace this.
-        memcpy(result.data(), lumpdata.data(), lumpdata_size);
+        memcpy(result.data(), lumpptr, std::min(lumpdata_num * sizeof(T), lumpavail));
         return result;
     }
 
     // Returns the byte offsets of the PVS and the PAS inside the vis lump.
+    // The cluster count is clamped to the offsets that fit in the lump, offsets aren't checked (see BspValidator).
     std::vector<int[2]> GetVisData() {
-        int visnum = -1;
-
-        SetReadPtr(header->lumps[LUMP_VISIBILITY].fileofs);
+        BSP_IO_LUMP(LUMP_VISIBILITY);
+        const lump_t &target = header->lumps[LUMP_VISIBILITY];
+        int visnum = 0;
+
+        // Compressed vis has to be decompressed whole, empty if it can't be.
+        if (target.compressed != 0 && IsLumpCompressed(LUMP_VISIBILITY))
+        {
+            std::vector<char> data;
+            if (!ReadLump(LUMP_VISIBILITY, data) || data.size() < sizeof(int))
+                return std::vector<int[2]>();
+            memcpy(&visnum, data.data(), sizeof(int));
+            visnum = CLAMP(visnum, 0, (int)((data.size() - sizeof(int)) / sizeof(int[2])));
+            std::vector<int[2]> result(visnum);
+            memcpy(result.data(), data.data() + sizeof(int), visnum * sizeof(int[2]));
+            return result;
+        }
+        if (target.filelen < (int)sizeof(int))
+            return std::vector<int[2]>();
+
+        SetReadPtr(target.fileofs);
         Read(&visnum);
+        visnum = CLAMP(visnum, 0, (int)((target.filelen - sizeof(int)) / sizeof(int[2])));
 
         std::vector<int[2]> result(visnum);
         Read<int[2]>(result.data(), visnum);
@@ -202,10 +644,27 @@ public:
 
         return result;
     }
-    // TODO: add method to decompress the PVS and PAS
+
+    // The PVS and PAS of every cluster as bit matrices, decoded (on the pool if given) on first use.
+    // Stays valid until the vis lump is written to.
+    const VisMatrix& GetVisMatrix(ThreadPool *pool = nullptr) {
+        if (visdecoded)
+            return vis;
+        std::vector<char> data;
+        ReadLump(LUMP_VISIBILITY, data);
+        vis.Decode(data.data(), data.size(), pool);
+        visdecoded = true; // Even if it failed, a broken lump stays empty instead of being decoded over and over
+        return vis;
+    }
+
+    // Whether cluster to is in the PVS of cluster from, see GetVisMatrix().
+    inline bool IsClusterVisible(int from, int to) {
+        return GetVisMatrix().IsClusterVisible(from, to);
+    }
 
     // Returns the number of visclusters
     int GetVisClusterCount() {
+        BSP_IO_LUMP(LUMP_VISIBILITY);
         int visnum = -1;
 
         SetReadPtr(header->lumps[LUMP_VISIBILITY].fileofs);
@@ -217,12 +676,38 @@ public:
 
     // Returns the number of gamelumps inside the bsp
     int GetGameLumpCount() {
-        return gameheader->lumpCount;
+        LoadGameHeader();
+        return CLAMP(gameheader->lumpCount, 0, (int)gamelumps_stored);
+    }
+
+    // Reads the contents of game lump index (into GetAllGameLumps()), decompressed if it's compressed.
+    // Returns false if the index is out of range or the game lump couldn't be read.
+    bool ReadGameLump(int index, std::vector<char> &out) {
+        out.clear();
+        if (index < 0 || index >= GetGameLumpCount())
+            return false;
+        BSP_TRACE_SCOPE_LUMP("Bsp::ReadGameLump", LUMP_GAME_LUMP);
+        FlushWrites();
+        const dgamelump_t &gamelump = gameheader->gamelump[index];
+        bool decompressed = ReadGameLumpBytes(*this, gamelump, out);
+        return decompressed || !(gamelump.flags & GAMELUMPFLAG_COMPRESSED);
+    }
+
+    // Index of the game lump with id (PROP_STATIC, ...), -1 if there is none.
+    int FindGameLump(int id) {
+        int count = GetGameLumpCount();
+        for (int i = 0; i < count; i++)
+        {
+            if (gameheader->gamelump[i].id == id)
+                return i;
+        }
+        return -1;
     }
 
     // Returns all the gamelumps inside the bsp.
     std::vector<dgamelump_t> GetAllGameLumps() {
-        return std::vector<dgamelump_t>(&gameheader->gamelump[0], &gameheader->gamelump[0] + gameheader->lumpCount);
+        int count = GetGameLumpCount();
+        return std::vector<dgamelump_t>(&gameheader->gamelump[0], &gameheader->gamelump[0] + count);
     }
 };
 
@@ -2,6 +2,8 @@
 #ifndef BSP_DEFINITIONS_H
 #define BSP_DEFINITIONS_H
 
+#include <cstring>
+
 #define HEADER_LUMPS 64
 #define IDBSPHEADER	(('P'<<24)+('S'<<16)+('B'<<8)+'V')
 #define IDPSBHEADER	('P'+('S'<<8)+('B'<<16)+('V'<<24))
@@ -116,7 +118,7 @@ struct lump_l4d2_t
     operator lump_t() const;
 };
 
-lump_t::operator lump_l4d2_t() const {
+inline lump_t::operator lump_l4d2_t() const {
     lump_l4d2_t result;
     result.version = version;
     result.fileofs = fileofs;
@@ -125,7 +127,7 @@ lump_t::operator lump_l4d2_t() const {
     return result;
 }
 
-lump_l4d2_t::operator lump_t() const {
+inline lump_l4d2_t::operator lump_t() const {
     lump_t result;
     result.version = version;
     result.fileofs = fileofs;
@@ -142,6 +144,8 @@ struct dheader_t
 	int     mapRevision;
 };
 
+#define GAMELUMPFLAG_COMPRESSED 0x0001 // dgamelump_t::flags, the game lump is lzma compressed
+
 struct dgamelump_t
 {
 	int             id;
@@ -200,6 +204,32 @@ struct dface_t
 	unsigned int    smoothingGroups;        // lightmap smoothing group
 };
 
+// dbrush_t::contents and dleaf_t::contents flags (the common ones).
+enum
+{
+    CONTENTS_EMPTY = 0,
+    CONTENTS_SOLID = 0x1,
+    CONTENTS_WINDOW = 0x2,
+    CONTENTS_GRATE = 0x8,
+    CONTENTS_SLIME = 0x10,
+    CONTENTS_WATER = 0x20,
+    CONTENTS_OPAQUE = 0x80,
+    CONTENTS_MOVEABLE = 0x4000,
+    CONTENTS_PLAYERCLIP = 0x10000,
+    CONTENTS_MONSTERCLIP = 0x20000,
+    CONTENTS_MONSTER = 0x2000000,
+    CONTENTS_DEBRIS = 0x4000000,
+    CONTENTS_DETAIL = 0x8000000,
+    CONTENTS_TRANSLUCENT = 0x10000000,
+    CONTENTS_LADDER = 0x20000000,
+};
+
+#define MASK_ALL            (0xFFFFFFFF)
+#define MASK_SOLID          (CONTENTS_SOLID|CONTENTS_MOVEABLE|CONTENTS_WINDOW|CONTENTS_MONSTER|CONTENTS_GRATE)
+#define MASK_PLAYERSOLID    (MASK_SOLID|CONTENTS_PLAYERCLIP)
+#define MASK_NPCSOLID       (MASK_SOLID|CONTENTS_MONSTERCLIP)
+#define MASK_WATER          (CONTENTS_WATER|CONTENTS_SLIME)
+
 struct dbrush_t
 {
 	int    firstside;     // first brushside
@@ -242,8 +272,7 @@ struct dleaf_t
 	unsigned short  numleafbrushes;
 	short           leafWaterDataID;      // -1 for not in water
 
-	//!!! NOTE: for lump version 0 (usually in maps of version 19 or lower) uncomment the next line
-	//CompressedLightCube   ambientLighting;      // Precaculated light info for entities.
+	// lump version 0 (usually in maps of version 19 or lower) has the ambient lighting here, see dleaf_v0_t
 	short                 padding;              // padding to 4-byte boundary
 };
 
@@ -258,6 +287,19 @@ struct texinfo_t
 	int     texdata;              // Pointer to texture name, size, etc.
 };
 
+// texinfo_t::flags (the ones that matter for lighting).
+enum
+{
+    SURF_LIGHT = 0x1,
+    SURF_SKY2D = 0x2,
+    SURF_SKY = 0x4,
+    SURF_NODRAW = 0x80,
+    SURF_NOLIGHT = 0x400,
+    SURF_BUMPLIGHT = 0x800, // 3 more lightmaps per style for the bump basis
+};
+
+#define MAXLIGHTMAPS 4 // dface_t::styles, 255 marks the end
+
 struct dtexdata_t
 {
 	Vector  reflectivity;            // RGB reflectivity
@@ -312,67 +354,8 @@ struct QAngle
 // I have no idea how to decode this struct
 typedef int color32;
 
-// In the bsp, this struct is preceeded by an int which dictates how many of the following struct are going to be present.
-struct StaticPropLump_t
-{
-	// v4
-	Vector          Origin;            // origin
-	QAngle          Angles;            // orientation (pitch yaw roll)
-	
-	// v4
-	unsigned short  PropType;          // index into model name dictionary
-	unsigned short  FirstLeaf;         // index into leaf array
-	unsigned short  LeafCount;
-	unsigned char   Solid;             // solidity type
-#if PROP_VERSION != 7
-	// every version except v7*
-	unsigned char   Flags;
-#endif
-	// v4 still
-	int             Skin;              // model skin numbers
-	float           FadeMinDist;
-	float           FadeMaxDist;
-	Vector          LightingOrigin;    // for lighting
-#if PROP_VERSION >= 5
-	// since v5
-	float           ForcedFadeScale;   // fade distance scale
-#endif
-#if PROP_VERSION == 6 || PROP_VERSION == 7
-	// v6, v7, and v7* only
-	unsigned short  MinDXLevel;        // minimum DirectX version to be visible
-	unsigned short  MaxDXLevel;        // maximum DirectX version to be visible
-#endif
-#if PROP_VERSION == 7
-	// v7* only
-	unsigned int    Flags;
-	unsigned short  LightmapResX;      // lightmap image width
-	unsigned short	LightmapResY;      // lightmap image height
-#endif
-#if PROP_VERSION >= 8
-	// since v8
-	unsigned char   MinCPULevel;
-	unsigned char   MaxCPULevel;
-	unsigned char   MinGPULevel;
-	unsigned char   MaxGPULevel;
-#endif
-#if PROP_VERSION >= 7
-	// since v7
-	color32         DiffuseModulation; // per instance color and alpha modulation
-#endif
-#if PROP_VERSION == 9 || PROP_VERSION == 10
-	// v9 and v10 only
-	bool            DisableX360;       // if true, don't show on XBox 360 (4-bytes long)
-#endif
-#if PROP_VERSION >= 10
-	// since v10
-	unsigned int    FlagsEx;           // Further bitflags.
-#endif
-#if PROP_VERSION >= 11
-	// since v11
-	float           UniformScale;      // Prop scale
-#endif
-};
-
+// The sprp game lump is the dictionary, the leaf array and then an int which dictates how many props follow.
+// The layout of the props depends on the game lump version, see headers/staticprops.hpp.
 struct StaticPropLumpV4_t
 {
 	// v4
@@ -446,6 +429,8 @@ struct StaticPropLumpV7_t
 	unsigned short  FirstLeaf;         // index into leaf array
 	unsigned short  LeafCount;
 	unsigned char   Solid;             // solidity type
+	// every version except v7*
+	unsigned char   Flags;
 	// v4 still
 	int             Skin;              // model skin numbers
 	float           FadeMinDist;
@@ -496,6 +481,8 @@ struct StaticPropLumpV8_t
 	unsigned short  FirstLeaf;         // index into leaf array
 	unsigned short  LeafCount;
 	unsigned char   Solid;             // solidity type
+	// every version except v7*
+	unsigned char   Flags;
 	// v4 still
 	int             Skin;              // model skin numbers
 	float           FadeMinDist;
@@ -521,6 +508,8 @@ struct StaticPropLumpV9_t
 	unsigned short  FirstLeaf;         // index into leaf array
 	unsigned short  LeafCount;
 	unsigned char   Solid;             // solidity type
+	// every version except v7*
+	unsigned char   Flags;
 	// v4 still
 	int             Skin;              // model skin numbers
 	float           FadeMinDist;
@@ -548,6 +537,8 @@ struct StaticPropLumpV10_t
 	unsigned short  FirstLeaf;         // index into leaf array
 	unsigned short  LeafCount;
 	unsigned char   Solid;             // solidity type
+	// every version except v7*
+	unsigned char   Flags;
 	// v4 still
 	int             Skin;              // model skin numbers
 	float           FadeMinDist;
@@ -577,6 +568,8 @@ struct StaticPropLumpV11_t
 	unsigned short  FirstLeaf;         // index into leaf array
 	unsigned short  LeafCount;
 	unsigned char   Solid;             // solidity type
+	// every version except v7*
+	unsigned char   Flags;
 	// v4 still
 	int             Skin;              // model skin numbers
 	float           FadeMinDist;
@@ -634,6 +627,24 @@ struct CompressedLightCube
 	ColorRGBExp32 m_Color[6];
 };
 
+// dleaf_t of lump version 0, read through ReadBspLeafs() (bspversion.hpp).
+struct dleaf_v0_t
+{
+	int             contents;
+	short           cluster;
+	short           area:9;
+	short           flags:7;
+	short           mins[3];
+	short           maxs[3];
+	unsigned short  firstleafface;
+	unsigned short  numleaffaces;
+	unsigned short  firstleafbrush;
+	unsigned short  numleafbrushes;
+	short           leafWaterDataID;
+	CompressedLightCube   ambientLighting;      // Precaculated light info for entities.
+	short                 padding;              // padding to 4-byte boundary
+};
+
 struct dleafambientlighting_t
 {
 	CompressedLightCube	cube;
@@ -723,6 +734,28 @@ struct dworldlight_t
 	int		owner;			// entity that this light it relative to
 };
 
+// dworldlight_t of lump version 1 (newer branches), read through ReadWorldLights() (worldlights.hpp).
+struct dworldlight_v1_t
+{
+	Vector		origin;
+	Vector		intensity;
+	Vector		normal;
+	Vector		shadow_cast_offset;
+	int		cluster;
+	emittype_t	type;
+	int		style;
+	float		stopdot;
+	float		stopdot2;
+	float		exponent;
+	float		radius;
+	float		constant_attn;
+	float		linear_attn;
+	float		quadratic_attn;
+	int		flags;
+	int		texinfo;
+	int		owner;
+};
+
 struct dDispVert
 {
 	Vector  vec;    // Vector field defining displacement volume.
@@ -0,0 +1,505 @@
+#pragma once
+
+#ifndef BSP_BSPGEN_H
+#define BSP_BSPGEN_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "deflate.hpp"
+#include "pakfile.hpp"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// What BspGenerator writes. The defaults give a small map, grid, lightmaps and the pakfile scale it up.
+struct BspGenOptions
+{
+    int grid_x = 16;             // boxes along x and y, each a brush with 6 faces, a leaf and a vis cluster
+    int grid_y = 16;             // at most 127 each and 8191 boxes (16 bit vertex indices in dedge_t)
+    int version = 20;            // 19 (version 0 leafs with their ambient cube), 20 or 21
+    int lightmap_size = 4;       // luxels along each side of every face lightmap, 1 to 32
+    int lightmap_styles = 1;     // 1 to MAXLIGHTMAPS
+    size_t pakfile_bytes = 0;    // random stored files in the pakfile, 64 MB each
+    uint64_t seed = 1;
+};
+
+// Writes a synthetic but consistent bsp: a grid of boxes with their brushes, planes, faces and edges,
+// a bsp tree with one leaf per box, run-length encoded PVS/PAS, lighting, ambient samples, worldlights,
+// entities, a static prop per box (sprp v10) and a stored pakfile.
+// The output only depends on the options. Lumps are written one after the other and the pakfile in chunks,
+// so big maps don't have to fit in memory. Offsets are ints, so the whole file has to stay below 2 GB.
+class BspGenerator
+{
+private:
+    static const int BOX_SPACING = 256;
+    static const int BOX_SIZE = 128;
+    static constexpr size_t PAK_CHUNK = 64u << 20;
+
+    BspGenOptions options;
+
+    // splitmix64, the same sequence on every platform.
+    struct Random
+    {
+        uint64_t state;
+
+        explicit Random(uint64_t seed) : state(seed) {}
+
+        inline uint64_t Next() {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        inline int Range(int low, int high) {
+            return low + (int)(Next() % (uint64_t)(high - low));
+        }
+    };
+
+    template<typename T>
+    static void Append(std::vector<char> &out, const T &value) {
+        const char *bytes = (const char *)&value;
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    static ColorRGBExp32 RandomSample(Random &random, int min_exponent, int max_exponent) {
+        ColorRGBExp32 sample;
+        sample.r = (byte)random.Range(0, 256);
+        sample.g = (byte)random.Range(0, 256);
+        sample.b = (byte)random.Range(0, 256);
+        sample.exponent = (signed char)random.Range(min_exponent, max_exponent);
+        return sample;
+    }
+
+    // PVS/PAS row of a cluster: every cluster within radius boxes, run-length encoded like vvis does.
+    void AppendVisRow(std::vector<char> &out, int cluster, int radius) const {
+        int clusters = options.grid_x * options.grid_y;
+        std::vector<unsigned char> row((clusters + 7) / 8, 0);
+        int cx = cluster % options.grid_x, cy = cluster / options.grid_x;
+        for (int y = std::max(0, cy - radius); y <= std::min(options.grid_y - 1, cy + radius); y++)
+        {
+            for (int x = std::max(0, cx - radius); x <= std::min(options.grid_x - 1, cx + radius); x++)
+            {
+                int other = y * options.grid_x + x;
+                row[other >> 3] |= 1 << (other & 7);
+            }
+        }
+        for (size_t i = 0; i < row.size();)
+        {
+            if (row[i] != 0)
+            {
+                out.push_back((char)row[i++]);
+                continue;
+            }
+            int run = 0;
+            while (i < row.size() && row[i] == 0 && run < 255)
+            {
+                run++;
+                i++;
+            }
+            out.push_back(0);
+            out.push_back((char)run);
+        }
+    }
+
+    // Splits the cells in [x0, x1) x [y0, y1) along the longer side. Returns the child index for the parent.
+    int BuildNode(int x0, int x1, int y0, int y1, std::vector<char> &planes, std::vector<dnode_t> &nodes) const {
+        if (x1 - x0 == 1 && y1 - y0 == 1)
+            return -(1 + y0 * options.grid_x + x0) - 1;
+        int index = (int)nodes.size();
+        nodes.push_back(dnode_t());
+        dplane_t plane;
+        memset(&plane, 0, sizeof(dplane_t));
+        int front, back;
+        if (x1 - x0 >= y1 - y0)
+        {
+            int middle = (x0 + x1) / 2;
+            plane.normal.x = 1.0f;
+            plane.dist = (float)(middle * BOX_SPACING - 64);
+            plane.type = 0;
+            front = BuildNode(middle, x1, y0, y1, planes, nodes);
+            back = BuildNode(x0, middle, y0, y1, planes, nodes);
+        }
+        else
+        {
+            int middle = (y0 + y1) / 2;
+            plane.normal.y = 1.0f;
+            plane.dist = (float)(middle * BOX_SPACING - 64);
+            plane.type = 1;
+            front = BuildNode(x0, x1, middle, y1, planes, nodes);
+            back = BuildNode(x0, x1, y0, middle, planes, nodes);
+        }
+        dnode_t &node = nodes[index];
+        memset(&node, 0, sizeof(dnode_t));
+        node.planenum = (int)(planes.size() / sizeof(dplane_t));
+        Append(planes, plane);
+        node.children[0] = front;
+        node.children[1] = back;
+        node.mins[0] = (short)(x0 * BOX_SPACING - 64);
+        node.mins[1] = (short)(y0 * BOX_SPACING - 64);
+        node.mins[2] = -64;
+        node.maxs[0] = (short)(x1 * BOX_SPACING - 64);
+        node.maxs[1] = (short)(y1 * BOX_SPACING - 64);
+        node.maxs[2] = 192;
+        return index;
+    }
+
+    // Stored zip of random files, written straight to the file. Local headers are patched once their crc is known.
+    static bool WritePakfile(FILE *output, size_t size, Random &random, size_t &written) {
+        written = 0;
+        if (size == 0)
+            return true;
+        long start = ftell(output);
+        std::vector<char> chunk;
+        std::vector<zip_central_header_t> centrals;
+        std::vector<std::string> names;
+        for (size_t done = 0; done < size; done += chunk.size())
+        {
+            chunk.resize(std::min(PAK_CHUNK, size - done));
+            for (size_t i = 0; i < chunk.size(); i += 8)
+            {
+                uint64_t bits = random.Next();
+                memcpy(&chunk[i], &bits, std::min((size_t)8, chunk.size() - i));
+            }
+            char name[64];
+            snprintf(name, sizeof(name), "materials/generated/filler%05zu.vtf", names.size());
+            names.push_back(name);
+
+            zip_local_header_t local;
+            memset(&local, 0, sizeof(zip_local_header_t));
+            local.signature = ZIP_LOCAL_SIGNATURE;
+            local.versionNeeded = 10;
+            local.method = ZIP_STORED;
+            local.modDate = (0 << 9) | (1 << 5) | 1;
+            local.crc32 = Crc32(chunk.data(), chunk.size());
+            local.compressedSize = local.uncompressedSize = (unsigned int)chunk.size();
+            local.nameLength = (unsigned short)names.back().size();
+
+            zip_central_header_t central;
+            memset(&central, 0, sizeof(zip_central_header_t));
+            central.signature = ZIP_CENTRAL_SIGNATURE;
+            central.versionMadeBy = 20;
+            central.versionNeeded = 10;
+            central.method = ZIP_STORED;
+            central.modDate = local.modDate;
+            central.crc32 = local.crc32;
+            central.compressedSize = central.uncompressedSize = local.uncompressedSize;
+            central.nameLength = local.nameLength;
+            central.localHeaderOffset = (unsigned int)written;
+            centrals.push_back(central);
+
+            if (fwrite(&local, sizeof(zip_local_header_t), 1, output) != 1 || fwrite(name, 1, local.nameLength, output) != local.nameLength
+                || fwrite(chunk.data(), 1, chunk.size(), output) != chunk.size())
+                return false;
+            written += sizeof(zip_local_header_t) + local.nameLength + chunk.size();
+        }
+
+        size_t central_offset = written;
+        for (size_t i = 0; i < centrals.size(); i++)
+        {
+            if (fwrite(&centrals[i], sizeof(zip_central_header_t), 1, output) != 1 || fwrite(names[i].data(), 1, names[i].size(), output) != names[i].size())
+                return false;
+            written += sizeof(zip_central_header_t) + names[i].size();
+        }
+        zip_end_header_t end;
+        memset(&end, 0, sizeof(zip_end_header_t));
+        end.signature = ZIP_END_SIGNATURE;
+        end.diskEntries = end.entries = (unsigned short)centrals.size();
+        end.centralSize = (unsigned int)(written - central_offset);
+        end.centralOffset = (unsigned int)central_offset;
+        if (fwrite(&end, sizeof(zip_end_header_t), 1, output) != 1)
+            return false;
+        written += sizeof(zip_end_header_t);
+        return ftell(output) == start + (long)written;
+    }
+
+public:
+    explicit BspGenerator(const BspGenOptions &new_options) : options(new_options) {}
+
+    // Returns 0 on success, 1 if the options are out of range, 2 if the file couldn't be written.
+    int Write(const char *__restrict__ path) const {
+        int boxes = options.grid_x * options.grid_y;
+        if (options.grid_x < 1 || options.grid_y < 1 || options.grid_x > 127 || options.grid_y > 127 || boxes > 8191
+            || (options.version < 19 || options.version > 21) || options.lightmap_size < 1 || options.lightmap_size > 32
+            || options.lightmap_styles < 1 || options.lightmap_styles > MAXLIGHTMAPS)
+            return 1;
+        size_t lightmap_bytes = (size_t)boxes * 6 * options.lightmap_styles * options.lightmap_size * options.lightmap_size * sizeof(ColorRGBExp32);
+        size_t pak_files = (options.pakfile_bytes + PAK_CHUNK - 1) / PAK_CHUNK;
+        if (lightmap_bytes + options.pakfile_bytes + pak_files * 256 + ((size_t)64 << 20) > 0x7FFFFFFFu || pak_files > 0xFFFF)
+            return 1;
+
+        Random random(options.seed);
+        std::vector<char> lumps[HEADER_LUMPS];
+
+        // Brushes, their planes, and a face with 4 fresh edges for every side.
+        std::vector<char> &planes = lumps[LUMP_PLANES];
+        std::vector<Vector> vertices;
+        std::vector<dedge_t> edges(1, dedge_t{{0, 0}});
+        std::vector<int> surfedges;
+        std::vector<dface_t> faces;
+        std::vector<dbrush_t> brushes;
+        std::vector<dbrushside_t> brushsides;
+        std::vector<char> &lighting = lumps[LUMP_LIGHTING];
+        lighting.reserve(lightmap_bytes);
+        static const int quads[6][4] = {{1, 3, 7, 5}, {0, 4, 6, 2}, {2, 6, 7, 3}, {0, 1, 5, 4}, {4, 5, 7, 6}, {0, 2, 3, 1}};
+        for (int b = 0; b < boxes; b++)
+        {
+            float x0 = (float)(b % options.grid_x * BOX_SPACING), y0 = (float)(b / options.grid_x * BOX_SPACING), z0 = 0.0f;
+            float x1 = x0 + BOX_SIZE, y1 = y0 + BOX_SIZE, z1 = (float)BOX_SIZE;
+            const float sides[6][5] = {{1, 0, 0, x1, 0}, {-1, 0, 0, -x0, 0}, {0, 1, 0, y1, 1}, {0, -1, 0, -y0, 1}, {0, 0, 1, z1, 2}, {0, 0, -1, -z0, 2}};
+            brushes.push_back(dbrush_t{(int)brushsides.size(), 7, CONTENTS_SOLID});
+            int first_plane = (int)(planes.size() / sizeof(dplane_t));
+            for (int s = 0; s < 6; s++)
+            {
+                dplane_t plane;
+                plane.normal = Vector{sides[s][0], sides[s][1], sides[s][2]};
+                plane.dist = sides[s][3];
+                plane.type = (int)sides[s][4];
+                Append(planes, plane);
+                brushsides.push_back(dbrushside_t{(unsigned short)(first_plane + s), 0, -1, 0});
+            }
+            brushsides.push_back(dbrushside_t{(unsigned short)(first_plane + 4), 0, -1, 1}); // bevel copy of +z
+
+            int first_vertex = (int)vertices.size();
+            for (int k = 0; k < 8; k++)
+                vertices.push_back(Vector{k & 1 ? x1 : x0, k & 2 ? y1 : y0, k & 4 ? z1 : z0});
+            for (int s = 0; s < 6; s++)
+            {
+                dface_t face;
+                memset(&face, 0, sizeof(dface_t));
+                face.planenum = (unsigned short)(first_plane + s);
+                face.firstedge = (int)surfedges.size();
+                face.numedges = 4;
+                face.dispinfo = -1;
+                for (int k = 0; k < MAXLIGHTMAPS; k++)
+                    face.styles[k] = k < options.lightmap_styles ? (byte)k : 255;
+                face.lightofs = (int)lighting.size();
+                face.area = (float)(BOX_SIZE * BOX_SIZE);
+                face.LightmapTextureSizeInLuxels[0] = face.LightmapTextureSizeInLuxels[1] = options.lightmap_size - 1;
+                face.origFace = -1;
+                for (int k = 0; k < 4; k++)
+                {
+                    unsigned short a = (unsigned short)(first_vertex + quads[s][k]), c = (unsigned short)(first_vertex + quads[s][(k + 1) % 4]);
+                    surfedges.push_back(k % 2 == 0 ? (int)edges.size() : -(int)edges.size());
+                    edges.push_back(k % 2 == 0 ? dedge_t{{a, c}} : dedge_t{{c, a}});
+                }
+                for (int k = 0; k < options.lightmap_styles * options.lightmap_size * options.lightmap_size; k++)
+                    Append(lighting, RandomSample(random, -4, 3));
+                faces.push_back(face);
+            }
+        }
+
+        // One leaf per box after the solid leaf 0, and the tree above them.
+        std::vector<dnode_t> nodes;
+        BuildNode(0, options.grid_x, 0, options.grid_y, planes, nodes);
+        std::vector<char> &leafs = lumps[LUMP_LEAFS];
+        std::vector<unsigned short> leaffaces, leafbrushes;
+        for (int l = 0; l <= boxes; l++)
+        {
+            dleaf_v0_t leaf;
+            memset(&leaf, 0, sizeof(dleaf_v0_t));
+            leaf.cluster = -1;
+            leaf.leafWaterDataID = -1;
+            if (l == 0)
+                leaf.contents = CONTENTS_SOLID;
+            else
+            {
+                int b = l - 1, x = b % options.grid_x, y = b / options.grid_x;
+                leaf.cluster = (short)b;
+                leaf.mins[0] = (short)(x * BOX_SPACING - 64);
+                leaf.mins[1] = (short)(y * BOX_SPACING - 64);
+                leaf.mins[2] = -64;
+                leaf.maxs[0] = (short)(x * BOX_SPACING + 192);
+                leaf.maxs[1] = (short)(y * BOX_SPACING + 192);
+                leaf.maxs[2] = 192;
+                leaf.firstleafface = (unsigned short)leaffaces.size();
+                leaf.numleaffaces = 6;
+                leaf.firstleafbrush = (unsigned short)leafbrushes.size();
+                leaf.numleafbrushes = 1;
+                for (int s = 0; s < 6; s++)
+                    leaffaces.push_back((unsigned short)(b * 6 + s));
+                leafbrushes.push_back((unsigned short)b);
+            }
+            if (options.version == 19)
+            {
+                for (int side = 0; side < 6; side++)
+                    leaf.ambientLighting.m_Color[side] = RandomSample(random, -3, 1);
+                Append(leafs, leaf);
+            }
+            else
+            {
+                // dleaf_t is dleaf_v0_t without the cube.
+                dleaf_t v1;
+                memcpy(&v1, &leaf, offsetof(dleaf_t, padding));
+                v1.padding = 0;
+                Append(leafs, v1);
+            }
+        }
+
+        // PVS (neighbors) and PAS (3 boxes around) rows of every cluster after the offset table.
+        std::vector<char> &vis = lumps[LUMP_VISIBILITY];
+        Append(vis, boxes);
+        vis.resize(sizeof(int) + (size_t)boxes * 2 * sizeof(int));
+        for (int c = 0; c < boxes; c++)
+        {
+            int offsets[2];
+            offsets[0] = (int)vis.size();
+            AppendVisRow(vis, c, 1);
+            offsets[1] = (int)vis.size();
+            AppendVisRow(vis, c, 3);
+            memcpy(&vis[sizeof(int) + (size_t)c * 2 * sizeof(int)], offsets, sizeof(offsets));
+        }
+
+        // 2 ambient samples per box leaf.
+        for (int l = 0; l <= boxes; l++)
+        {
+            dleafambientindex_t index;
+            index.ambientSampleCount = l == 0 ? 0 : 2;
+            index.firstAmbientSample = (unsigned short)(l == 0 ? 0 : (l - 1) * 2);
+            Append(lumps[LUMP_LEAF_AMBIENT_INDEX], index);
+            for (int k = 0; k < index.ambientSampleCount; k++)
+            {
+                dleafambientlighting_t sample;
+                for (int side = 0; side < 6; side++)
+                    sample.cube.m_Color[side] = RandomSample(random, -3, 1);
+                sample.x = k == 0 ? 64 : 192;
+                sample.y = sample.z = 128;
+                sample.pad = 0;
+                Append(lumps[LUMP_LEAF_AMBIENT_LIGHTING], sample);
+            }
+        }
+
+        // A light above every box, an entity for it and a static prop on it.
+        std::string entities = "{\n\"classname\" \"worldspawn\"\n\"mapversion\" \"1\"\n}\n";
+        std::vector<char> &props = lumps[LUMP_GAME_LUMP];
+        int dictionary = 2;
+        Append(props, dictionary);
+        char names[2][128] = {"models/props/generated_a.mdl", "models/props/generated_b.mdl"};
+        props.insert(props.end(), &names[0][0], &names[0][0] + sizeof(names));
+        Append(props, boxes);
+        for (int b = 0; b < boxes; b++)
+            Append(props, (unsigned short)(b + 1));
+        Append(props, boxes);
+        for (int b = 0; b < boxes; b++)
+        {
+            float x = (float)(b % options.grid_x * BOX_SPACING), y = (float)(b / options.grid_x * BOX_SPACING);
+            dworldlight_t light;
+            memset(&light, 0, sizeof(dworldlight_t));
+            light.origin = Vector{x + 64, y + 64, 200};
+            light.intensity = Vector{100, 100, 100};
+            light.normal = Vector{0, 0, -1};
+            light.cluster = b;
+            light.type = b % 2 ? emit_point : emit_spotlight;
+            light.stopdot = 0.8f;
+            light.stopdot2 = 0.7f;
+            light.exponent = 1.0f;
+            light.radius = b % 3 ? 300.0f : 0.0f;
+            light.linear_attn = 1.0f;
+            light.owner = -1;
+            Append(lumps[LUMP_WORLDLIGHTS], light);
+
+            char entity[160];
+            snprintf(entity, sizeof(entity), "{\n\"origin\" \"%d %d 200\"\n\"targetname\" \"light_%d\"\n\"classname\" \"light\"\n}\n", (int)x + 64, (int)y + 64, b);
+            entities += entity;
+
+            StaticPropLumpV10_t prop;
+            memset(&prop, 0, sizeof(StaticPropLumpV10_t));
+            prop.Origin = Vector{x + 32, y + 32, 128};
+            prop.Angles.yaw = (float)(b % 36 * 10);
+            prop.PropType = (unsigned short)(b % 2);
+            prop.FirstLeaf = (unsigned short)b;
+            prop.LeafCount = 1;
+            prop.Solid = 6;
+            prop.FadeMinDist = 100.0f;
+            prop.FadeMaxDist = 2000.0f;
+            prop.LightingOrigin = Vector{x + 32, y + 32, 140};
+            prop.ForcedFadeScale = 1.0f;
+            prop.DiffuseModulation = -1;
+            Append(props, prop);
+        }
+        entities += "{\n\"origin\" \"0 0 0\"\n\"classname\" \"info_player_start\"\n}\n";
+        lumps[LUMP_ENTITIES].assign(entities.begin(), entities.end());
+        lumps[LUMP_ENTITIES].push_back('\0');
+
+        // One texture for everything, 16 units per luxel.
+        texinfo_t texinfo;
+        memset(&texinfo, 0, sizeof(texinfo_t));
+        texinfo.textureVecs[0][0] = texinfo.textureVecs[1][1] = 1.0f / 16;
+        texinfo.lightmapVecs[0][0] = texinfo.lightmapVecs[1][1] = 1.0f / 16;
+        Append(lumps[LUMP_TEXINFO], texinfo);
+        dtexdata_t texdata;
+        memset(&texdata, 0, sizeof(dtexdata_t));
+        texdata.reflectivity = Vector{0.5f, 0.5f, 0.5f};
+        texdata.width = texdata.height = texdata.view_width = texdata.view_height = 128;
+        Append(lumps[LUMP_TEXDATA], texdata);
+        const char texture[] = "tools/toolsnodraw";
+        lumps[LUMP_TEXDATA_STRING_DATA].assign(texture, texture + sizeof(texture));
+        Append(lumps[LUMP_TEXDATA_STRING_TABLE], 0);
+
+        dmodel_t world;
+        memset(&world, 0, sizeof(dmodel_t));
+        world.maxs = Vector{(float)(options.grid_x * BOX_SPACING), (float)(options.grid_y * BOX_SPACING), (float)BOX_SIZE};
+        world.numfaces = (int)faces.size();
+        Append(lumps[LUMP_MODELS], world);
+
+        auto bytes = [](std::vector<char> &out, const void *data, size_t size) {
+            out.assign((const char *)data, (const char *)data + size);
+        };
+        bytes(lumps[LUMP_VERTEXES], vertices.data(), vertices.size() * sizeof(Vector));
+        bytes(lumps[LUMP_EDGES], edges.data(), edges.size() * sizeof(dedge_t));
+        bytes(lumps[LUMP_SURFEDGES], surfedges.data(), surfedges.size() * sizeof(int));
+        bytes(lumps[LUMP_FACES], faces.data(), faces.size() * sizeof(dface_t));
+        bytes(lumps[LUMP_BRUSHES], brushes.data(), brushes.size() * sizeof(dbrush_t));
+        bytes(lumps[LUMP_BRUSHSIDES], brushsides.data(), brushsides.size() * sizeof(dbrushside_t));
+        bytes(lumps[LUMP_NODES], nodes.data(), nodes.size() * sizeof(dnode_t));
+        bytes(lumps[LUMP_LEAFFACES], leaffaces.data(), leaffaces.size() * sizeof(unsigned short));
+        bytes(lumps[LUMP_LEAFBRUSHES], leafbrushes.data(), leafbrushes.size() * sizeof(unsigned short));
+
+        FILE *output = fopen(path, "wb");
+        if (output == nullptr)
+            return 2;
+        dheader_t header;
+        memset(&header, 0, sizeof(dheader_t));
+        header.ident = IDBSPHEADER;
+        header.version = options.version;
+        header.mapRevision = 1;
+        bool ok = fwrite(&header, sizeof(dheader_t), 1, output) == 1;
+        size_t offset = sizeof(dheader_t);
+        for (int n = 0; n < HEADER_LUMPS && ok; n++)
+        {
+            static const char padding[4] = {0, 0, 0, 0};
+            size_t pad = (4 - offset % 4) % 4;
+            ok = fwrite(padding, 1, pad, output) == pad;
+            offset += pad;
+            lump_t &lump = header.lumps[n];
+            lump.fileofs = (int)offset;
+            lump.version = n == LUMP_LEAFS && options.version != 19 ? 1 : 0;
+            size_t size = lumps[n].size();
+            if (n == LUMP_GAME_LUMP)
+            {
+                // The directory with the static props right after it, offsets are from the start of the file.
+                dgamelump_t entry = {PROP_STATIC, 0, 10, (int)(offset + sizeof(int) + sizeof(dgamelump_t)), (int)lumps[n].size()};
+                int count = 1;
+                ok = fwrite(&count, sizeof(int), 1, output) == 1 && fwrite(&entry, sizeof(dgamelump_t), 1, output) == 1;
+                size += sizeof(int) + sizeof(dgamelump_t);
+            }
+            if (n == LUMP_PAKFILE)
+                ok = ok && WritePakfile(output, options.pakfile_bytes, random, size);
+            else
+                ok = ok && fwrite(lumps[n].data(), 1, lumps[n].size(), output) == lumps[n].size();
+            if (size == 0)
+                lump.fileofs = 0;
+            lump.filelen = (int)size;
+            offset += size;
+            std::vector<char>().swap(lumps[n]);
+        }
+        ok = ok && fseek(output, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(dheader_t), 1, output) == 1;
+        ok = fclose(output) == 0 && ok;
+        return ok ? 0 : 2;
+    }
+};
+
+#endif // BSP_BSPGEN_H
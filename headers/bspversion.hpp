@@ -0,0 +1,265 @@
+#pragma once
+
+#ifndef BSP_VERSION_H
+#define BSP_VERSION_H
+
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include <type_traits>
+#include <vector>
+
+// Bsp versions/games with a known lump header, leaf and face layout.
+enum
+{
+    BSP_PROFILE_UNKNOWN = 0, // read like v20
+    BSP_PROFILE_V19,         // HL2 and CS:S at release, leafs carry their ambient lighting
+    BSP_PROFILE_V20,         // HL2 episodes, Portal, TF2, GMod, later CS:S
+    BSP_PROFILE_V21,         // L4D, Portal 2, Alien Swarm, CS:GO
+    BSP_PROFILE_L4D2,        // v21 with lump_l4d2_t entries in the header
+    BSP_PROFILE_V22,         // Dota 2 beta, same lumps as v21
+    BSP_PROFILE_V23,         // Dota 2 beta, same lumps as v21
+};
+
+// Record layouts of one profile, known at compile time.
+// Readers are instantiated once per profile so the loops over the records never look at the version.
+template<int Profile>
+struct BspFormat
+{
+    typedef lump_t Lump;
+    typedef dface_t Face;
+    static const int LEAF_VERSION = 1; // layout of leafs whose lump version isn't 0 or 1
+};
+
+template<>
+struct BspFormat<BSP_PROFILE_V19>
+{
+    typedef lump_t Lump;
+    typedef dface_t Face;
+    static const int LEAF_VERSION = 0;
+};
+
+template<>
+struct BspFormat<BSP_PROFILE_L4D2>
+{
+    typedef lump_l4d2_t Lump;
+    typedef dface_t Face;
+    static const int LEAF_VERSION = 1;
+};
+
+// Leaf record of a leaf lump version.
+template<int LeafVersion>
+struct LeafFormat
+{
+    typedef dleaf_t Leaf;
+};
+
+template<>
+struct LeafFormat<0>
+{
+    typedef dleaf_v0_t Leaf;
+};
+
+// Calls visit(BspFormat<profile>()), unknown profiles get the v20 layouts.
+template<typename Visitor>
+inline void VisitBspFormat(int profile, Visitor &&visit) {
+    switch (profile)
+    {
+    case BSP_PROFILE_V19:
+        visit(BspFormat<BSP_PROFILE_V19>());
+        break;
+    case BSP_PROFILE_V21:
+        visit(BspFormat<BSP_PROFILE_V21>());
+        break;
+    case BSP_PROFILE_L4D2:
+        visit(BspFormat<BSP_PROFILE_L4D2>());
+        break;
+    case BSP_PROFILE_V22:
+        visit(BspFormat<BSP_PROFILE_V22>());
+        break;
+    case BSP_PROFILE_V23:
+        visit(BspFormat<BSP_PROFILE_V23>());
+        break;
+    default:
+        visit(BspFormat<BSP_PROFILE_V20>());
+        break;
+    }
+}
+
+inline const char* GetBspProfileName(int profile) {
+    switch (profile)
+    {
+    case BSP_PROFILE_V19:
+        return "v19";
+    case BSP_PROFILE_V20:
+        return "v20";
+    case BSP_PROFILE_V21:
+        return "v21";
+    case BSP_PROFILE_L4D2:
+        return "v21 (l4d2)";
+    case BSP_PROFILE_V22:
+        return "v22";
+    case BSP_PROFILE_V23:
+        return "v23";
+    default:
+        return "unknown";
+    }
+}
+
+// Number of header entries that make sense as Lump: empty, or inside the file after the header.
+// file_size 0 only checks the offsets.
+template<typename Lump>
+inline int CountPlausibleLumps(const dheader_t &raw, size_t file_size) {
+    int plausible = 0;
+    for (int n = 0; n < HEADER_LUMPS; n++)
+    {
+        Lump entry;
+        memcpy((void *)&entry, &raw.lumps[n], sizeof(Lump));
+        if (entry.filelen == 0)
+            plausible++;
+        else if (entry.fileofs >= (int)sizeof(dheader_t) && entry.filelen > 0
+                 && (file_size == 0 || (size_t)entry.fileofs + entry.filelen <= file_size))
+            plausible++;
+    }
+    return plausible;
+}
+
+// Profile of a header as it is stored in the file (before NormalizeBspHeader()).
+// L4D2 also says v21, its header is told apart by which entry layout makes more sense.
+inline int DetectBspProfile(const dheader_t &raw, size_t file_size = 0) {
+    if (raw.ident != IDBSPHEADER)
+        return BSP_PROFILE_UNKNOWN;
+    switch (raw.version)
+    {
+    case 19:
+        return BSP_PROFILE_V19;
+    case 20:
+        return BSP_PROFILE_V20;
+    case 21:
+        if (CountPlausibleLumps<lump_l4d2_t>(raw, file_size) > CountPlausibleLumps<lump_t>(raw, file_size))
+            return BSP_PROFILE_L4D2;
+        return BSP_PROFILE_V21;
+    case 22:
+        return BSP_PROFILE_V22;
+    case 23:
+        return BSP_PROFILE_V23;
+    default:
+        return BSP_PROFILE_UNKNOWN;
+    }
+}
+
+// Turns the header entries of the file into lump_t in place, so the rest of the code only sees lump_t.
+inline void NormalizeBspHeader(dheader_t &header, int profile) {
+    VisitBspFormat(profile, [&header](auto format) {
+        typedef typename decltype(format)::Lump Lump;
+        for (int n = 0; n < HEADER_LUMPS; n++)
+        {
+            Lump entry;
+            memcpy((void *)&entry, &header.lumps[n], sizeof(Lump));
+            header.lumps[n] = entry;
+        }
+    });
+}
+
+// Header entry as the file of that profile stores it, what NormalizeBspHeader() undoes.
+inline void EncodeBspLump(const lump_t &lump, int profile, void *out) {
+    VisitBspFormat(profile, [&lump, out](auto format) {
+        typedef typename decltype(format)::Lump Lump;
+        Lump entry = lump;
+        memcpy(out, (const void *)&entry, sizeof(Lump));
+    });
+}
+
+// Inverse of NormalizeBspHeader().
+inline void EncodeBspHeader(dheader_t &header, int profile) {
+    for (int n = 0; n < HEADER_LUMPS; n++)
+    {
+        lump_t entry = header.lumps[n];
+        EncodeBspLump(entry, profile, &header.lumps[n]);
+    }
+}
+
+// Fields every leaf layout shares.
+template<typename Leaf>
+inline void ConvertLeaf(const Leaf &in, dleaf_t &out) {
+    out.contents = in.contents;
+    out.cluster = in.cluster;
+    out.area = in.area;
+    out.flags = in.flags;
+    memcpy(out.mins, in.mins, sizeof(out.mins));
+    memcpy(out.maxs, in.maxs, sizeof(out.maxs));
+    out.firstleafface = in.firstleafface;
+    out.numleaffaces = in.numleaffaces;
+    out.firstleafbrush = in.firstleafbrush;
+    out.numleafbrushes = in.numleafbrushes;
+    out.leafWaterDataID = in.leafWaterDataID;
+    out.padding = 0;
+}
+
+template<typename Leaf>
+inline void LeafAmbient(const Leaf &, CompressedLightCube &out) {
+    memset(&out, 0, sizeof(CompressedLightCube));
+}
+
+inline void LeafAmbient(const dleaf_v0_t &leaf, CompressedLightCube &out) {
+    out = leaf.ambientLighting;
+}
+
+template<typename Leaf>
+inline void DecodeLeafs(const char *data, size_t count, dleaf_t *out, CompressedLightCube *ambient) {
+    Leaf leaf;
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy((void *)&leaf, data + i * sizeof(Leaf), sizeof(Leaf));
+        ConvertLeaf(leaf, out[i]);
+        if (ambient != nullptr)
+            LeafAmbient(leaf, ambient[i]);
+    }
+}
+
+// Current layout, nothing to convert.
+template<>
+inline void DecodeLeafs<dleaf_t>(const char *data, size_t count, dleaf_t *out, CompressedLightCube *ambient) {
+    if (count == 0)
+        return;
+    memcpy((void *)out, data, count * sizeof(dleaf_t));
+    if (ambient != nullptr)
+        memset(ambient, 0, count * sizeof(CompressedLightCube));
+}
+
+// Decodes (decompressed) leaf lump bytes of any layout into dleaf_t, the layout comes from the leaf lump version
+// like in the engine, or from the profile if that version is unknown.
+// ambient, if given, gets the lighting of version 0 leafs (zeroed for the others, their lighting has its own lumps).
+inline void ReadBspLeafs(const char *data, size_t size, int profile, int lump_version, std::vector<dleaf_t> &leafs, std::vector<CompressedLightCube> *ambient = nullptr) {
+    BSP_TRACE_SCOPE("ReadBspLeafs");
+    int leaf_version = lump_version;
+    if (leaf_version != 0 && leaf_version != 1)
+        VisitBspFormat(profile, [&leaf_version](auto format) { leaf_version = decltype(format)::LEAF_VERSION; });
+
+    size_t record = leaf_version == 0 ? sizeof(LeafFormat<0>::Leaf) : sizeof(LeafFormat<1>::Leaf);
+    size_t count = size / record;
+    leafs.resize(count);
+    CompressedLightCube *cubes = nullptr;
+    if (ambient != nullptr)
+    {
+        ambient->resize(count);
+        cubes = ambient->data();
+    }
+    if (leaf_version == 0)
+        DecodeLeafs<LeafFormat<0>::Leaf>(data, count, leafs.data(), cubes);
+    else
+        DecodeLeafs<LeafFormat<1>::Leaf>(data, count, leafs.data(), cubes);
+}
+
+// Decodes (decompressed) face lump bytes of a profile into dface_t.
+inline void ReadBspFaces(const char *data, size_t size, int profile, std::vector<dface_t> &faces) {
+    BSP_TRACE_SCOPE("ReadBspFaces");
+    VisitBspFormat(profile, [&](auto format) {
+        typedef typename decltype(format)::Face Face;
+        static_assert(std::is_same<Face, dface_t>::value, "add a conversion for this face layout");
+        faces.resize(size / sizeof(Face));
+        memcpy((void *)faces.data(), data, faces.size() * sizeof(Face));
+    });
+}
+
+#endif // BSP_VERSION_H
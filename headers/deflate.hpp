@@ -0,0 +1,117 @@
+#pragma once
+
+#ifndef BSP_DEFLATE_H
+#define BSP_DEFLATE_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Deflate support for pakfile entries needs zlib, build with -DBSP_ENABLE_ZLIB and link with -lz.
+// Without it deflated entries can be listed but not extracted, and new entries are stored.
+#ifdef BSP_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+inline bool IsZlibAvailable() {
+#ifdef BSP_ENABLE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Inflates a raw deflate stream (no zlib or gzip header, like in zip files) of actual bytes into out.
+// Returns false if the stream is broken, doesn't have actual bytes or zlib isn't available.
+inline bool InflateRaw(const char *data, size_t size, size_t actual, std::vector<char> &out) {
+#ifdef BSP_ENABLE_ZLIB
+    z_stream stream;
+    memset(&stream, 0, sizeof(z_stream));
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+        return false;
+    out.resize(actual);
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)size;
+    stream.next_out = (Bytef *)out.data();
+    stream.avail_out = (uInt)out.size();
+    int ret = inflate(&stream, Z_FINISH);
+    bool ok = ret == Z_STREAM_END && stream.total_out == actual;
+    inflateEnd(&stream);
+    return ok;
+#else
+    (void)data;
+    (void)size;
+    (void)actual;
+    (void)out;
+    return false;
+#endif
+}
+
+// Compresses size bytes into a raw deflate stream in out, level 1 (fast) to 9 (small).
+// Returns false if compression failed or zlib isn't available.
+inline bool DeflateRaw(const char *data, size_t size, std::vector<char> &out, int level = 6) {
+#ifdef BSP_ENABLE_ZLIB
+    z_stream stream;
+    memset(&stream, 0, sizeof(z_stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    out.resize(deflateBound(&stream, (uLong)size));
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)size;
+    stream.next_out = (Bytef *)out.data();
+    stream.avail_out = (uInt)out.size();
+    int ret = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return ret == Z_STREAM_END;
+#else
+    (void)data;
+    (void)size;
+    (void)out;
+    (void)level;
+    return false;
+#endif
+}
+
+// CRC-32 (zip, png) of size bytes, continuing from crc. Slicing by 8, no zlib needed.
+inline uint32_t Crc32(const void *data, size_t size, uint32_t crc = 0) {
+    struct Tables
+    {
+        uint32_t table[8][256];
+
+        Tables()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                table[0][i] = c;
+            }
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                for (int t = 1; t < 8; t++)
+                    table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+            }
+        }
+    };
+    static const Tables tables;
+    const uint32_t (*table)[256] = tables.table;
+
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+        low ^= crc;
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+            ^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+    }
+    for (; size > 0; size--, p++)
+        crc = table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#endif // BSP_DEFLATE_H
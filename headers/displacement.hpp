@@ -0,0 +1,394 @@
+#pragma once
+
+#ifndef BSP_DISPLACEMENT_H
+#define BSP_DISPLACEMENT_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include "threadpool.hpp"
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Where one displacement's grid and triangles are in a DisplacementMesh.
+struct DispSurface
+{
+    int face;          // index into LUMP_FACES
+    int power;
+    int size;          // vertices per side, (1 << power) + 1, 0 if the displacement couldn't be built
+    int firstvertex;   // size * size vertices, row by row
+    int firsttriangle; // 2 * (size - 1)^2 triangles, two per grid quad
+    int numtriangles;
+};
+
+// Tessellated displacements. The grid of every displacement is spread over its base face
+// (starting at the corner nearest to startPosition) and pushed out by vec * dist of its dDispVert.
+// Vertices are stored as separate x, y, z and alpha arrays, triangles keep their CDispTri tags.
+class DisplacementMesh
+{
+public:
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> alpha;
+    std::vector<unsigned int> indices;  // 3 per triangle
+    std::vector<unsigned short> tags;   // CDispTri::m_uiTags of every triangle
+    std::vector<DispSurface> surfaces;  // one per ddispinfo_t
+
+private:
+    static const int MIN_POWER = 1;
+    static const int MAX_POWER = 4;
+    // Boundary vertices closer than this (before displacing) are the same point.
+    static constexpr float STITCH_EPSILON = 0.01f;
+
+    std::vector<float> base[3]; // grid positions before displacing, for stitching
+
+    // The 4 corners of the base face, rotated so the one nearest to start comes first.
+    static bool FaceCorners(const dface_t &face, const int *surfedges, size_t surfedge_count, const dedge_t *edges, size_t edge_count,
+                            const Vector *vertexes, size_t vertex_count, const Vector &start, Vector corners[4]) {
+        if (face.numedges != 4 || face.firstedge < 0 || (size_t)face.firstedge + 4 > surfedge_count)
+            return false;
+        Vector points[4];
+        int nearest = 0;
+        float best = INFINITY;
+        for (int k = 0; k < 4; k++)
+        {
+            int surfedge = surfedges[face.firstedge + k];
+            size_t edge = surfedge >= 0 ? surfedge : -(int64_t)surfedge;
+            if (edge >= edge_count)
+                return false;
+            unsigned short vertex = edges[edge].v[surfedge >= 0 ? 0 : 1];
+            if (vertex >= vertex_count)
+                return false;
+            points[k] = vertexes[vertex];
+            float dx = points[k].x - start.x, dy = points[k].y - start.y, dz = points[k].z - start.z;
+            float distance = dx * dx + dy * dy + dz * dz;
+            if (distance < best)
+            {
+                best = distance;
+                nearest = k;
+            }
+        }
+        for (int k = 0; k < 4; k++)
+            corners[k] = points[(nearest + k) % 4];
+        return true;
+    }
+
+    // Row i runs from the corner 0 -> 1 edge to the corner 3 -> 2 edge.
+    void Tessellate(const DispSurface &surface, const Vector corners[4], const dDispVert *verts) {
+        int size = surface.size;
+        float step = 1.0f / (size - 1);
+        for (int i = 0; i < size; i++)
+        {
+            float t = i * step;
+            float left[3] = {corners[0].x + (corners[1].x - corners[0].x) * t, corners[0].y + (corners[1].y - corners[0].y) * t, corners[0].z + (corners[1].z - corners[0].z) * t};
+            float right[3] = {corners[3].x + (corners[2].x - corners[3].x) * t, corners[3].y + (corners[2].y - corners[3].y) * t, corners[3].z + (corners[2].z - corners[3].z) * t};
+            size_t row = surface.firstvertex + (size_t)i * size;
+            const dDispVert *in = verts + (size_t)i * size;
+            float *out[3] = {&x[row], &y[row], &z[row]};
+            float *flat[3] = {&base[0][row], &base[1][row], &base[2][row]};
+            int j = 0;
+#ifdef __SSE2__
+            const __m128 steps = _mm_mul_ps(_mm_set_ps(3, 2, 1, 0), _mm_set1_ps(step));
+            for (; j + 4 <= size; j += 4)
+            {
+                __m128 s = _mm_add_ps(_mm_set1_ps(j * step), steps);
+                __m128 dist = _mm_set_ps(in[j + 3].dist, in[j + 2].dist, in[j + 1].dist, in[j].dist);
+                __m128 vec[3] = {
+                    _mm_set_ps(in[j + 3].vec.x, in[j + 2].vec.x, in[j + 1].vec.x, in[j].vec.x),
+                    _mm_set_ps(in[j + 3].vec.y, in[j + 2].vec.y, in[j + 1].vec.y, in[j].vec.y),
+                    _mm_set_ps(in[j + 3].vec.z, in[j + 2].vec.z, in[j + 1].vec.z, in[j].vec.z),
+                };
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    __m128 l = _mm_set1_ps(left[axis]);
+                    __m128 position = _mm_add_ps(l, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(right[axis]), l), s));
+                    _mm_storeu_ps(flat[axis] + j, position);
+                    _mm_storeu_ps(out[axis] + j, _mm_add_ps(position, _mm_mul_ps(vec[axis], dist)));
+                }
+                _mm_storeu_ps(&alpha[row + j], _mm_set_ps(in[j + 3].alpha, in[j + 2].alpha, in[j + 1].alpha, in[j].alpha));
+            }
+#endif
+            for (; j < size; j++)
+            {
+                float s = j * step;
+                const float *vec = &in[j].vec.x;
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    float position = left[axis] + (right[axis] - left[axis]) * s;
+                    flat[axis][j] = position;
+                    out[axis][j] = position + vec[axis] * in[j].dist;
+                }
+                alpha[row + j] = in[j].alpha;
+            }
+        }
+    }
+
+    // Two triangles per quad, the diagonal alternates so the grid is symmetric.
+    void Triangulate(const DispSurface &surface, const CDispTri *tris, size_t tri_count, int tristart) {
+        int size = surface.size;
+        unsigned int *out = &indices[(size_t)surface.firsttriangle * 3];
+        for (int i = 0; i < size - 1; i++)
+        {
+            for (int j = 0; j < size - 1; j++)
+            {
+                unsigned int index = surface.firstvertex + i * size + j;
+                if ((i * size + j) % 2)
+                {
+                    unsigned int triangles[6] = {index, index + size, index + 1, index + 1, index + size, index + size + 1};
+                    memcpy(out, triangles, sizeof(triangles));
+                }
+                else
+                {
+                    unsigned int triangles[6] = {index, index + size, index + size + 1, index, index + size + 1, index + 1};
+                    memcpy(out, triangles, sizeof(triangles));
+                }
+                out += 6;
+            }
+        }
+        bool tagged = tristart >= 0 && (size_t)tristart + surface.numtriangles <= tri_count;
+        for (int t = 0; t < surface.numtriangles; t++)
+            tags[surface.firsttriangle + t] = tagged ? tris[tristart + t].m_uiTags : 0;
+    }
+
+    // Grid index of boundary vertex k, walking the 4 edges around the grid.
+    static inline int Boundary(int size, int k) {
+        int side = size - 1;
+        if (k < side)
+            return k;                                   // row 0
+        if (k < 2 * side)
+            return (k - side) * size + side;            // last column
+        if (k < 3 * side)
+            return side * size + (3 * side - k);        // last row, backwards
+        return (4 * side - k) * size;                   // column 0, backwards
+    }
+
+    inline bool SameBase(size_t a, size_t b) const {
+        return fabsf(base[0][a] - base[0][b]) < STITCH_EPSILON && fabsf(base[1][a] - base[1][b]) < STITCH_EPSILON && fabsf(base[2][a] - base[2][b]) < STITCH_EPSILON;
+    }
+
+    // Where vertex a lies on the segment b -> c (before displacing), -1 if it doesn't.
+    inline float OnSegment(size_t a, size_t b, size_t c) const {
+        float ab[3], bc[3], length = 0, t = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            ab[axis] = base[axis][a] - base[axis][b];
+            bc[axis] = base[axis][c] - base[axis][b];
+            length += bc[axis] * bc[axis];
+            t += ab[axis] * bc[axis];
+        }
+        if (length <= 0)
+            return -1;
+        t /= length;
+        if (t <= 0 || t >= 1)
+            return -1;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (fabsf(ab[axis] - bc[axis] * t) > STITCH_EPSILON)
+                return -1;
+        }
+        return t;
+    }
+
+    // Neighbors of displacement d without duplicates, returns how many.
+    int Neighbors(const ddispinfo_t &info, size_t d, int *neighbors) const {
+        int count = 0;
+        auto add = [&](int n) {
+            if (n == 0xFFFF || (size_t)n >= surfaces.size() || (size_t)n == d || surfaces[n].size == 0)
+                return;
+            for (int m = 0; m < count; m++)
+            {
+                if (neighbors[m] == n)
+                    return;
+            }
+            neighbors[count++] = n;
+        };
+        for (int edge = 0; edge < 4; edge++)
+        {
+            for (int sub = 0; sub < 2; sub++)
+                add(info.EdgeNeighbors[edge].m_SubNeighbors[sub].m_iNeighbor);
+            int corners = info.CornerNeighbors[edge].m_nNeighbors < MAX_DISP_CORNER_NEIGHBORS ? info.CornerNeighbors[edge].m_nNeighbors : MAX_DISP_CORNER_NEIGHBORS;
+            for (int c = 0; c < corners; c++)
+                add(info.CornerNeighbors[edge].m_Neighbors[c]);
+        }
+        return count;
+    }
+
+    // First boundary vertices shared with an edge or corner neighbor are averaged, then vertices in the middle
+    // of a coarser neighbor's edge (T-junctions) are moved onto that edge, so no cracks open between displacements.
+    void Stitch(const ddispinfo_t *dispinfos) {
+        for (int pass = 0; pass < 2; pass++)
+        {
+            std::vector<float> stitched[3] = {x, y, z};
+            for (size_t d = 0; d < surfaces.size(); d++)
+            {
+                const DispSurface &surface = surfaces[d];
+                if (surface.size == 0)
+                    continue;
+                int neighbors[4 * 2 + 4 * MAX_DISP_CORNER_NEIGHBORS];
+                int neighbor_count = Neighbors(dispinfos[d], d, neighbors);
+
+                int boundary = 4 * (surface.size - 1);
+                for (int k = 0; k < boundary; k++)
+                {
+                    size_t vertex = surface.firstvertex + Boundary(surface.size, k);
+                    float sum[3] = {x[vertex], y[vertex], z[vertex]};
+                    int count = 1;
+                    bool moved = false;
+                    for (int n = 0; n < neighbor_count && !moved; n++)
+                    {
+                        const DispSurface &other = surfaces[neighbors[n]];
+                        int other_boundary = 4 * (other.size - 1);
+                        for (int m = 0; m < other_boundary; m++)
+                        {
+                            size_t a = other.firstvertex + Boundary(other.size, m);
+                            if (SameBase(vertex, a))
+                            {
+                                sum[0] += x[a];
+                                sum[1] += y[a];
+                                sum[2] += z[a];
+                                count++;
+                                break;
+                            }
+                            if (pass == 0)
+                                continue;
+                            size_t b = other.firstvertex + Boundary(other.size, (m + 1) % other_boundary);
+                            float t = SameBase(vertex, b) ? -1 : OnSegment(vertex, a, b);
+                            if (t > 0)
+                            {
+                                stitched[0][vertex] = x[a] + (x[b] - x[a]) * t;
+                                stitched[1][vertex] = y[a] + (y[b] - y[a]) * t;
+                                stitched[2][vertex] = z[a] + (z[b] - z[a]) * t;
+                                moved = true;
+                                break;
+                            }
+                        }
+                    }
+                    if (pass == 0 && count > 1)
+                    {
+                        stitched[0][vertex] = sum[0] / count;
+                        stitched[1][vertex] = sum[1] / count;
+                        stitched[2][vertex] = sum[2] / count;
+                    }
+                }
+            }
+            x.swap(stitched[0]);
+            y.swap(stitched[1]);
+            z.swap(stitched[2]);
+        }
+    }
+
+public:
+    // Tessellates every displacement, in parallel on the pool if one is given, then stitches neighbors.
+    // Displacements whose face isn't a quad or whose verts are out of range get size 0.
+    void Build(const ddispinfo_t *dispinfos, size_t disp_count, const dDispVert *dispverts, size_t dispvert_count, const CDispTri *disptris, size_t disptri_count,
+               const dface_t *faces, size_t face_count, const int *surfedges, size_t surfedge_count, const dedge_t *edges, size_t edge_count,
+               const Vector *vertexes, size_t vertex_count, ThreadPool *pool = nullptr) {
+        BSP_TRACE_SCOPE("DisplacementMesh::Build");
+        // Offsets from a prefix sum so every displacement can be written on its own.
+        surfaces.resize(disp_count);
+        size_t vertex_total = 0, triangle_total = 0;
+        for (size_t d = 0; d < disp_count; d++)
+        {
+            const ddispinfo_t &info = dispinfos[d];
+            DispSurface &surface = surfaces[d];
+            surface.face = info.MapFace;
+            surface.power = info.power;
+            surface.size = 0;
+            surface.firstvertex = (int)vertex_total;
+            surface.firsttriangle = (int)triangle_total;
+            surface.numtriangles = 0;
+            if (info.power < MIN_POWER || info.power > MAX_POWER || info.MapFace >= face_count)
+                continue;
+            int size = (1 << info.power) + 1;
+            if (info.DispVertStart < 0 || (size_t)info.DispVertStart + size * size > dispvert_count)
+                continue;
+            surface.size = size;
+            surface.numtriangles = 2 * (size - 1) * (size - 1);
+            vertex_total += size * size;
+            triangle_total += surface.numtriangles;
+        }
+        for (int axis = 0; axis < 3; axis++)
+            base[axis].resize(vertex_total);
+        x.resize(vertex_total);
+        y.resize(vertex_total);
+        z.resize(vertex_total);
+        alpha.resize(vertex_total);
+        indices.resize(triangle_total * 3);
+        tags.resize(triangle_total);
+
+        auto build = [&](size_t d) {
+            DispSurface &surface = surfaces[d];
+            if (surface.size == 0)
+                return;
+            const ddispinfo_t &info = dispinfos[d];
+            Vector corners[4];
+            if (!FaceCorners(faces[info.MapFace], surfedges, surfedge_count, edges, edge_count, vertexes, vertex_count, info.startPosition, corners))
+            {
+                // Keeps its slot but nothing refers to it.
+                memset(&x[surface.firstvertex], 0, surface.size * surface.size * sizeof(float));
+                memset(&y[surface.firstvertex], 0, surface.size * surface.size * sizeof(float));
+                memset(&z[surface.firstvertex], 0, surface.size * surface.size * sizeof(float));
+                memset(&alpha[surface.firstvertex], 0, surface.size * surface.size * sizeof(float));
+                memset(&indices[(size_t)surface.firsttriangle * 3], 0, surface.numtriangles * 3 * sizeof(unsigned int));
+                memset(&tags[surface.firsttriangle], 0, surface.numtriangles * sizeof(unsigned short));
+                surface.size = 0;
+                surface.numtriangles = 0;
+                return;
+            }
+            Tessellate(surface, corners, dispverts + info.DispVertStart);
+            Triangulate(surface, disptris, disptri_count, info.DispTriStart);
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, disp_count, 16, build);
+        else
+        {
+            for (size_t d = 0; d < disp_count; d++)
+                build(d);
+        }
+
+        Stitch(dispinfos);
+        for (int axis = 0; axis < 3; axis++)
+            std::vector<float>().swap(base[axis]);
+    }
+
+    // Builds from a Bsp or BspSnapshot, compressed lumps included.
+    template<typename Source>
+    void Build(Source &bsp, ThreadPool *pool = nullptr) {
+        std::vector<char> info_data, vert_data, tri_data, surfedge_data, edge_data, vertex_data;
+        bsp.ReadLump(LUMP_DISPINFO, info_data);
+        bsp.ReadLump(LUMP_DISP_VERTS, vert_data);
+        bsp.ReadLump(LUMP_DISP_TRIS, tri_data);
+        bsp.ReadLump(LUMP_SURFEDGES, surfedge_data);
+        bsp.ReadLump(LUMP_EDGES, edge_data);
+        bsp.ReadLump(LUMP_VERTEXES, vertex_data);
+        // Faces are converted from whatever layout the profile uses.
+        std::vector<dface_t> in_faces;
+        bsp.ReadFaces(in_faces);
+
+        std::vector<ddispinfo_t> infos(info_data.size() / sizeof(ddispinfo_t));
+        std::vector<dDispVert> verts(vert_data.size() / sizeof(dDispVert));
+        std::vector<CDispTri> tris(tri_data.size() / sizeof(CDispTri));
+        std::vector<int> in_surfedges(surfedge_data.size() / sizeof(int));
+        std::vector<dedge_t> in_edges(edge_data.size() / sizeof(dedge_t));
+        std::vector<Vector> in_vertexes(vertex_data.size() / sizeof(Vector));
+        memcpy((void *)infos.data(), info_data.data(), infos.size() * sizeof(ddispinfo_t));
+        memcpy((void *)verts.data(), vert_data.data(), verts.size() * sizeof(dDispVert));
+        memcpy((void *)tris.data(), tri_data.data(), tris.size() * sizeof(CDispTri));
+        memcpy((void *)in_surfedges.data(), surfedge_data.data(), in_surfedges.size() * sizeof(int));
+        memcpy((void *)in_edges.data(), edge_data.data(), in_edges.size() * sizeof(dedge_t));
+        memcpy((void *)in_vertexes.data(), vertex_data.data(), in_vertexes.size() * sizeof(Vector));
+        Build(infos.data(), infos.size(), verts.data(), verts.size(), tris.data(), tris.size(), in_faces.data(), in_faces.size(),
+              in_surfedges.data(), in_surfedges.size(), in_edges.data(), in_edges.size(), in_vertexes.data(), in_vertexes.size(), pool);
+    }
+
+    inline size_t GetVertexCount() const {
+        return x.size();
+    }
+};
+
+#endif // BSP_DISPLACEMENT_H
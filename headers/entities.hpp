@@ -0,0 +1,553 @@
+#pragma once
+
+#ifndef BSP_ENTITIES_H
+#define BSP_ENTITIES_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include "instrument.hpp"
+#include "snapshot.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+struct EntityPair
+{
+    std::string_view key;
+    std::string_view value;
+};
+
+// The entity lump parsed into key/value pairs that point straight into the lump, nothing is copied.
+// Entities keep their index for the whole life of the parse, removed ones are only flagged.
+// Keys are compared case-insensitively like the engine does, the classname/targetname indexes match values exactly.
+// Escaped quotes (\") are kept as written, in the views and when serializing.
+class EntityList
+{
+private:
+    struct Entity
+    {
+        size_t firstpair;
+        size_t numpairs;
+        bool removed;
+    };
+
+    // Value -> entities, open addressing over the distinct values with the entities of a value chained.
+    class ValueIndex
+    {
+    private:
+        static const size_t NONE = SIZE_MAX;
+
+        struct Slot
+        {
+            std::string_view value;
+            size_t head; // First node, NONE if the slot is empty
+        };
+
+        struct Node
+        {
+            size_t entity; // NONE once removed
+            size_t next;
+        };
+
+        std::vector<Slot> slots;
+        std::vector<Node> nodes;
+        size_t used;
+
+        // 8 bytes at a time, values are mostly short names.
+        static inline size_t Hash(std::string_view value) {
+            uint64_t h = value.size() * 0x9E3779B97F4A7C15ull;
+            size_t i = 0;
+            for (; i + 8 <= value.size(); i += 8)
+            {
+                uint64_t word;
+                memcpy(&word, value.data() + i, 8);
+                h = (h ^ word) * 0xC2B2AE3D27D4EB4Full;
+                h ^= h >> 29;
+            }
+            uint64_t last = 0;
+            memcpy(&last, value.data() + i, value.size() - i);
+            h = (h ^ last) * 0xC2B2AE3D27D4EB4Full;
+            return (size_t)(h ^ (h >> 32));
+        }
+
+        // Slot of value, or the empty slot it would go in.
+        size_t Find(std::string_view value) const {
+            size_t mask = slots.size() - 1;
+            for (size_t slot = Hash(value) & mask;; slot = (slot + 1) & mask)
+            {
+                if (slots[slot].head == NONE || slots[slot].value == value)
+                    return slot;
+            }
+        }
+
+        void Grow() {
+            std::vector<Slot> old;
+            old.swap(slots);
+            slots.assign(old.empty() ? 64 : old.size() * 2, {std::string_view(), NONE});
+            for (const Slot &slot : old)
+            {
+                if (slot.head != NONE)
+                    slots[Find(slot.value)] = slot;
+            }
+        }
+
+    public:
+        ValueIndex() : used(0) {}
+
+        void Clear(size_t expected) {
+            size_t size = 64;
+            while (size < expected * 2)
+                size <<= 1;
+            slots.assign(size, {std::string_view(), NONE});
+            nodes.clear();
+            used = 0;
+        }
+
+        void Insert(std::string_view value, size_t entity) {
+            if ((used + 1) * 2 > slots.size())
+                Grow();
+            size_t slot = Find(value);
+            if (slots[slot].head == NONE)
+            {
+                slots[slot].value = value;
+                used++;
+            }
+            nodes.push_back({entity, slots[slot].head});
+            slots[slot].head = nodes.size() - 1;
+        }
+
+        void Remove(std::string_view value, size_t entity) {
+            if (slots.empty())
+                return;
+            for (size_t node = slots[Find(value)].head; node != NONE; node = nodes[node].next)
+            {
+                if (nodes[node].entity == entity)
+                {
+                    nodes[node].entity = NONE;
+                    return;
+                }
+            }
+        }
+
+        // Entities with value in ascending order.
+        std::vector<size_t> Lookup(std::string_view value) const {
+            std::vector<size_t> result;
+            if (slots.empty())
+                return result;
+            for (size_t node = slots[Find(value)].head; node != NONE; node = nodes[node].next)
+            {
+                if (nodes[node].entity != NONE)
+                    result.push_back(nodes[node].entity);
+            }
+            std::sort(result.begin(), result.end());
+            return result;
+        }
+    };
+
+    std::vector<char> storage;            // Copy of the lump when it couldn't be used in place
+    std::deque<std::string> owned;        // Keys and values set after the parse, deque so they never move
+    std::vector<EntityPair> pairs;
+    std::vector<Entity> entities;
+    size_t error_offset;
+    // Built on the first lookup, parsing alone doesn't pay for them.
+    mutable ValueIndex classnames;
+    mutable ValueIndex targetnames;
+    mutable bool indexed;
+
+    // Bit i is set if block[i] is '{', '}', '"' or NUL.
+    static inline uint64_t TokenMask(const char *block) {
+#if defined(__AVX2__)
+        const __m256i open = _mm256_set1_epi8('{'), close = _mm256_set1_epi8('}');
+        const __m256i quote = _mm256_set1_epi8('"'), zero = _mm256_setzero_si256();
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; i += 32)
+        {
+            __m256i bytes = _mm256_loadu_si256((const __m256i *)(block + i));
+            __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, open), _mm256_cmpeq_epi8(bytes, close)),
+                                           _mm256_or_si256(_mm256_cmpeq_epi8(bytes, quote), _mm256_cmpeq_epi8(bytes, zero)));
+            mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(hits) << i;
+        }
+        return mask;
+#elif defined(__SSE2__)
+        const __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+        const __m128i quote = _mm_set1_epi8('"'), zero = _mm_setzero_si128();
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+            __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, open), _mm_cmpeq_epi8(bytes, close)),
+                                        _mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, zero)));
+            mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(hits) << i;
+        }
+        return mask;
+#else
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; i++)
+        {
+            char c = block[i];
+            if (c == '{' || c == '}' || c == '"' || c == '\0')
+                mask |= (uint64_t)1 << i;
+        }
+        return mask;
+#endif
+    }
+
+    // A quote after an odd number of backslashes (after start) doesn't end the string.
+    static inline bool IsEscaped(const char *data, size_t quote, size_t start) {
+        size_t slash = quote;
+        while (slash > start && data[slash - 1] == '\\')
+            slash--;
+        return (quote - slash) % 2 != 0;
+    }
+
+    static bool KeyEquals(std::string_view a, std::string_view b) {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            char x = a[i], y = b[i];
+            if (x >= 'A' && x <= 'Z')
+                x += 'a' - 'A';
+            if (y >= 'A' && y <= 'Z')
+                y += 'a' - 'A';
+            if (x != y)
+                return false;
+        }
+        return true;
+    }
+
+    // Index to keep up to date when key changes, nullptr if there is none (or they aren't built yet).
+    ValueIndex* IndexFor(std::string_view key) const {
+        if (!indexed)
+            return nullptr;
+        if (KeyEquals(key, "classname"))
+            return &classnames;
+        if (KeyEquals(key, "targetname"))
+            return &targetnames;
+        return nullptr;
+    }
+
+    void BuildIndexes() const {
+        if (indexed)
+            return;
+        classnames.Clear(64);
+        targetnames.Clear(64);
+        for (size_t e = 0; e < entities.size(); e++)
+        {
+            if (entities[e].removed)
+                continue;
+            const EntityPair *pair = &pairs[entities[e].firstpair];
+            for (size_t i = 0; i < entities[e].numpairs; i++, pair++)
+            {
+                if (KeyEquals(pair->key, "classname"))
+                    classnames.Insert(pair->value, e);
+                else if (KeyEquals(pair->key, "targetname"))
+                    targetnames.Insert(pair->value, e);
+            }
+        }
+        indexed = true;
+    }
+
+    std::string_view Own(std::string_view text) {
+        owned.emplace_back(text);
+        return owned.back();
+    }
+
+public:
+    EntityList() : error_offset(0), indexed(false) {}
+
+    // The views point into the list or the lump, copying would leave them pointing at the original.
+    EntityList(const EntityList &other) = delete;
+    EntityList& operator=(const EntityList &other) = delete;
+
+    // Parses size bytes of entity text, stopping at the first NUL. The data has to outlive the list.
+    // The text is scanned 64 bytes at a time into a bit mask of the bytes that matter, only those are looked at.
+    // Returns 0 on success, 1 on a syntax error (see GetErrorOffset()), entities before the error are kept.
+    int Parse(const char *data, size_t size) {
+        BSP_TRACE_SCOPE("EntityList::Parse");
+        owned.clear();
+        pairs.clear();
+        entities.clear();
+        error_offset = 0;
+        indexed = false;
+
+        bool inside = false;   // between braces
+        bool instring = false;
+        bool haskey = false;
+        size_t start = 0;      // first byte of the current string
+        std::string_view key;
+        int result = 0;
+        size_t position = size;
+        for (size_t base = 0; base < size && result == 0; base += 64)
+        {
+            uint64_t mask;
+            if (size - base >= 64)
+                mask = TokenMask(data + base);
+            else
+            {
+                // Spaces past the end don't match anything.
+                char block[64];
+                memset(block, ' ', sizeof(block));
+                memcpy(block, data + base, size - base);
+                mask = TokenMask(block);
+            }
+
+            for (; mask != 0; mask &= mask - 1)
+            {
+                size_t i = base + __builtin_ctzll(mask);
+                char c = data[i];
+                if (instring)
+                {
+                    if (c != '"' || IsEscaped(data, i, start))
+                        continue;
+                    std::string_view token(data + start, i - start);
+                    if (haskey)
+                    {
+                        pairs.push_back({key, token});
+                        entities.back().numpairs++;
+                    }
+                    else
+                        key = token;
+                    haskey = !haskey;
+                    instring = false;
+                    continue;
+                }
+                if (c == '\0')
+                {
+                    position = i;
+                    break;
+                }
+                if (c == '"' ? !inside : (c == '{') == inside || haskey)
+                {
+                    position = i;
+                    result = 1;
+                    break;
+                }
+                if (c == '"')
+                {
+                    instring = true;
+                    start = i + 1;
+                    continue;
+                }
+                if (c == '{')
+                    entities.push_back({pairs.size(), 0, false});
+                inside = !inside;
+            }
+            if (position != size)
+                break;
+        }
+        if (result == 0 && (inside || instring))
+            result = 1;
+        if (result != 0)
+        {
+            error_offset = instring ? start - 1 : position;
+            if (inside)
+            {
+                // Drop the entity that was cut off.
+                pairs.resize(entities.back().firstpair);
+                entities.pop_back();
+            }
+        }
+        return result;
+    }
+
+    // Parses the entity lump in place when it's mapped, from a copy otherwise (or if it's compressed).
+    int Parse(Bsp &bsp) {
+        LumpView<char> view = bsp.GetLumpView<char>(LUMP_ENTITIES);
+        if (bsp.IsMapped() && !bsp.IsLumpCompressed(LUMP_ENTITIES) && view.IsValid())
+        {
+            std::vector<char>().swap(storage);
+            return Parse(view.data(), view.size());
+        }
+        bsp.ReadLump(LUMP_ENTITIES, storage);
+        return Parse(storage.data(), storage.size());
+    }
+
+    // Parses the entity lump in place, the snapshot has to outlive the list.
+    int Parse(const BspSnapshot &bsp) {
+        LumpView<char> view = bsp.GetLumpView<char>(LUMP_ENTITIES);
+        if (view.IsValid())
+        {
+            std::vector<char>().swap(storage);
+            return Parse(view.data(), view.size());
+        }
+        bsp.ReadLump(LUMP_ENTITIES, storage);
+        return Parse(storage.data(), storage.size());
+    }
+
+    // Byte offset of the syntax error of the last Parse().
+    inline size_t GetErrorOffset() const {
+        return error_offset;
+    }
+
+    // Number of entities, removed ones included.
+    inline size_t size() const {
+        return entities.size();
+    }
+
+    inline bool IsRemoved(size_t entity) const {
+        return entity >= entities.size() || entities[entity].removed;
+    }
+
+    inline size_t GetPairCount(size_t entity) const {
+        return entity < entities.size() ? entities[entity].numpairs : 0;
+    }
+
+    // GetPairCount() pairs in file order, nullptr if the index is out of range.
+    inline const EntityPair* GetPairs(size_t entity) const {
+        return entity < entities.size() ? pairs.data() + entities[entity].firstpair : nullptr;
+    }
+
+    // Value of the first pair with key, empty if there is none.
+    std::string_view GetValue(size_t entity, std::string_view key) const {
+        const EntityPair *pair = GetPairs(entity);
+        for (size_t i = 0; i < GetPairCount(entity); i++, pair++)
+        {
+            if (KeyEquals(pair->key, key))
+                return pair->value;
+        }
+        return std::string_view();
+    }
+
+    // Entities with that classname/targetname in file order, removed ones left out.
+    // The first call builds the indexes, so it isn't safe to make from several threads at once.
+    std::vector<size_t> FindByClassname(std::string_view classname) const {
+        BuildIndexes();
+        return classnames.Lookup(classname);
+    }
+
+    std::vector<size_t> FindByTargetname(std::string_view targetname) const {
+        BuildIndexes();
+        return targetnames.Lookup(targetname);
+    }
+
+    // Sets the value of the first pair with key, adds the pair if there is none. Both strings are copied.
+    void SetValue(size_t entity, std::string_view key, std::string_view value) {
+        if (entity >= entities.size() || entities[entity].removed)
+            return;
+        Entity &target = entities[entity];
+        ValueIndex *index = IndexFor(key);
+        value = Own(value);
+        for (size_t i = 0; i < target.numpairs; i++)
+        {
+            EntityPair &pair = pairs[target.firstpair + i];
+            if (!KeyEquals(pair.key, key))
+                continue;
+            if (index != nullptr)
+            {
+                index->Remove(pair.value, entity);
+                index->Insert(value, entity);
+            }
+            pair.value = value;
+            return;
+        }
+
+        // The pairs of an entity have to stay contiguous, move them to the end unless they already are.
+        if (target.firstpair + target.numpairs != pairs.size())
+        {
+            size_t first = pairs.size();
+            for (size_t i = 0; i < target.numpairs; i++)
+                pairs.push_back(pairs[target.firstpair + i]);
+            target.firstpair = first;
+        }
+        pairs.push_back({Own(key), value});
+        target.numpairs++;
+        if (index != nullptr)
+            index->Insert(value, entity);
+    }
+
+    // Removes every pair with key. Returns false if there was none.
+    bool RemoveKey(size_t entity, std::string_view key) {
+        if (entity >= entities.size() || entities[entity].removed)
+            return false;
+        Entity &target = entities[entity];
+        ValueIndex *index = IndexFor(key);
+        size_t kept = 0;
+        for (size_t i = 0; i < target.numpairs; i++)
+        {
+            EntityPair pair = pairs[target.firstpair + i];
+            if (!KeyEquals(pair.key, key))
+                pairs[target.firstpair + kept++] = pair;
+            else if (index != nullptr)
+                index->Remove(pair.value, entity);
+        }
+        bool removed = kept != target.numpairs;
+        target.numpairs = kept;
+        return removed;
+    }
+
+    // Adds an empty entity at the end, returns its index.
+    size_t AddEntity() {
+        entities.push_back({pairs.size(), 0, false});
+        return entities.size() - 1;
+    }
+
+    void RemoveEntity(size_t entity) {
+        if (entity >= entities.size() || entities[entity].removed)
+            return;
+        const EntityPair *pair = GetPairs(entity);
+        for (size_t i = 0; i < entities[entity].numpairs; i++, pair++)
+        {
+            ValueIndex *index = IndexFor(pair->key);
+            if (index != nullptr)
+                index->Remove(pair->value, entity);
+        }
+        entities[entity].removed = true;
+    }
+
+    // Writes the entities back as entity lump text, NUL terminated like the compile tools do.
+    // For a lump of another size hand the result to BspRelayout::SetLump(LUMP_ENTITIES, ...).
+    void Serialize(std::string &out) const {
+        size_t length = 1;
+        for (const Entity &entity : entities)
+        {
+            if (entity.removed)
+                continue;
+            length += 4;
+            for (size_t i = 0; i < entity.numpairs; i++)
+                length += pairs[entity.firstpair + i].key.size() + pairs[entity.firstpair + i].value.size() + 6;
+        }
+        out.clear();
+        out.reserve(length);
+        for (const Entity &entity : entities)
+        {
+            if (entity.removed)
+                continue;
+            out += "{\n";
+            for (size_t i = 0; i < entity.numpairs; i++)
+            {
+                const EntityPair &pair = pairs[entity.firstpair + i];
+                out += '"';
+                out += pair.key;
+                out += "\" \"";
+                out += pair.value;
+                out += "\"\n";
+            }
+            out += "}\n";
+        }
+        out += '\0';
+    }
+
+    // Writes the entities over the entity lump of bsp through its lump writer, the rest of the lump is zeroed.
+    // Returns false if they don't fit in the lump (use BspRelayout then) or the lump is compressed.
+    // Views into a mapped lump change with it, Parse() again afterwards.
+    bool Write(Bsp &bsp) const {
+        std::string text;
+        Serialize(text);
+        bsp.SelectLump<char>(LUMP_ENTITIES);
+        if (bsp.IsLumpCompressed(LUMP_ENTITIES) || text.size() > (size_t)bsp.GetLumpDataSize())
+            return false;
+        text.resize(bsp.GetLumpDataSize(), '\0');
+        return bsp.WriteLumpElements<char>(text.data(), text.size()) == text.size();
+    }
+};
+
+#endif // BSP_ENTITIES_H
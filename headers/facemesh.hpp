@@ -0,0 +1,232 @@
+#pragma once
+
+#ifndef BSP_FACEMESH_H
+#define BSP_FACEMESH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include "threadpool.hpp"
+#include <vector>
+
+// Triangles of all the faces of one model with the vertices they share merged.
+struct FaceMesh
+{
+    std::vector<Vector> vertices;
+    std::vector<unsigned int> indices;        // triangle list, same winding as the faces
+    std::vector<unsigned int> triangle_faces; // face (index into LUMP_FACES) of every triangle
+};
+
+// Turns faces into indexed triangle meshes, one per model.
+// Each face walks its surfedges (negative ones use the edge backwards) and is triangulated as a fan,
+// vertices at the same position are merged through a hash table.
+class FaceMeshExtractor
+{
+private:
+    // Position -> output vertex, open addressing.
+    class VertexTable
+    {
+    private:
+        std::vector<unsigned int> slots; // output vertex + 1, 0 is empty
+        size_t mask;
+
+        static inline uint32_t Bits(float f) {
+            if (f == 0.0f)
+                f = 0.0f; // -0 and 0 are the same point
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            return bits;
+        }
+
+        static inline size_t Hash(const Vector &v) {
+            uint64_t h = Bits(v.x) * 0x9E3779B97F4A7C15ull;
+            h ^= Bits(v.y) * 0xC2B2AE3D27D4EB4Full;
+            h ^= Bits(v.z) * 0x165667B19E3779F9ull;
+            return (size_t)(h ^ (h >> 29));
+        }
+
+    public:
+        VertexTable(size_t expected)
+        {
+            size_t size = 16;
+            while (size < expected * 2)
+                size <<= 1;
+            slots.assign(size, 0);
+            mask = size - 1;
+        }
+
+        // Index of v in vertices, appended if it's new.
+        unsigned int Insert(const Vector &v, std::vector<Vector> &vertices) {
+            for (size_t slot = Hash(v) & mask;; slot = (slot + 1) & mask)
+            {
+                if (slots[slot] == 0)
+                {
+                    vertices.push_back(v);
+                    slots[slot] = (unsigned int)vertices.size();
+                    return slots[slot] - 1;
+                }
+                const Vector &other = vertices[slots[slot] - 1];
+                if (Bits(other.x) == Bits(v.x) && Bits(other.y) == Bits(v.y) && Bits(other.z) == Bits(v.z))
+                    return slots[slot] - 1;
+            }
+        }
+    };
+
+    const dface_t *faces;
+    size_t face_count;
+    const int *surfedges;
+    size_t surfedge_count;
+    const dedge_t *edges;
+    size_t edge_count;
+    const Vector *vertexes;
+    size_t vertex_count;
+    std::vector<unsigned int> remap; // Lump vertex -> merged vertex of the current model
+    std::vector<size_t> remap_model; // Model + 1 the remap entry belongs to, so it isn't cleared between models
+
+    // Vertex (index into LUMP_VERTEXES) at corner k of the face, -1 if out of range.
+    inline int Corner(const dface_t &face, int k) const {
+        int surfedge = surfedges[face.firstedge + k];
+        size_t edge = surfedge >= 0 ? surfedge : -(int64_t)surfedge;
+        if (edge >= edge_count)
+            return -1;
+        int vertex = edges[edge].v[surfedge >= 0 ? 0 : 1];
+        return (size_t)vertex < vertex_count ? vertex : -1;
+    }
+
+    // Triangle count of a face, 0 if its edges are out of range.
+    inline size_t TriangleCount(size_t f) const {
+        const dface_t &face = faces[f];
+        if (face.numedges < 3 || face.firstedge < 0 || (size_t)face.firstedge + face.numedges > surfedge_count)
+            return 0;
+        for (int k = 0; k < face.numedges; k++)
+        {
+            if (Corner(face, k) < 0)
+                return 0;
+        }
+        return face.numedges - 2;
+    }
+
+    void ExtractModel(size_t model, size_t firstface, size_t numfaces, FaceMesh &mesh, ThreadPool *pool) {
+        // Triangle offsets of every face from a prefix sum over the counts, so faces can be written in parallel.
+        std::vector<size_t> start(numfaces + 1, 0);
+        auto count = [this, firstface, &start](size_t i) {
+            start[i + 1] = TriangleCount(firstface + i);
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, numfaces, 1024, count);
+        else
+        {
+            for (size_t i = 0; i < numfaces; i++)
+                count(i);
+        }
+        // A fan of n triangles has n + 2 corners, the table has to hold all of them if none are shared.
+        size_t corners = 0;
+        for (size_t i = 0; i < numfaces; i++)
+        {
+            corners += start[i + 1] > 0 ? start[i + 1] + 2 : 0;
+            start[i + 1] += start[i];
+        }
+        size_t triangles = start[numfaces];
+
+        // The fans first use the vertex indices of the lump, merged afterwards.
+        mesh.indices.resize(triangles * 3);
+        mesh.triangle_faces.resize(triangles);
+        auto triangulate = [this, firstface, &start, &mesh](size_t i) {
+            size_t f = firstface + i;
+            const dface_t &face = faces[f];
+            size_t triangle = start[i];
+            int count = (int)(start[i + 1] - start[i]);
+            if (count == 0)
+                return;
+            unsigned int first = Corner(face, 0);
+            unsigned int *out = &mesh.indices[triangle * 3];
+            for (int k = 1; k <= count; k++)
+            {
+                *out++ = first;
+                *out++ = Corner(face, k);
+                *out++ = Corner(face, k + 1);
+                mesh.triangle_faces[triangle++] = (unsigned int)f;
+            }
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, numfaces, 256, triangulate);
+        else
+        {
+            for (size_t i = 0; i < numfaces; i++)
+                triangulate(i);
+        }
+
+        // Every lump vertex the model uses gets its merged index once.
+        VertexTable table(std::min(corners, vertex_count));
+        mesh.vertices.clear();
+        for (unsigned int &index : mesh.indices)
+        {
+            if (remap_model[index] != model + 1)
+            {
+                remap[index] = table.Insert(vertexes[index], mesh.vertices);
+                remap_model[index] = model + 1;
+            }
+            index = remap[index];
+        }
+    }
+
+public:
+    FaceMeshExtractor() : faces(nullptr), face_count(0), surfedges(nullptr), surfedge_count(0), edges(nullptr), edge_count(0), vertexes(nullptr), vertex_count(0) {}
+
+    // Fills meshes with one mesh per model. The lumps have to stay alive during the call only.
+    void Extract(const dmodel_t *models, size_t model_count, const dface_t *faces, size_t face_count, const int *surfedges, size_t surfedge_count,
+                 const dedge_t *edges, size_t edge_count, const Vector *vertexes, size_t vertex_count, std::vector<FaceMesh> &meshes, ThreadPool *pool = nullptr) {
+        this->faces = faces;
+        this->face_count = face_count;
+        this->surfedges = surfedges;
+        this->surfedge_count = surfedge_count;
+        this->edges = edges;
+        this->edge_count = edge_count;
+        this->vertexes = vertexes;
+        this->vertex_count = vertex_count;
+
+        remap.assign(vertex_count, 0);
+        remap_model.assign(vertex_count, 0);
+        meshes.clear();
+        meshes.resize(model_count);
+        for (size_t m = 0; m < model_count; m++)
+        {
+            // Clamp the face range to the lump.
+            size_t firstface = models[m].firstface < 0 ? face_count : (size_t)models[m].firstface;
+            firstface = firstface < face_count ? firstface : face_count;
+            size_t numfaces = models[m].numfaces < 0 ? 0 : (size_t)models[m].numfaces;
+            numfaces = numfaces < face_count - firstface ? numfaces : face_count - firstface;
+            ExtractModel(m, firstface, numfaces, meshes[m], pool);
+        }
+    }
+
+    // Extracts from a Bsp or BspSnapshot, compressed lumps included.
+    template<typename Source>
+    void Extract(Source &bsp, std::vector<FaceMesh> &meshes, ThreadPool *pool = nullptr) {
+        BSP_TRACE_SCOPE("FaceMeshExtractor::Extract");
+        std::vector<char> model_data, surfedge_data, edge_data, vertex_data;
+        bsp.ReadLump(LUMP_MODELS, model_data);
+        bsp.ReadLump(LUMP_SURFEDGES, surfedge_data);
+        bsp.ReadLump(LUMP_EDGES, edge_data);
+        bsp.ReadLump(LUMP_VERTEXES, vertex_data);
+        // Faces are converted from whatever layout the profile uses.
+        std::vector<dface_t> in_faces;
+        bsp.ReadFaces(in_faces);
+
+        // std::vector<char> storage is only guaranteed to be aligned for char, copy into the real types.
+        std::vector<dmodel_t> models(model_data.size() / sizeof(dmodel_t));
+        std::vector<int> in_surfedges(surfedge_data.size() / sizeof(int));
+        std::vector<dedge_t> in_edges(edge_data.size() / sizeof(dedge_t));
+        std::vector<Vector> in_vertexes(vertex_data.size() / sizeof(Vector));
+        memcpy((void *)models.data(), model_data.data(), models.size() * sizeof(dmodel_t));
+        memcpy((void *)in_surfedges.data(), surfedge_data.data(), in_surfedges.size() * sizeof(int));
+        memcpy((void *)in_edges.data(), edge_data.data(), in_edges.size() * sizeof(dedge_t));
+        memcpy((void *)in_vertexes.data(), vertex_data.data(), in_vertexes.size() * sizeof(Vector));
+        Extract(models.data(), models.size(), in_faces.data(), in_faces.size(), in_surfedges.data(), in_surfedges.size(),
+                in_edges.data(), in_edges.size(), in_vertexes.data(), in_vertexes.size(), meshes, pool);
+    }
+};
+
+#endif // BSP_FACEMESH_H
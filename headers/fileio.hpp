@@ -1,7 +1,10 @@
 #pragma once
+#include "instrument.hpp"
 #include <stdio.h>
 #include <stdlib.h>
 #include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define NULLIFYSTACK(array) \
     memset(array, 0, sizeof(array))
@@ -9,6 +12,10 @@
     memcpy(array, other, sizeof(array))
 #define STRSTACKCPY(str, other) \
     strncpy(str, other, sizeof(str) - 1)
+#define CLAMPELEMENTS(elements, bytes, elem_size) \
+    ( (elements) < (bytes) / (elem_size) ? (elements) : (bytes) / (elem_size) )
+
+#define SEEK_STACK_DEPTH 8
 
 class File
 {
@@ -17,24 +24,85 @@ private:
     size_t size;
     char mode[4];
     char filepath[256];
+    char *mapping; // Whole file mapping, nullptr when using stdio
+    int backend;
 
 protected:
     size_t count[2]; // Data-read and Data-written
     ssize_t seek[2]; // Read-seek and Write-seek
-    ssize_t old_seek[2]; // For RevertReadPtr() and RevertWritePtr()
+    ssize_t old_seek[2][SEEK_STACK_DEPTH]; // Saved pointers for RevertReadPtr() and RevertWritePtr(), so Set/Revert pairs can nest
+    size_t seek_depth[2];
     // Access with <member>[READ] and <member>[WRITE]
 
+    // Maps the whole file with the given backend.
+    // Returns false (and stays on stdio) if the file is empty or cannot be mapped.
+    bool Map(int new_backend) {
+        if (new_backend == BACKEND_STDIO || size == 0 || fileptr == nullptr)
+            return false;
+        int prot = PROT_READ;
+        int flags = MAP_PRIVATE;
+        if (new_backend == BACKEND_MMAP_WRITE)
+        {
+            prot |= PROT_WRITE;
+            flags = MAP_SHARED;
+        }
+        fflush(fileptr);
+        void *addr = mmap(nullptr, size, prot, flags, fileno(fileptr), 0);
+        if (addr == MAP_FAILED)
+            return false;
+        mapping = (char *)addr;
+        backend = new_backend;
+        return true;
+    }
+
+    // Saves the current pointer, the oldest one is dropped when the stack is full.
+    inline void PushSeek(int which) {
+        if (seek_depth[which] == SEEK_STACK_DEPTH)
+        {
+            memmove(&old_seek[which][0], &old_seek[which][1], sizeof(ssize_t) * (SEEK_STACK_DEPTH - 1));
+            seek_depth[which]--;
+        }
+        old_seek[which][seek_depth[which]++] = seek[which];
+    }
+
+    inline void PopSeek(int which) {
+        if (seek_depth[which] > 0)
+            seek[which] = old_seek[which][--seek_depth[which]];
+    }
+
+    void Unmap() {
+        if (mapping != nullptr)
+            munmap(mapping, size);
+        mapping = nullptr;
+        backend = BACKEND_STDIO;
+    }
+
 public:
-    File(const char *__restrict__ path)
+    // Backends, picked when constructing the file.
+    // With the mmap backends the whole file is mapped once and Read()/Write() become memcpy's, no syscalls.
+    // BACKEND_MMAP_WRITE writes straight into the file but cannot grow it.
+    enum
+    {
+        BACKEND_STDIO = 0,
+        BACKEND_MMAP_READ = 1,
+        BACKEND_MMAP_WRITE = 2,
+    };
+
+    File(const char *__restrict__ path, int backend = BACKEND_STDIO)
     {
         NULLIFYSTACK(mode);
-        STRSTACKCPY(mode, "rb+");
+        STRSTACKCPY(mode, backend == BACKEND_MMAP_READ ? "rb" : "rb+");
         STRSTACKCPY(filepath, path);
-        if (Exists(path))
+        if (backend == BACKEND_MMAP_READ)
+            fileptr = fopen(path, "rb");
+        else if (Exists(path))
             fileptr = fopen(path, "rb+");
         else if (Accessible(path))
             fileptr = fopen(path, "wb+");
         else
+            fileptr = nullptr;
+
+        if (fileptr == nullptr)
         {
             perror("fopen");
             abort();
@@ -46,17 +114,23 @@ public:
 
         NULLIFYSTACK(seek);
         NULLIFYSTACK(old_seek);
+        NULLIFYSTACK(seek_depth);
         NULLIFYSTACK(count);
 
+        mapping = nullptr;
+        this->backend = BACKEND_STDIO;
+        Map(backend);
     }
     virtual ~File()
     {
+        Unmap();
         if (fileptr != nullptr)
             fclose(fileptr);
         fileptr = nullptr;
         size = 0;
         NULLIFYSTACK(seek);
         NULLIFYSTACK(old_seek);
+        NULLIFYSTACK(seek_depth);
         NULLIFYSTACK(count);
         NULLIFYSTACK(filepath);
         NULLIFYSTACK(mode);
@@ -74,15 +148,20 @@ public:
         size = other.size;
         COPYSTACK(seek, other.seek);
         COPYSTACK(old_seek, other.old_seek);
+        COPYSTACK(seek_depth, other.seek_depth);
         COPYSTACK(count, other.count);
         STRSTACKCPY(filepath, other.filepath);
         STRSTACKCPY(mode, other.mode);
+        mapping = nullptr;
+        backend = BACKEND_STDIO;
+        Map(other.backend);
     }
 
     File& operator=(const File& other)
     {
         if (this != &other)
         {
+            Unmap();
             if (fileptr != nullptr)
                 fclose(fileptr);
 
@@ -90,9 +169,11 @@ public:
             size = other.size;
             COPYSTACK(seek, other.seek);
             COPYSTACK(old_seek, other.old_seek);
+            COPYSTACK(seek_depth, other.seek_depth);
             COPYSTACK(count, other.count);
             STRSTACKCPY(filepath, other.filepath);
             STRSTACKCPY(mode, other.mode);
+            Map(other.backend);
         }
         return *this;
     }
@@ -101,16 +182,22 @@ public:
     {
         fileptr = other.fileptr;
         size = other.size;
+        mapping = other.mapping;
+        backend = other.backend;
         COPYSTACK(seek, other.seek);
         COPYSTACK(old_seek, other.old_seek);
+        COPYSTACK(seek_depth, other.seek_depth);
         COPYSTACK(count, other.count);
         STRSTACKCPY(filepath, other.filepath);
         STRSTACKCPY(mode, other.mode);
 
         other.fileptr = nullptr;
+        other.mapping = nullptr;
+        other.backend = BACKEND_STDIO;
         other.size = 0;
         NULLIFYSTACK(other.seek);
         NULLIFYSTACK(other.old_seek);
+        NULLIFYSTACK(other.seek_depth);
         NULLIFYSTACK(other.count);
         NULLIFYSTACK(other.filepath);
         NULLIFYSTACK(other.mode);
@@ -120,21 +207,28 @@ public:
     {
         if (this != &other)
         {
+            Unmap();
             if (fileptr != nullptr)
                 fclose(fileptr);
 
             fileptr = other.fileptr;
             size = other.size;
+            mapping = other.mapping;
+            backend = other.backend;
             COPYSTACK(seek, other.seek);
             COPYSTACK(old_seek, other.old_seek);
+            COPYSTACK(seek_depth, other.seek_depth);
             COPYSTACK(count, other.count);
             STRSTACKCPY(filepath, other.filepath);
             STRSTACKCPY(mode, other.mode);
 
             other.fileptr = nullptr;
+            other.mapping = nullptr;
+            other.backend = BACKEND_STDIO;
             other.size = 0;
             NULLIFYSTACK(other.seek);
             NULLIFYSTACK(other.old_seek);
+            NULLIFYSTACK(other.seek_depth);
             NULLIFYSTACK(other.count);
             NULLIFYSTACK(other.filepath);
             NULLIFYSTACK(other.mode);
@@ -150,6 +244,22 @@ public:
         return filepath;
     }
 
+    inline int GetBackend() const {
+        return backend;
+    }
+
+    inline bool IsMapped() const {
+        return mapping != nullptr;
+    }
+
+    // Returns a pointer straight into the mapping, or nullptr if the file isn't mapped or the range is out of bounds.
+    // The pointer stays valid for the lifetime of the file, writing through it is only allowed with BACKEND_MMAP_WRITE.
+    inline const char* GetMappedData(size_t offset, size_t length) const {
+        if (mapping == nullptr || offset > size || length > size - offset)
+            return nullptr;
+        return mapping + offset;
+    }
+
     inline ssize_t GetReadPtr() const {
         return seek[READ];
     }
@@ -159,12 +269,12 @@ public:
     }
 
     inline void SetReadPtr(ssize_t offset) {
-        old_seek[READ] = seek[READ];
+        PushSeek(READ);
         seek[READ] = offset;
     }
 
     inline void SetWritePtr(ssize_t offset) {
-        old_seek[WRITE] = seek[WRITE];
+        PushSeek(WRITE);
         seek[WRITE] = offset;
     }
 
@@ -176,42 +286,153 @@ public:
         return count[WRITE];
     }
 
+    // Restores the pointer saved by the matching SetReadPtr(), pairs can be nested up to SEEK_STACK_DEPTH deep.
     inline void RevertReadPtr() {
-        seek[READ] = old_seek[READ];
+        PopSeek(READ);
     }
 
     inline void RevertWritePtr() {
-        seek[WRITE] = old_seek[WRITE];
+        PopSeek(WRITE);
     }
 
+    // Flushes pending stdio writes, needed before positional reads can see them.
+    inline void Flush() {
+        if (fileptr != nullptr)
+            fflush(fileptr);
+    }
+
+    // Returns the amount of bytes read, only whole elements are read.
     template<typename T>
     size_t Read(const T *buffer, size_t elements = 1, ssize_t element_offset = 0) {
         seek[READ] += element_offset * sizeof(T);
-        fseek(fileptr, seek[READ], SEEK_SET);
 
-        size_t bytes_read = fread((void*)buffer, sizeof(T), elements, fileptr);
+        size_t bytes_read = 0;
+        if (mapping != nullptr)
+        {
+            BSP_IO_SCOPE(io, IO_READ);
+            size_t avail = (seek[READ] >= 0 && (size_t)seek[READ] < size) ? size - seek[READ] : 0;
+            bytes_read = CLAMPELEMENTS(elements, avail, sizeof(T)) * sizeof(T);
+            memcpy((void*)buffer, mapping + seek[READ], bytes_read);
+            BSP_IO_BYTES(io, bytes_read);
+        }
+        else
+        {
+            {
+                BSP_IO_SCOPE(io, IO_SEEK);
+                fseek(fileptr, seek[READ], SEEK_SET);
+            }
+            BSP_IO_SCOPE(io, IO_READ);
+            bytes_read = fread((void*)buffer, sizeof(T), elements, fileptr) * sizeof(T);
+            BSP_IO_BYTES(io, bytes_read);
+        }
 
         seek[READ] += bytes_read;
         count[READ] += bytes_read;
         return bytes_read;
     };
 
+    // Returns the amount of bytes written, only whole elements are written.
+    // Does nothing with BACKEND_MMAP_READ, and cannot write past the end of a mapped file.
     template<typename T>
     size_t Write(const T *buffer, size_t elements = 1, ssize_t element_offset = 0) {
+        if (mapping != nullptr && backend != BACKEND_MMAP_WRITE)
+            return 0;
         seek[WRITE] += element_offset * sizeof(T);
-        fseek(fileptr, seek[WRITE], SEEK_SET);
 
-        size_t bytes_written = fwrite((void*)buffer, sizeof(T), elements, fileptr);
+        size_t bytes_written = 0;
+        if (mapping != nullptr)
+        {
+            BSP_IO_SCOPE(io, IO_WRITE);
+            size_t avail = (seek[WRITE] >= 0 && (size_t)seek[WRITE] < size) ? size - seek[WRITE] : 0;
+            bytes_written = CLAMPELEMENTS(elements, avail, sizeof(T)) * sizeof(T);
+            memcpy(mapping + seek[WRITE], (const void*)buffer, bytes_written);
+            BSP_IO_BYTES(io, bytes_written);
+        }
+        else
+        {
+            {
+                BSP_IO_SCOPE(io, IO_SEEK);
+                fseek(fileptr, seek[WRITE], SEEK_SET);
+            }
+            BSP_IO_SCOPE(io, IO_WRITE);
+            bytes_written = fwrite((void*)buffer, sizeof(T), elements, fileptr) * sizeof(T);
+            BSP_IO_BYTES(io, bytes_written);
+        }
 
         seek[WRITE] += bytes_written;
         count[WRITE] += bytes_written;
         return bytes_written;
     };
 
+    // Positional read at a byte offset, like pread().
+    // Doesn't touch the read pointer or the counters, so any number of threads can call it at once.
+    // Returns the amount of bytes read, only whole elements are read.
+    template<typename T>
+    size_t ReadAt(T *buffer, size_t elements, size_t byte_offset) const {
+        BSP_IO_SCOPE(io, IO_READ);
+        size_t avail = byte_offset < size ? size - byte_offset : 0;
+        size_t bytes = CLAMPELEMENTS(elements, avail, sizeof(T)) * sizeof(T);
+        if (bytes == 0)
+            return 0;
+        if (mapping != nullptr)
+        {
+            memcpy((void*)buffer, mapping + byte_offset, bytes);
+            BSP_IO_BYTES(io, bytes);
+            return bytes;
+        }
+
+        size_t done = 0;
+        while (done < bytes)
+        {
+            ssize_t got = pread(fileno(fileptr), (char*)buffer + done, bytes - done, byte_offset + done);
+            if (got <= 0)
+                break;
+            done += got;
+        }
+        BSP_IO_BYTES(io, done);
+        return done - done % sizeof(T);
+    }
+
+    // Positional write at a byte offset, like pwrite().
+    // Doesn't touch the write pointer or the counters. Like Write(), does nothing with BACKEND_MMAP_READ.
+    // Returns the amount of bytes written.
+    template<typename T>
+    size_t WriteAt(const T *buffer, size_t elements, size_t byte_offset) {
+        BSP_IO_SCOPE(io, IO_WRITE);
+        size_t bytes = elements * sizeof(T);
+        if (mapping != nullptr)
+        {
+            if (backend != BACKEND_MMAP_WRITE)
+                return 0;
+            size_t avail = byte_offset < size ? size - byte_offset : 0;
+            bytes = CLAMPELEMENTS(elements, avail, sizeof(T)) * sizeof(T);
+            memcpy(mapping + byte_offset, (const void*)buffer, bytes);
+            BSP_IO_BYTES(io, bytes);
+            return bytes;
+        }
+
+        // Positional writes bypass the stdio buffer.
+        fflush(fileptr);
+        size_t done = 0;
+        while (done < bytes)
+        {
+            ssize_t put = pwrite(fileno(fileptr), (const char*)buffer + done, bytes - done, byte_offset + done);
+            if (put <= 0)
+                break;
+            done += put;
+        }
+        if (byte_offset + done > size)
+            size = byte_offset + done;
+        BSP_IO_BYTES(io, done);
+        return done;
+    }
+
     typedef char (*transform_t)(char, unsigned int, size_t);
     // transformer_func is a function pointer (can be nullptr/NULL) which takes in as an input the character, its index inside the block, and the index of its block, and outputs a character.
     // A return value of 0 indicates the function worked properly.
     int Backup(const char *__restrict__ append, const size_t block_size = BUFSIZ, bool overwrite = false, transform_t transformer_func = nullptr) {
+        BSP_TRACE_SCOPE("File::Backup");
+        BSP_IO_SCOPE(io, IO_BACKUP);
         char *buffer = new char[block_size];
         memset(buffer, 0, block_size);
         strncpy(buffer, filepath, block_size);
@@ -232,7 +453,26 @@ public:
         size_t transfered = 0;
         memset(buffer, 0, block_size);
         fseek(fileptr, 0, SEEK_SET);
-        if (transformer_func == nullptr)
+        if (mapping != nullptr)
+        {
+            // Straight from the mapping, no intermediate reads.
+            size_t index = 0;
+            for (size_t done = 0; done < size; done += transfered, index++)
+            {
+                transfered = size - done < block_size ? size - done : block_size;
+                if (transformer_func == nullptr)
+                {
+                    fwrite(mapping + done, 1, transfered, backup);
+                    continue;
+                }
+                for (size_t i = 0; i < transfered; i++)
+                {
+                    buffer[i] = transformer_func(mapping[done + i], i, index);
+                }
+                fwrite(buffer, 1, transfered, backup);
+            }
+        }
+        else if (transformer_func == nullptr)
         {
             while ((transfered = fread(buffer, 1, block_size, fileptr)) > 0)
             {
@@ -255,6 +495,7 @@ public:
 
         fclose(backup);
         delete[] buffer;
+        BSP_IO_BYTES(io, size);
         return 0;
     }
 
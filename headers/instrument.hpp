@@ -0,0 +1,350 @@
+#pragma once
+
+#ifndef BSP_INSTRUMENT_H
+#define BSP_INSTRUMENT_H
+
+// Optional I/O counters and trace spans, compiled in with -DBSP_INSTRUMENT.
+// Without it every macro below expands to nothing and this header declares nothing else.
+//
+// BSP_TRACE_SCOPE(name)             span from here to the end of the scope, name has to be a string literal
+// BSP_TRACE_SCOPE_LUMP(name, lump)  same, and I/O in the scope is counted against lump
+// BSP_IO_LUMP(lump)                 only counts I/O in the scope against lump
+// BSP_IO_SCOPE(var, op)             times one IO_* operation until the end of the scope
+// BSP_IO_BYTES(var, bytes)          bytes moved by that operation
+
+#ifdef BSP_INSTRUMENT
+
+#include "bspdefs.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+// Operations counted by Instrumentation.
+enum
+{
+    IO_READ = 0,
+    IO_WRITE = 1,
+    IO_SEEK = 2,
+    IO_BACKUP = 3,
+    IO_OPERATIONS = 4,
+};
+
+// Calls, bytes, total latency and a latency histogram (bucket b counts calls of [2^b, 2^(b+1)) ns) of one lump and operation.
+struct IoStats
+{
+    static const int BUCKETS = 32;
+
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t nanoseconds;
+    uint64_t histogram[BUCKETS];
+};
+
+// Process wide counters and spans. Counters are relaxed atomics, spans go to a buffer per thread,
+// so recording never takes a lock shared with other threads.
+class Instrumentation
+{
+private:
+    // Lump HEADER_LUMPS collects I/O outside of any lump (headers, backups, ...).
+    struct Counters
+    {
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> nanoseconds;
+        std::atomic<uint64_t> histogram[IoStats::BUCKETS];
+    };
+
+    struct Event
+    {
+        const char *name;
+        int lump;
+        uint64_t start;
+        uint64_t duration;
+    };
+
+    struct ThreadEvents
+    {
+        std::mutex lock; // Only contended while exporting
+        std::vector<Event> events;
+        unsigned int thread;
+    };
+
+    static inline Counters counters[HEADER_LUMPS + 1][IO_OPERATIONS];
+    static inline std::mutex registry_lock;
+    static inline std::vector<std::shared_ptr<ThreadEvents>> threads; // Kept after their thread exits
+    static inline std::atomic<size_t> event_budget{(size_t)1 << 20};
+    static inline std::atomic<size_t> dropped{0};
+    static inline const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    static ThreadEvents& LocalEvents() {
+        thread_local std::shared_ptr<ThreadEvents> local;
+        if (!local)
+        {
+            local = std::make_shared<ThreadEvents>();
+            std::lock_guard<std::mutex> guard(registry_lock);
+            local->thread = (unsigned int)threads.size() + 1;
+            threads.push_back(local);
+        }
+        return *local;
+    }
+
+    static inline int Bucket(uint64_t nanoseconds) {
+        int bucket = 63 - __builtin_clzll(nanoseconds | 1);
+        return bucket < IoStats::BUCKETS ? bucket : IoStats::BUCKETS - 1;
+    }
+
+    static const char* OperationName(int op) {
+        static const char *const names[IO_OPERATIONS] = {"read", "write", "seek", "backup"};
+        return names[op];
+    }
+
+public:
+    // Nanoseconds since the first use, the clock of every span.
+    static inline uint64_t Now() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    // Lump the I/O of this thread is counted against, -1 for none.
+    static inline int& CurrentLump() {
+        thread_local int lump = -1;
+        return lump;
+    }
+
+    static void RecordIo(int op, uint64_t bytes, uint64_t nanoseconds) {
+        int lump = CurrentLump();
+        Counters &counter = counters[lump >= 0 && lump < HEADER_LUMPS ? lump : HEADER_LUMPS][op];
+        counter.calls.fetch_add(1, std::memory_order_relaxed);
+        counter.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        counter.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+        counter.histogram[Bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Spans past the event limit are only counted as dropped.
+    static void RecordSpan(const char *name, int lump, uint64_t start, uint64_t duration) {
+        size_t budget = event_budget.load(std::memory_order_relaxed);
+        do
+        {
+            if (budget == 0)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        } while (!event_budget.compare_exchange_weak(budget, budget - 1, std::memory_order_relaxed));
+        ThreadEvents &local = LocalEvents();
+        std::lock_guard<std::mutex> guard(local.lock);
+        local.events.push_back(Event{name, lump, start, duration});
+    }
+
+    // Most spans kept in memory from now on (1M by default), so long running processes stay bounded.
+    static void SetEventLimit(size_t limit) {
+        event_budget.store(limit, std::memory_order_relaxed);
+    }
+
+    static inline size_t GetDroppedEvents() {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    // Counters of lump (-1 for I/O outside of lumps) and op, zeroed if either is out of range.
+    static IoStats GetIoStats(int lump, int op) {
+        IoStats stats;
+        memset(&stats, 0, sizeof(IoStats));
+        if (lump < -1 || lump >= HEADER_LUMPS || op < 0 || op >= IO_OPERATIONS)
+            return stats;
+        const Counters &counter = counters[lump >= 0 ? lump : HEADER_LUMPS][op];
+        stats.calls = counter.calls.load(std::memory_order_relaxed);
+        stats.bytes = counter.bytes.load(std::memory_order_relaxed);
+        stats.nanoseconds = counter.nanoseconds.load(std::memory_order_relaxed);
+        for (int b = 0; b < IoStats::BUCKETS; b++)
+            stats.histogram[b] = counter.histogram[b].load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // Drops every counter and span, their room under the event limit is given back.
+    static void Reset() {
+        for (int lump = 0; lump <= HEADER_LUMPS; lump++)
+        {
+            for (int op = 0; op < IO_OPERATIONS; op++)
+            {
+                Counters &counter = counters[lump][op];
+                counter.calls.store(0, std::memory_order_relaxed);
+                counter.bytes.store(0, std::memory_order_relaxed);
+                counter.nanoseconds.store(0, std::memory_order_relaxed);
+                for (int b = 0; b < IoStats::BUCKETS; b++)
+                    counter.histogram[b].store(0, std::memory_order_relaxed);
+            }
+        }
+        std::lock_guard<std::mutex> guard(registry_lock);
+        for (const auto &local : threads)
+        {
+            std::lock_guard<std::mutex> events_guard(local->lock);
+            event_budget.fetch_add(local->events.size(), std::memory_order_relaxed);
+            local->events.clear();
+        }
+        dropped.store(0, std::memory_order_relaxed);
+    }
+
+    // One line per lump and operation that saw any I/O: calls, bytes, total and average latency.
+    static void PrintIoStats(FILE *output) {
+        fprintf(output, "%-6s %-7s %10s %14s %12s %10s\n", "lump", "op", "calls", "bytes", "total ms", "avg us");
+        for (int lump = -1; lump < HEADER_LUMPS; lump++)
+        {
+            for (int op = 0; op < IO_OPERATIONS; op++)
+            {
+                IoStats stats = GetIoStats(lump, op);
+                if (stats.calls == 0)
+                    continue;
+                char name[8];
+                snprintf(name, sizeof(name), lump < 0 ? "-" : "%d", lump);
+                fprintf(output, "%-6s %-7s %10llu %14llu %12.3f %10.3f\n", name, OperationName(op), (unsigned long long)stats.calls,
+                    (unsigned long long)stats.bytes, stats.nanoseconds / 1e6, stats.nanoseconds / 1e3 / stats.calls);
+            }
+        }
+    }
+
+    // Chrome trace JSON (chrome://tracing, Perfetto): every span as a complete event with its lump,
+    // and the I/O counters with their histograms under "bspIoStats", which trace viewers ignore.
+    // Returns 0 on success, 1 if the file couldn't be written.
+    static int WriteChromeTrace(const char *__restrict__ path) {
+        FILE *output = fopen(path, "w");
+        if (output == nullptr)
+            return 1;
+        int pid = (int)getpid();
+        bool first = true;
+        fprintf(output, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+        {
+            std::lock_guard<std::mutex> guard(registry_lock);
+            for (const auto &local : threads)
+            {
+                std::lock_guard<std::mutex> events_guard(local->lock);
+                for (const Event &event : local->events)
+                {
+                    fprintf(output, "%s\n{\"name\":\"%s\",\"cat\":\"bsp\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u",
+                        first ? "" : ",", event.name, event.start / 1e3, event.duration / 1e3, pid, local->thread);
+                    if (event.lump >= 0)
+                        fprintf(output, ",\"args\":{\"lump\":%d}", event.lump);
+                    fputc('}', output);
+                    first = false;
+                }
+            }
+        }
+        fprintf(output, "\n],\"bspIoStats\":[");
+        first = true;
+        for (int lump = -1; lump < HEADER_LUMPS; lump++)
+        {
+            for (int op = 0; op < IO_OPERATIONS; op++)
+            {
+                IoStats stats = GetIoStats(lump, op);
+                if (stats.calls == 0)
+                    continue;
+                fprintf(output, "%s\n{\"lump\":%d,\"op\":\"%s\",\"calls\":%llu,\"bytes\":%llu,\"ns\":%llu,\"histogram\":[",
+                    first ? "" : ",", lump, OperationName(op), (unsigned long long)stats.calls, (unsigned long long)stats.bytes,
+                    (unsigned long long)stats.nanoseconds);
+                for (int b = 0; b < IoStats::BUCKETS; b++)
+                    fprintf(output, b == 0 ? "%llu" : ",%llu", (unsigned long long)stats.histogram[b]);
+                fprintf(output, "]}");
+                first = false;
+            }
+        }
+        fprintf(output, "\n],\"droppedEvents\":%zu}\n", GetDroppedEvents());
+        return fclose(output) == 0 ? 0 : 1;
+    }
+};
+
+// Records a span when it goes out of scope, I/O inside it is counted against its lump (if it has one).
+class TraceSpan
+{
+private:
+    const char *name;
+    int lump;
+    int previous_lump;
+    uint64_t start;
+
+public:
+    TraceSpan(const char *new_name, int new_lump = -1) : name(new_name), lump(new_lump)
+    {
+        previous_lump = Instrumentation::CurrentLump();
+        if (lump >= 0)
+            Instrumentation::CurrentLump() = lump;
+        start = Instrumentation::Now();
+    }
+    ~TraceSpan()
+    {
+        Instrumentation::RecordSpan(name, lump, start, Instrumentation::Now() - start);
+        Instrumentation::CurrentLump() = previous_lump;
+    }
+
+    TraceSpan(const TraceSpan &other) = delete;
+    TraceSpan& operator=(const TraceSpan &other) = delete;
+};
+
+// Counts I/O against a lump without a span.
+class IoLumpScope
+{
+private:
+    int previous_lump;
+
+public:
+    explicit IoLumpScope(int lump)
+    {
+        previous_lump = Instrumentation::CurrentLump();
+        Instrumentation::CurrentLump() = lump;
+    }
+    ~IoLumpScope()
+    {
+        Instrumentation::CurrentLump() = previous_lump;
+    }
+
+    IoLumpScope(const IoLumpScope &other) = delete;
+    IoLumpScope& operator=(const IoLumpScope &other) = delete;
+};
+
+// Times one operation, bytes are filled in before it goes out of scope.
+class IoTimer
+{
+private:
+    int op;
+    uint64_t start;
+
+public:
+    uint64_t bytes;
+
+    explicit IoTimer(int new_op) : op(new_op), start(Instrumentation::Now()), bytes(0) {}
+    ~IoTimer()
+    {
+        Instrumentation::RecordIo(op, bytes, Instrumentation::Now() - start);
+    }
+
+    IoTimer(const IoTimer &other) = delete;
+    IoTimer& operator=(const IoTimer &other) = delete;
+};
+
+#define BSP_INSTRUMENT_CONCAT2(a, b) a##b
+#define BSP_INSTRUMENT_CONCAT(a, b) BSP_INSTRUMENT_CONCAT2(a, b)
+#define BSP_TRACE_SCOPE(name) \
+    TraceSpan BSP_INSTRUMENT_CONCAT(trace_span_, __LINE__)(name)
+#define BSP_TRACE_SCOPE_LUMP(name, lump) \
+    TraceSpan BSP_INSTRUMENT_CONCAT(trace_span_, __LINE__)(name, lump)
+#define BSP_IO_LUMP(lump) \
+    IoLumpScope BSP_INSTRUMENT_CONCAT(io_lump_, __LINE__)(lump)
+#define BSP_IO_SCOPE(var, op) \
+    IoTimer var(op)
+#define BSP_IO_BYTES(var, count) \
+    (var).bytes = (count)
+
+#else
+
+#define BSP_TRACE_SCOPE(name)
+#define BSP_TRACE_SCOPE_LUMP(name, lump)
+#define BSP_IO_LUMP(lump)
+#define BSP_IO_SCOPE(var, op)
+#define BSP_IO_BYTES(var, count)
+
+#endif // BSP_INSTRUMENT
+
+#endif // BSP_INSTRUMENT_H
@@ -0,0 +1,316 @@
+#pragma once
+
+#ifndef BSP_LIGHTMAP_H
+#define BSP_LIGHTMAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "bspversion.hpp"
+#include "instrument.hpp"
+#include "threadpool.hpp"
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// One lightmap page of a face in the atlas: a style, and for bumped faces one of the 4 bump basis maps.
+struct LightmapPage
+{
+    int face;
+    int style;   // index into dface_t::styles
+    int bump;    // 0 is the flat lightmap, 1 to 3 the bump basis
+    int x;       // top left in the atlas, in texels
+    int y;
+    int width;   // LightmapTextureSizeInLuxels + 1
+    int height;
+};
+
+// ColorRGBExp32 to linear float: c / 255 * 2^exponent, done as two exact power of 2 multiplies so
+// exponents below -126 still give the same result on every path.
+inline float Pow2(int e) {
+    uint32_t bits = (uint32_t)(e + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline void DecodeRGBE(const ColorRGBExp32 &sample, float *out) {
+    int low = sample.exponent >> 1, high = sample.exponent - low;
+    out[0] = (float)sample.r * (1.0f / 255.0f) * Pow2(low) * Pow2(high);
+    out[1] = (float)sample.g * (1.0f / 255.0f) * Pow2(low) * Pow2(high);
+    out[2] = (float)sample.b * (1.0f / 255.0f) * Pow2(low) * Pow2(high);
+}
+
+// IEEE half from float, rounding to nearest even like F16C does.
+inline uint16_t FloatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t abs = bits & 0x7FFFFFFF;
+    if (abs >= 0x7F800000)
+        return sign | (abs > 0x7F800000 ? 0x7E00 : 0x7C00);
+    if (abs >= 0x477FF000)
+        return sign | 0x7C00; // rounds up past the largest half
+    if (abs < 0x38800000)
+    {
+        // Denormal half (or 0), shift the mantissa with its implicit bit into place.
+        if (abs < 0x33000000)
+            return sign;
+        int shift = 126 - (int)(abs >> 23);
+        uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | (uint16_t)half;
+    }
+    uint32_t half = (abs - 0x38000000) >> 13;
+    uint32_t rest = abs & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | (uint16_t)half;
+}
+
+// Decodes the lighting of every face into one atlas of RGBA texels, a = 1.
+// Build() packs the pages of every lit face (styles times bump maps) into shelves of a fixed width,
+// Decode() then writes them into a buffer the caller allocated, faces spread over a pool.
+class LightmapAtlas
+{
+public:
+    // Texel formats of the atlas.
+    enum
+    {
+        LIGHTMAP_RGBA32F = 0,
+        LIGHTMAP_RGBA16F = 1,
+    };
+
+private:
+    std::vector<LightmapPage> pages;
+    std::vector<size_t> face_pages;   // first page of every face, face_count + 1 entries
+    std::vector<int> lightofs;        // byte offset of the first page of every page's face
+    int width;
+    int height;
+
+    // count samples into RGBA floats.
+    static void DecodeRow(const char *src, size_t count, float *dst) {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i byte = _mm_set1_epi32(0xFF);
+        const __m128i bias = _mm_set1_epi32(127);
+        const __m128 inv255 = _mm_set1_ps(1.0f / 255.0f);
+        const __m128 one = _mm_set1_ps(1.0f);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i raw = _mm_loadu_si128((const __m128i *)(src + i * 4));
+            __m128 r = _mm_cvtepi32_ps(_mm_and_si128(raw, byte));
+            __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(raw, 8), byte));
+            __m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(raw, 16), byte));
+            __m128i e = _mm_srai_epi32(raw, 24);
+            __m128i low = _mm_srai_epi32(e, 1);
+            __m128i high = _mm_sub_epi32(e, low);
+            __m128 low2 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(low, bias), 23));
+            __m128 high2 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(high, bias), 23));
+            r = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(r, inv255), low2), high2);
+            g = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(g, inv255), low2), high2);
+            b = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(b, inv255), low2), high2);
+            __m128 a = one;
+            _MM_TRANSPOSE4_PS(r, g, b, a);
+            _mm_storeu_ps(dst + i * 4, r);
+            _mm_storeu_ps(dst + i * 4 + 4, g);
+            _mm_storeu_ps(dst + i * 4 + 8, b);
+            _mm_storeu_ps(dst + i * 4 + 12, a);
+        }
+#endif
+        for (; i < count; i++)
+        {
+            ColorRGBExp32 sample;
+            memcpy(&sample, src + i * 4, sizeof(sample));
+            DecodeRGBE(sample, dst + i * 4);
+            dst[i * 4 + 3] = 1.0f;
+        }
+    }
+
+    // count samples into RGBA halfs, through a float row.
+    static void DecodeRowHalf(const char *src, size_t count, uint16_t *dst, float *scratch) {
+        DecodeRow(src, count, scratch);
+        size_t i = 0;
+#ifdef __F16C__
+        for (; i < count; i++)
+            _mm_storel_epi64((__m128i *)(dst + i * 4), _mm_cvtps_ph(_mm_loadu_ps(scratch + i * 4), _MM_FROUND_TO_NEAREST_INT));
+#endif
+        for (i *= 4; i < count * 4; i++)
+            dst[i] = FloatToHalf(scratch[i]);
+    }
+
+public:
+    LightmapAtlas() : width(0), height(0) {}
+
+    // Lays out the pages of every face that has lighting inside lighting_size bytes.
+    // Pages are sorted by height and put on shelves atlas_width texels wide, padding texels apart.
+    // Returns 0 on success, 1 if a page is wider than the atlas (that face is left out).
+    int Build(const dface_t *faces, size_t face_count, const texinfo_t *texinfos, size_t texinfo_count, size_t lighting_size, int atlas_width = 2048, int padding = 0) {
+        BSP_TRACE_SCOPE("LightmapAtlas::Build");
+        pages.clear();
+        lightofs.clear();
+        face_pages.assign(face_count + 1, 0);
+        width = atlas_width;
+        height = 0;
+        int result = 0;
+
+        for (size_t f = 0; f < face_count; f++)
+        {
+            const dface_t &face = faces[f];
+            face_pages[f] = pages.size();
+            int styles = 0;
+            while (styles < MAXLIGHTMAPS && face.styles[styles] != 255)
+                styles++;
+            int w = face.LightmapTextureSizeInLuxels[0] + 1, h = face.LightmapTextureSizeInLuxels[1] + 1;
+            if (face.lightofs < 0 || styles == 0 || w <= 0 || h <= 0)
+                continue;
+            bool bump = face.texinfo >= 0 && (size_t)face.texinfo < texinfo_count && (texinfos[face.texinfo].flags & SURF_BUMPLIGHT);
+            int maps = bump ? 4 : 1;
+            size_t bytes = (size_t)w * h * maps * styles * sizeof(ColorRGBExp32);
+            if ((size_t)face.lightofs > lighting_size || lighting_size - face.lightofs < bytes)
+                continue;
+            if (w > atlas_width)
+            {
+                result = 1;
+                continue;
+            }
+            // Styles first, then the bump maps of the style, like the lump.
+            for (int s = 0; s < styles; s++)
+            {
+                for (int m = 0; m < maps; m++)
+                {
+                    pages.push_back(LightmapPage{(int)f, s, m, 0, 0, w, h});
+                    lightofs.push_back(face.lightofs);
+                }
+            }
+        }
+        face_pages[face_count] = pages.size();
+
+        // Shelf packing, tallest pages first.
+        std::vector<size_t> order(pages.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return pages[a].height > pages[b].height;
+        });
+        int x = 0, y = 0, shelf = 0;
+        for (size_t i : order)
+        {
+            LightmapPage &page = pages[i];
+            if (x + page.width > width)
+            {
+                x = 0;
+                y += shelf + padding;
+                shelf = 0;
+            }
+            page.x = x;
+            page.y = y;
+            x += page.width + padding;
+            shelf = std::max(shelf, page.height);
+        }
+        height = pages.empty() ? 0 : y + shelf;
+        return result;
+    }
+
+    inline int GetWidth() const {
+        return width;
+    }
+
+    inline int GetHeight() const {
+        return height;
+    }
+
+    // Bytes the atlas needs in a format, width * height texels.
+    inline size_t GetAtlasSize(int format) const {
+        return (size_t)width * height * 4 * (format == LIGHTMAP_RGBA16F ? sizeof(uint16_t) : sizeof(float));
+    }
+
+    inline const std::vector<LightmapPage>& GetPages() const {
+        return pages;
+    }
+
+    // Pages of a face, styles first then bump maps. count is 0 for faces without lighting.
+    inline const LightmapPage* GetFacePages(size_t face, size_t &count) const {
+        if (face + 1 >= face_pages.size())
+        {
+            count = 0;
+            return nullptr;
+        }
+        count = face_pages[face + 1] - face_pages[face];
+        return pages.data() + face_pages[face];
+    }
+
+    // Decodes the lighting lump the layout was built for into atlas (GetAtlasSize(format) bytes).
+    // Texels between pages aren't written.
+    void Decode(const char *lighting, void *atlas, int format = LIGHTMAP_RGBA32F, ThreadPool *pool = nullptr) const {
+        BSP_TRACE_SCOPE("LightmapAtlas::Decode");
+        size_t face_count = face_pages.empty() ? 0 : face_pages.size() - 1;
+        auto decode = [&](size_t f) {
+            std::vector<float> scratch;
+            for (size_t p = face_pages[f]; p < face_pages[f + 1]; p++)
+            {
+                const LightmapPage &page = pages[p];
+                size_t luxels = (size_t)page.width * page.height;
+                size_t index = p - face_pages[f]; // style * maps + bump
+                const char *src = lighting + lightofs[p] + index * luxels * sizeof(ColorRGBExp32);
+                for (int row = 0; row < page.height; row++)
+                {
+                    size_t texel = (size_t)(page.y + row) * width + page.x;
+                    const char *line = src + (size_t)row * page.width * sizeof(ColorRGBExp32);
+                    if (format == LIGHTMAP_RGBA16F)
+                    {
+                        scratch.resize(page.width * 4);
+                        DecodeRowHalf(line, page.width, (uint16_t *)atlas + texel * 4, scratch.data());
+                    }
+                    else
+                        DecodeRow(line, page.width, (float *)atlas + texel * 4);
+                }
+            }
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, face_count, 64, decode);
+        else
+        {
+            for (size_t f = 0; f < face_count; f++)
+                decode(f);
+        }
+    }
+
+    // Builds the layout from a Bsp or BspSnapshot (the HDR faces and lighting if hdr is set and they exist)
+    // and decodes into atlas, which is resized to fit. Returns what Build() returns.
+    template<typename Source>
+    int Load(Source &bsp, std::vector<char> &atlas, bool hdr = false, int format = LIGHTMAP_RGBA32F, ThreadPool *pool = nullptr, int atlas_width = 2048, int padding = 0) {
+        std::vector<char> lighting, texinfo_data;
+        std::vector<dface_t> faces;
+        if (hdr)
+            bsp.ReadLump(LUMP_LIGHTING_HDR, lighting);
+        if (!hdr || lighting.empty())
+            bsp.ReadLump(LUMP_LIGHTING, lighting);
+        bsp.ReadFaces(faces);
+        if (hdr)
+        {
+            std::vector<char> face_data;
+            bsp.ReadLump(LUMP_FACES_HDR, face_data);
+            if (!face_data.empty())
+                ReadBspFaces(face_data.data(), face_data.size(), bsp.GetProfile(), faces);
+        }
+        bsp.ReadLump(LUMP_TEXINFO, texinfo_data);
+        std::vector<texinfo_t> texinfos(texinfo_data.size() / sizeof(texinfo_t));
+        memcpy((void *)texinfos.data(), texinfo_data.data(), texinfos.size() * sizeof(texinfo_t));
+
+        int result = Build(faces.data(), faces.size(), texinfos.data(), texinfos.size(), lighting.size(), atlas_width, padding);
+        atlas.assign(GetAtlasSize(format), 0);
+        Decode(lighting.data(), atlas.data(), format, pool);
+        return result;
+    }
+};
+
+#endif // BSP_LIGHTMAP_H
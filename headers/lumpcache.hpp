@@ -0,0 +1,146 @@
+#pragma once
+
+#ifndef BSP_LUMPCACHE_H
+#define BSP_LUMPCACHE_H
+
+#include <cstring>
+#include "bspdefs.hpp"
+#include <vector>
+
+// Per-lump cache with a memory budget and least recently used eviction.
+// A budget of 0 disables the cache.
+class LumpCache
+{
+private:
+    std::vector<char> entries[HEADER_LUMPS];
+    bool loaded[HEADER_LUMPS];
+    unsigned long long lastuse[HEADER_LUMPS];
+    unsigned long long tick;
+    size_t budget;
+    size_t used;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+
+    // Evicts the least recently used lumps until bytes more fit, never evicts pinned.
+    bool MakeRoom(size_t bytes, int pinned) {
+        while (used + bytes > budget)
+        {
+            int oldest = -1;
+            for (int n = 0; n < HEADER_LUMPS; n++)
+            {
+                if (!loaded[n] || n == pinned)
+                    continue;
+                if (oldest == -1 || lastuse[n] < lastuse[oldest])
+                    oldest = n;
+            }
+            if (oldest == -1)
+                return false;
+            Invalidate(oldest);
+            evictions++;
+        }
+        return true;
+    }
+
+public:
+    LumpCache(size_t budget = 0) : tick(0), budget(budget), used(0), hits(0), misses(0), evictions(0)
+    {
+        memset(loaded, 0, sizeof(loaded));
+        memset(lastuse, 0, sizeof(lastuse));
+    }
+
+    inline bool IsEnabled() const {
+        return budget > 0;
+    }
+
+    inline size_t GetBudget() const {
+        return budget;
+    }
+
+    inline size_t GetUsedBytes() const {
+        return used;
+    }
+
+    inline size_t GetHits() const {
+        return hits;
+    }
+
+    inline size_t GetMisses() const {
+        return misses;
+    }
+
+    inline size_t GetEvictions() const {
+        return evictions;
+    }
+
+    // Shrinking the budget evicts right away, except for pinned.
+    void SetBudget(size_t bytes, int pinned = -1) {
+        budget = bytes;
+        if (budget == 0)
+        {
+            for (int n = 0; n < HEADER_LUMPS; n++)
+            {
+                if (n != pinned)
+                    Invalidate(n);
+            }
+            return;
+        }
+        MakeRoom(0, pinned);
+    }
+
+    // Counts a hit or a miss and marks the lump as recently used.
+    // Returns nullptr on a miss.
+    std::vector<char>* Find(int n) {
+        if (n < 0 || n >= HEADER_LUMPS || !IsEnabled())
+            return nullptr;
+        if (!loaded[n])
+        {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        lastuse[n] = ++tick;
+        return &entries[n];
+    }
+
+    // Like Find() but doesn't touch the counters or the eviction order.
+    const std::vector<char>* Peek(int n) const {
+        if (n < 0 || n >= HEADER_LUMPS || !loaded[n])
+            return nullptr;
+        return &entries[n];
+    }
+
+    // Takes ownership of data, evicting older lumps (except pinned) to stay in budget.
+    // Returns nullptr and leaves data alone if it doesn't fit.
+    std::vector<char>* Insert(int n, std::vector<char> &data, int pinned = -1) {
+        if (n < 0 || n >= HEADER_LUMPS || !IsEnabled() || data.size() > budget)
+            return nullptr;
+        Invalidate(n);
+        if (!MakeRoom(data.size(), pinned))
+            return nullptr;
+        entries[n].swap(data);
+        loaded[n] = true;
+        lastuse[n] = ++tick;
+        used += entries[n].size();
+        return &entries[n];
+    }
+
+    void Invalidate(int n) {
+        if (n < 0 || n >= HEADER_LUMPS || !loaded[n])
+            return;
+        used -= entries[n].size();
+        std::vector<char>().swap(entries[n]);
+        loaded[n] = false;
+    }
+
+    void Clear() {
+        for (int n = 0; n < HEADER_LUMPS; n++)
+            Invalidate(n);
+    }
+
+    void ResetCounters() {
+        hits = misses = evictions = 0;
+    }
+};
+
+#endif // BSP_LUMPCACHE_H
@@ -0,0 +1,157 @@
+#pragma once
+
+#ifndef BSP_LZMA_H
+#define BSP_LZMA_H
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include "instrument.hpp"
+#include <vector>
+
+// LZMA support for compressed lumps needs liblzma, build with -DBSP_ENABLE_LZMA and link with -llzma.
+// Without it compressed lumps are detected but left as they are.
+#ifdef BSP_ENABLE_LZMA
+#include <lzma.h>
+#endif
+
+#define LZMA_ID (('A'<<24)|('M'<<16)|('Z'<<8)|('L')) // "LZMA"
+
+// Precedes the raw lzma stream of compressed lumps and game lumps.
+#pragma pack(push, 1)
+struct lzma_header_t
+{
+	unsigned int    id;
+	unsigned int    actualSize;     // uncompressed size
+	unsigned int    lzmaSize;       // compressed size, without this header
+	unsigned char   properties[5];
+};
+#pragma pack(pop)
+
+// Largest uncompressed size that is decompressed, the size comes from the file so anything bigger is rejected
+// before it gets allocated. 512 MB by default, more than any lump of a map that fits in 2 GB offsets needs in practice.
+inline std::atomic<size_t> lzma_size_limit(512u << 20);
+
+inline void SetLzmaSizeLimit(size_t bytes) {
+    lzma_size_limit.store(bytes, std::memory_order_relaxed);
+}
+
+inline size_t GetLzmaSizeLimit() {
+    return lzma_size_limit.load(std::memory_order_relaxed);
+}
+
+inline bool IsLzmaAvailable() {
+#ifdef BSP_ENABLE_LZMA
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline bool IsLzmaCompressed(const char *data, size_t size) {
+    if (data == nullptr || size < sizeof(lzma_header_t))
+        return false;
+    unsigned int id;
+    memcpy(&id, data, sizeof(id));
+    return id == LZMA_ID;
+}
+
+// Uncompressed size of a compressed lump, 0 if it isn't one.
+inline size_t GetLzmaActualSize(const char *data, size_t size) {
+    if (!IsLzmaCompressed(data, size))
+        return 0;
+    lzma_header_t header;
+    memcpy(&header, data, sizeof(lzma_header_t));
+    return header.actualSize;
+}
+
+// Decompresses a raw lzma stream (no header) of actual bytes with the 5 property bytes into out.
+// Returns false if the stream is broken, actual is above GetLzmaSizeLimit() or liblzma isn't available.
+inline bool LzmaDecompressRaw(const char *data, size_t size, const unsigned char *properties, size_t actual, std::vector<char> &out) {
+#ifdef BSP_ENABLE_LZMA
+    if (actual > GetLzmaSizeLimit())
+        return false;
+    lzma_filter filters[2];
+    filters[0].id = LZMA_FILTER_LZMA1;
+    filters[0].options = nullptr;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    if (lzma_properties_decode(&filters[0], nullptr, properties, 5) != LZMA_OK)
+        return false;
+
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_ret ret = lzma_raw_decoder(&stream, filters);
+    free(filters[0].options);
+    if (ret != LZMA_OK)
+        return false;
+
+    out.resize(actual);
+    stream.next_in = (const uint8_t *)data;
+    stream.avail_in = size;
+    stream.next_out = (uint8_t *)out.data();
+    stream.avail_out = out.size();
+    // The stream may or may not have an end marker, the known size is what counts.
+    ret = lzma_code(&stream, LZMA_RUN);
+    bool ok = stream.avail_out == 0 && (ret == LZMA_OK || ret == LZMA_STREAM_END);
+    lzma_end(&stream);
+    return ok;
+#else
+    (void)data;
+    (void)size;
+    (void)properties;
+    (void)actual;
+    (void)out;
+    return false;
+#endif
+}
+
+// Decompresses a whole compressed lump (header included) into out.
+// Returns false if the data isn't a valid compressed lump or liblzma isn't available.
+inline bool LzmaDecompress(const char *data, size_t size, std::vector<char> &out) {
+    BSP_TRACE_SCOPE("LzmaDecompress");
+    if (!IsLzmaCompressed(data, size))
+        return false;
+    lzma_header_t header;
+    memcpy(&header, data, sizeof(lzma_header_t));
+    size_t payload = size - sizeof(lzma_header_t);
+    if (header.lzmaSize < payload)
+        payload = header.lzmaSize;
+    return LzmaDecompressRaw(data + sizeof(lzma_header_t), payload, header.properties, header.actualSize, out);
+}
+
+// Compresses size bytes into a compressed lump (header included) in out.
+// Returns false if compression failed or liblzma isn't available.
+inline bool LzmaCompress(const char *data, size_t size, std::vector<char> &out, unsigned int preset = 6) {
+#ifdef BSP_ENABLE_LZMA
+    lzma_options_lzma options;
+    if (lzma_lzma_preset(&options, preset))
+        return false;
+    lzma_filter filters[2];
+    filters[0].id = LZMA_FILTER_LZMA1;
+    filters[0].options = &options;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+
+    lzma_header_t header;
+    header.id = LZMA_ID;
+    header.actualSize = (unsigned int)size;
+    if (lzma_properties_encode(&filters[0], header.properties) != LZMA_OK)
+        return false;
+
+    out.resize(sizeof(lzma_header_t) + size + size / 3 + 128);
+    size_t written = sizeof(lzma_header_t);
+    if (lzma_raw_buffer_encode(filters, nullptr, (const uint8_t *)data, size, (uint8_t *)out.data(), &written, out.size()) != LZMA_OK)
+        return false;
+
+    header.lzmaSize = (unsigned int)(written - sizeof(lzma_header_t));
+    memcpy(out.data(), &header, sizeof(lzma_header_t));
+    out.resize(written);
+    return true;
+#else
+    (void)data;
+    (void)size;
+    (void)out;
+    (void)preset;
+    return false;
+#endif
+}
+
+#endif // BSP_LZMA_H
@@ -0,0 +1,368 @@
+#pragma once
+
+#ifndef BSP_PAKFILE_H
+#define BSP_PAKFILE_H
+
+#include <cstdint>
+#include <cstring>
+#include "deflate.hpp"
+#include "instrument.hpp"
+#include "lzma.hpp"
+#include "snapshot.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define ZIP_LOCAL_SIGNATURE   0x04034b50
+#define ZIP_CENTRAL_SIGNATURE 0x02014b50
+#define ZIP_END_SIGNATURE     0x06054b50
+
+// Compression methods of zip entries.
+enum
+{
+    ZIP_STORED = 0,
+    ZIP_DEFLATED = 8,
+    ZIP_LZMA = 14,
+};
+
+#pragma pack(push, 1)
+struct zip_local_header_t
+{
+	unsigned int    signature;      // ZIP_LOCAL_SIGNATURE
+	unsigned short  versionNeeded;
+	unsigned short  flags;
+	unsigned short  method;
+	unsigned short  modTime;
+	unsigned short  modDate;
+	unsigned int    crc32;
+	unsigned int    compressedSize;
+	unsigned int    uncompressedSize;
+	unsigned short  nameLength;
+	unsigned short  extraLength;
+	// name, extra field and the data follow
+};
+
+struct zip_central_header_t
+{
+	unsigned int    signature;      // ZIP_CENTRAL_SIGNATURE
+	unsigned short  versionMadeBy;
+	unsigned short  versionNeeded;
+	unsigned short  flags;
+	unsigned short  method;
+	unsigned short  modTime;
+	unsigned short  modDate;
+	unsigned int    crc32;
+	unsigned int    compressedSize;
+	unsigned int    uncompressedSize;
+	unsigned short  nameLength;
+	unsigned short  extraLength;
+	unsigned short  commentLength;
+	unsigned short  diskStart;
+	unsigned short  internalAttributes;
+	unsigned int    externalAttributes;
+	unsigned int    localHeaderOffset; // from the start of the lump
+	// name, extra field and comment follow
+};
+
+struct zip_end_header_t
+{
+	unsigned int    signature;      // ZIP_END_SIGNATURE
+	unsigned short  disk;
+	unsigned short  centralDisk;
+	unsigned short  diskEntries;
+	unsigned short  entries;
+	unsigned int    centralSize;
+	unsigned int    centralOffset;
+	unsigned short  commentLength;
+	// comment follows
+};
+#pragma pack(pop)
+
+// One file of the pakfile, as listed in the central directory.
+struct PakEntry
+{
+    std::string_view name; // points into the central directory, as stored (any case, either slash)
+    unsigned short method; // ZIP_STORED, ZIP_DEFLATED, ZIP_LZMA, ...
+    unsigned int crc;
+    size_t size;           // uncompressed
+    size_t compressed_size;
+    size_t local_offset;   // of the local header
+};
+
+// Raw bytes of an entry inside the lump.
+struct PakSpan
+{
+    const char *data;
+    size_t size;
+};
+
+// Reads the zip archive of LUMP_PAKFILE in place: the central directory is parsed where it is and only
+// the entries that are asked for are touched. Stored entries come back as spans into the lump, deflated
+// (BSP_ENABLE_ZLIB) and lzma (BSP_ENABLE_LZMA) ones are decompressed on demand, in parallel with ExtractBatch().
+// Paths are looked up case-insensitively with either slash, through a hash table.
+class PakFile
+{
+private:
+    std::vector<char> storage; // Copy of the lump when it couldn't be used in place
+    const char *data;
+    size_t data_size;
+    std::vector<PakEntry> entries;
+    std::vector<unsigned int> slots; // entry + 1, 0 is empty
+    size_t mask;
+
+    static inline char Fold(char c) {
+        if (c >= 'A' && c <= 'Z')
+            return c + ('a' - 'A');
+        return c == '\\' ? '/' : c;
+    }
+
+    static size_t Hash(std::string_view path) {
+        uint64_t h = 0xCBF29CE484222325ull;
+        for (char c : path)
+            h = (h ^ (unsigned char)Fold(c)) * 0x100000001B3ull;
+        return (size_t)(h ^ (h >> 32));
+    }
+
+    static bool SamePath(std::string_view a, std::string_view b) {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            if (Fold(a[i]) != Fold(b[i]))
+                return false;
+        }
+        return true;
+    }
+
+    // Finds the end of central directory record, searching back over a possible comment.
+    bool FindEnd(zip_end_header_t &end) const {
+        if (data_size < sizeof(zip_end_header_t))
+            return false;
+        size_t last = data_size - sizeof(zip_end_header_t);
+        size_t first = last > 0xFFFF ? last - 0xFFFF : 0;
+        for (size_t offset = last + 1; offset-- > first;)
+        {
+            unsigned int signature;
+            memcpy(&signature, data + offset, sizeof(signature));
+            if (signature != ZIP_END_SIGNATURE)
+                continue;
+            memcpy(&end, data + offset, sizeof(zip_end_header_t));
+            if (offset + sizeof(zip_end_header_t) + end.commentLength <= data_size)
+                return true;
+        }
+        return false;
+    }
+
+    void BuildIndex() {
+        size_t size = 16;
+        while (size < entries.size() * 2)
+            size <<= 1;
+        slots.assign(size, 0);
+        mask = size - 1;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            size_t slot = Hash(entries[i].name) & mask;
+            while (slots[slot] != 0)
+                slot = (slot + 1) & mask;
+            slots[slot] = (unsigned int)i + 1;
+        }
+    }
+
+public:
+    // Error codes of Open().
+    enum
+    {
+        PAK_OK = 0,
+        PAK_NO_DIRECTORY = 1, // no end of central directory record, an empty lump is fine
+        PAK_CORRUPT = 2,      // the central directory is out of range or broken
+    };
+
+    PakFile() : data(nullptr), data_size(0), mask(0) {}
+
+    // The spans point into the lump or into the reader.
+    PakFile(const PakFile &other) = delete;
+    PakFile& operator=(const PakFile &other) = delete;
+
+    // Reads the archive in place, the data has to outlive the reader. Returns PAK_OK or an error code.
+    int Open(const char *archive, size_t size) {
+        BSP_TRACE_SCOPE("PakFile::Open");
+        data = archive;
+        data_size = archive != nullptr ? size : 0;
+        entries.clear();
+        slots.clear();
+        mask = 0;
+        if (data_size == 0)
+            return PAK_OK;
+
+        zip_end_header_t end;
+        if (!FindEnd(end))
+            return PAK_NO_DIRECTORY;
+        if ((size_t)end.centralOffset + end.centralSize > data_size)
+            return PAK_CORRUPT;
+
+        entries.reserve(end.entries);
+        size_t offset = end.centralOffset, stop = (size_t)end.centralOffset + end.centralSize;
+        for (unsigned int i = 0; i < end.entries; i++)
+        {
+            zip_central_header_t header;
+            if (stop - offset < sizeof(zip_central_header_t))
+                return PAK_CORRUPT;
+            memcpy(&header, data + offset, sizeof(zip_central_header_t));
+            size_t record = sizeof(zip_central_header_t) + header.nameLength + header.extraLength + header.commentLength;
+            if (header.signature != ZIP_CENTRAL_SIGNATURE || stop - offset < record)
+                return PAK_CORRUPT;
+
+            PakEntry entry;
+            entry.name = std::string_view(data + offset + sizeof(zip_central_header_t), header.nameLength);
+            entry.method = header.method;
+            entry.crc = header.crc32;
+            entry.size = header.uncompressedSize;
+            entry.compressed_size = header.compressedSize;
+            entry.local_offset = header.localHeaderOffset;
+            entries.push_back(entry);
+            offset += record;
+        }
+        BuildIndex();
+        return PAK_OK;
+    }
+
+    // Reads the pakfile in place when it's mapped, from a copy otherwise.
+    int Open(Bsp &bsp) {
+        LumpView<char> view = bsp.GetLumpView<char>(LUMP_PAKFILE);
+        if (bsp.IsMapped() && !bsp.IsLumpCompressed(LUMP_PAKFILE) && view.IsValid())
+        {
+            std::vector<char>().swap(storage);
+            return Open(view.data(), view.size());
+        }
+        bsp.ReadLump(LUMP_PAKFILE, storage);
+        return Open(storage.data(), storage.size());
+    }
+
+    // Reads the pakfile in place, the snapshot has to outlive the reader.
+    int Open(const BspSnapshot &bsp) {
+        LumpView<char> view = bsp.GetLumpView<char>(LUMP_PAKFILE);
+        if (view.IsValid())
+        {
+            std::vector<char>().swap(storage);
+            return Open(view.data(), view.size());
+        }
+        bsp.ReadLump(LUMP_PAKFILE, storage);
+        return Open(storage.data(), storage.size());
+    }
+
+    inline size_t size() const {
+        return entries.size();
+    }
+
+    inline const PakEntry& GetEntry(size_t index) const {
+        return entries[index];
+    }
+
+    inline const std::vector<PakEntry>& GetEntries() const {
+        return entries;
+    }
+
+    // Index of the entry at path, -1 if there is none. Case-insensitive, '\' and '/' are the same.
+    int Find(std::string_view path) const {
+        if (slots.empty())
+            return -1;
+        for (size_t slot = Hash(path) & mask; slots[slot] != 0; slot = (slot + 1) & mask)
+        {
+            if (SamePath(entries[slots[slot] - 1].name, path))
+                return (int)slots[slot] - 1;
+        }
+        return -1;
+    }
+
+    // Bytes of entry index as stored (compressed or not) from its local header, {nullptr, 0} if they're out of range.
+    PakSpan GetRawSpan(size_t index) const {
+        PakSpan span = {nullptr, 0};
+        if (index >= entries.size())
+            return span;
+        const PakEntry &entry = entries[index];
+        zip_local_header_t local;
+        if (entry.local_offset > data_size || data_size - entry.local_offset < sizeof(zip_local_header_t))
+            return span;
+        memcpy(&local, data + entry.local_offset, sizeof(zip_local_header_t));
+        // The extra field of the local header doesn't have to match the central one.
+        size_t start = entry.local_offset + sizeof(zip_local_header_t) + local.nameLength + local.extraLength;
+        if (local.signature != ZIP_LOCAL_SIGNATURE || start > data_size || data_size - start < entry.compressed_size)
+            return span;
+        span.data = data + start;
+        span.size = entry.compressed_size;
+        return span;
+    }
+
+    // Zero-copy span over a stored entry, {nullptr, 0} if it's compressed or out of range.
+    PakSpan GetSpan(size_t index) const {
+        if (index >= entries.size() || entries[index].method != ZIP_STORED)
+            return PakSpan{nullptr, 0};
+        return GetRawSpan(index);
+    }
+
+    // Decompresses (or copies) entry index into out, checking its CRC if verify is set.
+    // Returns false if it's out of range, broken, uses an unsupported method or its library isn't enabled.
+    bool Extract(size_t index, std::vector<char> &out, bool verify = true) const {
+        out.clear();
+        PakSpan span = GetRawSpan(index);
+        if (span.data == nullptr)
+            return false;
+        const PakEntry &entry = entries[index];
+        bool ok = false;
+        switch (entry.method)
+        {
+        case ZIP_STORED:
+            ok = span.size == entry.size;
+            if (ok)
+                out.assign(span.data, span.data + span.size);
+            break;
+        case ZIP_DEFLATED:
+            // Deflate can't expand more than 1032:1, bigger sizes are lies and never get allocated.
+            if (entry.size <= span.size * 1032 + 64)
+                ok = InflateRaw(span.data, span.size, entry.size, out);
+            break;
+        case ZIP_LZMA:
+            // 2 bytes of lzma sdk version, 2 bytes of property size (5), the properties and the raw stream.
+            // LZMA has no useful expansion bound, sizes above GetLzmaSizeLimit() are rejected before allocating instead.
+            if (span.size >= 9 && entry.size <= GetLzmaSizeLimit() && (unsigned char)span.data[2] == 5 && span.data[3] == 0)
+                ok = LzmaDecompressRaw(span.data + 9, span.size - 9, (const unsigned char *)span.data + 4, entry.size, out);
+            break;
+        default:
+            break;
+        }
+        if (ok && verify)
+            ok = Crc32(out.data(), out.size()) == entry.crc;
+        if (!ok)
+            out.clear();
+        return ok;
+    }
+
+    // Extract() by path.
+    bool Extract(std::string_view path, std::vector<char> &out, bool verify = true) const {
+        int index = Find(path);
+        if (index < 0)
+        {
+            out.clear();
+            return false;
+        }
+        return Extract((size_t)index, out, verify);
+    }
+
+    // Extracts count entries into outputs (and their results into ok if given), spread over the pool if there is one.
+    void ExtractBatch(const size_t *indices, size_t count, std::vector<char> *outputs, bool *ok = nullptr, ThreadPool *pool = nullptr, bool verify = true) const {
+        auto extract = [&](size_t i) {
+            bool result = Extract(indices[i], outputs[i], verify);
+            if (ok != nullptr)
+                ok[i] = result;
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, count, 1, extract);
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+                extract(i);
+        }
+    }
+};
+
+#endif // BSP_PAKFILE_H
@@ -0,0 +1,340 @@
+#pragma once
+
+#ifndef BSP_PAKWRITER_H
+#define BSP_PAKWRITER_H
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include "pakfile.hpp"
+#include "relayout.hpp"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Builds a new pakfile from an existing one plus adds, replaces and removes, then writes it into a bsp.
+// Untouched entries are copied as they are (still compressed), new files are deflated (BSP_ENABLE_ZLIB)
+// in parallel. Files with identical contents (new files by their bytes, entries of the source by crc, size and
+// raw bytes) are compressed and stored once: their central records all point at the same local record.
+// Like BspRelayout, the data handed to Add() isn't copied and has to stay alive until Build()/Commit().
+class PakWriter
+{
+private:
+    static const unsigned short DOS_DATE = (0 << 9) | (1 << 5) | 1; // 1980-01-01, so the output is reproducible
+
+    struct Member
+    {
+        std::string name;
+        const char *data;   // new contents, nullptr for entries of the source
+        size_t size;
+        int source;         // entry of the source pakfile, -1 for new files
+        bool compress;
+        bool removed;
+    };
+
+    // What ends up in the archive for one member.
+    struct Packed
+    {
+        const char *data;
+        size_t size;
+        unsigned short method;
+        unsigned int crc;
+        size_t uncompressed;
+    };
+
+    const PakFile *source;
+    std::vector<Member> members;
+    std::unordered_map<std::string, size_t> paths; // folded path -> member
+    int level;
+    size_t min_compress; // smaller files are stored
+
+    static std::string Fold(std::string_view path) {
+        std::string folded(path);
+        for (char &c : folded)
+        {
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            else if (c == '\\')
+                c = '/';
+        }
+        return folded;
+    }
+
+    static inline uint64_t HashContents(const char *data, size_t size) {
+        uint64_t h = size * 0x9E3779B97F4A7C15ull;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            h = (h ^ word) * 0xC2B2AE3D27D4EB4Full;
+            h ^= h >> 31;
+        }
+        uint64_t last = 0;
+        memcpy(&last, data + i, size - i);
+        h = (h ^ last) * 0xC2B2AE3D27D4EB4Full;
+        return h ^ (h >> 29);
+    }
+
+    size_t Insert(std::string_view path, const Member &member) {
+        std::string key = Fold(path);
+        auto found = paths.find(key);
+        if (found != paths.end())
+        {
+            members[found->second] = member;
+            return found->second;
+        }
+        members.push_back(member);
+        paths.emplace(key, members.size() - 1);
+        return members.size() - 1;
+    }
+
+public:
+    PakWriter() : source(nullptr), level(6), min_compress(64) {}
+
+    // Starts from the entries of an open pakfile, which has to stay open until Build()/Commit().
+    // If it lists a path twice the last one wins.
+    explicit PakWriter(const PakFile &pak) : PakWriter()
+    {
+        source = &pak;
+        members.reserve(pak.size());
+        for (size_t i = 0; i < pak.size(); i++)
+        {
+            const PakEntry &entry = pak.GetEntry(i);
+            Insert(entry.name, Member{std::string(entry.name), nullptr, entry.size, (int)i, false, false});
+        }
+    }
+
+    PakWriter(const PakWriter &other) = delete;
+    PakWriter& operator=(const PakWriter &other) = delete;
+
+    // Deflate level (1 to 9) and the size under which new files are stored anyway.
+    void SetCompression(int new_level, size_t new_min_compress = 64) {
+        level = new_level;
+        min_compress = new_min_compress;
+    }
+
+    // Adds the file at path, replacing the one that's already there (paths are case-insensitive, either slash).
+    void Add(std::string_view path, const void *data, size_t size, bool compress = true) {
+        Insert(path, Member{std::string(path), (const char *)data, size, -1, compress, false});
+    }
+
+    // Add() for a file that has to exist already. Returns false if it doesn't.
+    bool Replace(std::string_view path, const void *data, size_t size, bool compress = true) {
+        if (!Contains(path))
+            return false;
+        Add(path, data, size, compress);
+        return true;
+    }
+
+    // Returns false if there is no such file.
+    bool Remove(std::string_view path) {
+        auto found = paths.find(Fold(path));
+        if (found == paths.end())
+            return false;
+        members[found->second].removed = true;
+        paths.erase(found);
+        return true;
+    }
+
+    bool Contains(std::string_view path) const {
+        return paths.find(Fold(path)) != paths.end();
+    }
+
+    // Number of files the archive will have.
+    inline size_t size() const {
+        return paths.size();
+    }
+
+    // Writes the whole archive into out, offsets relative to its start like the engine expects.
+    // New files are hashed and compressed on the pool if one is given.
+    // Returns false if an entry of the source couldn't be read or the archive would need zip64.
+    bool Build(std::vector<char> &out, ThreadPool *pool = nullptr) const {
+        std::vector<size_t> live;
+        live.reserve(members.size());
+        for (size_t m = 0; m < members.size(); m++)
+        {
+            if (!members[m].removed)
+                live.push_back(m);
+        }
+        if (live.size() > 0xFFFF)
+            return false;
+
+        auto run = [pool](size_t count, size_t chunk, const std::function<void(size_t)> &func) {
+            if (pool != nullptr)
+                pool->ParallelFor(0, count, chunk, func);
+            else
+            {
+                for (size_t i = 0; i < count; i++)
+                    func(i);
+            }
+        };
+
+        // Hash every member, new files by their contents and entries of the source by their raw (compressed) bytes
+        // and crc. The first of each group of identical ones does the work and holds the data for all of them.
+        std::vector<uint64_t> hashes(live.size(), 0);
+        std::vector<PakSpan> spans(live.size(), PakSpan{nullptr, 0});
+        run(live.size(), 16, [&](size_t i) {
+            const Member &member = members[live[i]];
+            if (member.source < 0)
+            {
+                hashes[i] = HashContents(member.data, member.size);
+                return;
+            }
+            spans[i] = source->GetRawSpan(member.source);
+            if (spans[i].data != nullptr)
+                hashes[i] = HashContents(spans[i].data, spans[i].size) ^ (source->GetEntry(member.source).crc * 0x9E3779B97F4A7C15ull);
+        });
+        auto same = [&](size_t a, size_t b) {
+            const Member &first = members[live[a]], &second = members[live[b]];
+            if (first.source < 0 && second.source < 0)
+                return first.size == second.size && first.compress == second.compress && memcmp(first.data, second.data, first.size) == 0;
+            if (first.source < 0 || second.source < 0 || spans[a].data == nullptr || spans[b].data == nullptr)
+                return false;
+            const PakEntry &x = source->GetEntry(first.source), &y = source->GetEntry(second.source);
+            return x.method == y.method && x.crc == y.crc && x.size == y.size && spans[a].size == spans[b].size
+                && memcmp(spans[a].data, spans[b].data, spans[a].size) == 0;
+        };
+        std::vector<size_t> owner(live.size());
+        std::unordered_multimap<uint64_t, size_t> seen;
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            owner[i] = i;
+            auto range = seen.equal_range(hashes[i]);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (same(it->second, i))
+                {
+                    owner[i] = it->second;
+                    break;
+                }
+            }
+            if (owner[i] == i)
+                seen.emplace(hashes[i], i);
+        }
+
+        std::vector<Packed> packed(live.size());
+        std::vector<std::vector<char>> compressed(live.size());
+        std::vector<char> failed(live.size(), 0);
+        run(live.size(), 1, [&](size_t i) {
+            const Member &member = members[live[i]];
+            Packed &result = packed[i];
+            if (member.source >= 0)
+            {
+                const PakEntry &entry = source->GetEntry(member.source);
+                result = Packed{spans[i].data, spans[i].size, entry.method, entry.crc, entry.size};
+                failed[i] = spans[i].data == nullptr;
+                return;
+            }
+            if (owner[i] != i)
+                return;
+            result = Packed{member.data, member.size, ZIP_STORED, Crc32(member.data, member.size), member.size};
+            if (member.compress && member.size >= min_compress && DeflateRaw(member.data, member.size, compressed[i], level)
+                && compressed[i].size() < member.size)
+            {
+                result.data = compressed[i].data();
+                result.size = compressed[i].size();
+                result.method = ZIP_DEFLATED;
+            }
+            else
+                std::vector<char>().swap(compressed[i]);
+        });
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            if (failed[i])
+                return false;
+            if (owner[i] != i)
+                packed[i] = packed[owner[i]];
+        }
+
+        // Local records back to back (one per group of identical files), then the central directory and its end record.
+        size_t total = sizeof(zip_end_header_t);
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            size_t name = members[live[i]].name.size();
+            total += sizeof(zip_central_header_t) + name;
+            if (owner[i] == i)
+                total += sizeof(zip_local_header_t) + name + packed[i].size;
+        }
+        if (total > 0xFFFFFFFFu)
+            return false;
+        out.assign(total, 0);
+        std::vector<size_t> local_offsets(live.size());
+        size_t offset = 0;
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            // Owners always come first, duplicates reuse their record.
+            if (owner[i] != i)
+            {
+                local_offsets[i] = local_offsets[owner[i]];
+                continue;
+            }
+            const std::string &name = members[live[i]].name;
+            const Packed &entry = packed[i];
+            zip_local_header_t local;
+            memset(&local, 0, sizeof(zip_local_header_t));
+            local.signature = ZIP_LOCAL_SIGNATURE;
+            local.versionNeeded = entry.method == ZIP_STORED ? 10 : entry.method == ZIP_DEFLATED ? 20 : 63;
+            local.method = entry.method;
+            local.modDate = DOS_DATE;
+            local.crc32 = entry.crc;
+            local.compressedSize = (unsigned int)entry.size;
+            local.uncompressedSize = (unsigned int)entry.uncompressed;
+            local.nameLength = (unsigned short)name.size();
+            local_offsets[i] = offset;
+            memcpy(&out[offset], &local, sizeof(zip_local_header_t));
+            offset += sizeof(zip_local_header_t);
+            memcpy(&out[offset], name.data(), name.size());
+            offset += name.size();
+            if (entry.size > 0)
+                memcpy(&out[offset], entry.data, entry.size);
+            offset += entry.size;
+        }
+
+        size_t central_offset = offset;
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            const std::string &name = members[live[i]].name;
+            const Packed &entry = packed[i];
+            zip_central_header_t central;
+            memset(&central, 0, sizeof(zip_central_header_t));
+            central.signature = ZIP_CENTRAL_SIGNATURE;
+            central.versionMadeBy = 20;
+            central.versionNeeded = entry.method == ZIP_STORED ? 10 : entry.method == ZIP_DEFLATED ? 20 : 63;
+            central.method = entry.method;
+            central.modDate = DOS_DATE;
+            central.crc32 = entry.crc;
+            central.compressedSize = (unsigned int)entry.size;
+            central.uncompressedSize = (unsigned int)entry.uncompressed;
+            central.nameLength = (unsigned short)name.size();
+            central.localHeaderOffset = (unsigned int)local_offsets[i];
+            memcpy(&out[offset], &central, sizeof(zip_central_header_t));
+            offset += sizeof(zip_central_header_t);
+            memcpy(&out[offset], name.data(), name.size());
+            offset += name.size();
+        }
+
+        zip_end_header_t end;
+        memset(&end, 0, sizeof(zip_end_header_t));
+        end.signature = ZIP_END_SIGNATURE;
+        end.diskEntries = end.entries = (unsigned short)live.size();
+        end.centralSize = (unsigned int)(offset - central_offset);
+        end.centralOffset = (unsigned int)central_offset;
+        memcpy(&out[offset], &end, sizeof(zip_end_header_t));
+        return true;
+    }
+
+    // Builds the archive and writes a copy of bsp with it as LUMP_PAKFILE to out_path, through BspRelayout.
+    // Returns what BspRelayout::Commit() returns, or 4 if the archive couldn't be built.
+    int Commit(Bsp &bsp, const char *__restrict__ out_path, ThreadPool *pool = nullptr) const {
+        std::vector<char> archive;
+        if (!Build(archive, pool))
+            return 4;
+        BspRelayout relayout(bsp);
+        relayout.SetLump(LUMP_PAKFILE, archive.data(), archive.size());
+        return relayout.Commit(out_path, pool);
+    }
+};
+
+#endif // BSP_PAKWRITER_H
@@ -0,0 +1,251 @@
+#pragma once
+
+#ifndef BSP_POINTLEAF_H
+#define BSP_POINTLEAF_H
+
+#include <cstddef>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The bsp tree flattened for point to leaf lookups.
+// Nodes are stored in depth first order with their plane packed in, so a lookup touches one array
+// and the front child usually sits in the next node. Children >= 0 are nodes in this array,
+// negative children are -(leaf + 1) like in dnode_t.
+class PointLeafTree
+{
+private:
+    struct Node
+    {
+        float normal[3];
+        float dist;
+        int children[2];
+    };
+
+    std::vector<Node> nodes;
+    std::vector<short> clusters; // Cluster of every leaf
+
+    // Which child a point goes to, front (0) if it's on or in front of the plane.
+    static inline int Side(const Node &node, float x, float y, float z) {
+        return x * node.normal[0] + y * node.normal[1] + z * node.normal[2] - node.dist < 0.0f;
+    }
+
+#if defined(__AVX2__)
+    // 8 points at a time, the nodes are gathered straight out of the array.
+    void FindLeaves8(const Vector *points, int *out) const {
+        const float *base = (const float *)nodes.data();
+        const int stride = sizeof(Node) / sizeof(float);
+        __m256 x = _mm256_set_ps(points[7].x, points[6].x, points[5].x, points[4].x, points[3].x, points[2].x, points[1].x, points[0].x);
+        __m256 y = _mm256_set_ps(points[7].y, points[6].y, points[5].y, points[4].y, points[3].y, points[2].y, points[1].y, points[0].y);
+        __m256 z = _mm256_set_ps(points[7].z, points[6].z, points[5].z, points[4].z, points[3].z, points[2].z, points[1].z, points[0].z);
+        __m256i index = _mm256_setzero_si256();
+        const __m256i zero = _mm256_setzero_si256();
+        for (;;)
+        {
+            // Lanes that reached a leaf keep pointing at node 0 and ignore the result.
+            __m256i active = _mm256_cmpgt_epi32(index, _mm256_set1_epi32(-1));
+            if (_mm256_testz_si256(active, active))
+                break;
+            __m256i offset = _mm256_mullo_epi32(_mm256_max_epi32(index, zero), _mm256_set1_epi32(stride));
+            __m256 d = _mm256_mul_ps(x, _mm256_i32gather_ps(base + 0, offset, 4));
+            d = _mm256_add_ps(d, _mm256_mul_ps(y, _mm256_i32gather_ps(base + 1, offset, 4)));
+            d = _mm256_add_ps(d, _mm256_mul_ps(z, _mm256_i32gather_ps(base + 2, offset, 4)));
+            d = _mm256_sub_ps(d, _mm256_i32gather_ps(base + 3, offset, 4));
+            __m256i back = _mm256_castps_si256(_mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_LT_OQ));
+            __m256i front_child = _mm256_i32gather_epi32((const int *)(base + 4), offset, 4);
+            __m256i back_child = _mm256_i32gather_epi32((const int *)(base + 5), offset, 4);
+            __m256i child = _mm256_blendv_epi8(front_child, back_child, back);
+            index = _mm256_blendv_epi8(index, child, active);
+        }
+        _mm256_storeu_si256((__m256i *)out, index);
+    }
+#elif defined(__SSE2__)
+    // 4 points at a time. SSE2 has no gathers, the nodes are loaded per lane.
+    void FindLeaves4(const Vector *points, int *out) const {
+        const Node *tree = nodes.data();
+        __m128 x = _mm_set_ps(points[3].x, points[2].x, points[1].x, points[0].x);
+        __m128 y = _mm_set_ps(points[3].y, points[2].y, points[1].y, points[0].y);
+        __m128 z = _mm_set_ps(points[3].z, points[2].z, points[1].z, points[0].z);
+        alignas(16) int index[4] = {0, 0, 0, 0};
+        for (;;)
+        {
+            int active = (index[0] >= 0) | (index[1] >= 0) << 1 | (index[2] >= 0) << 2 | (index[3] >= 0) << 3;
+            if (active == 0)
+                break;
+            const Node &n0 = tree[index[0] >= 0 ? index[0] : 0];
+            const Node &n1 = tree[index[1] >= 0 ? index[1] : 0];
+            const Node &n2 = tree[index[2] >= 0 ? index[2] : 0];
+            const Node &n3 = tree[index[3] >= 0 ? index[3] : 0];
+            __m128 d = _mm_mul_ps(x, _mm_set_ps(n3.normal[0], n2.normal[0], n1.normal[0], n0.normal[0]));
+            d = _mm_add_ps(d, _mm_mul_ps(y, _mm_set_ps(n3.normal[1], n2.normal[1], n1.normal[1], n0.normal[1])));
+            d = _mm_add_ps(d, _mm_mul_ps(z, _mm_set_ps(n3.normal[2], n2.normal[2], n1.normal[2], n0.normal[2])));
+            d = _mm_sub_ps(d, _mm_set_ps(n3.dist, n2.dist, n1.dist, n0.dist));
+            int back = _mm_movemask_ps(_mm_cmplt_ps(d, _mm_setzero_ps()));
+            if (active & 1)
+                index[0] = n0.children[back & 1];
+            if (active & 2)
+                index[1] = n1.children[(back >> 1) & 1];
+            if (active & 4)
+                index[2] = n2.children[(back >> 2) & 1];
+            if (active & 8)
+                index[3] = n3.children[(back >> 3) & 1];
+        }
+        memcpy(out, index, sizeof(index));
+    }
+#endif
+
+public:
+    // Flattens the tree below headnode.
+    // Returns 0 on success and 1 if a node or plane index is out of range or the nodes don't form a tree,
+    // the tree is empty then.
+    int Build(const dnode_t *in_nodes, size_t node_count, const dplane_t *planes, size_t plane_count, int headnode = 0) {
+        BSP_TRACE_SCOPE("PointLeafTree::Build");
+        nodes.clear();
+        if (node_count == 0)
+            return 0;
+        if (headnode < 0 || (size_t)headnode >= node_count)
+            return 1;
+
+        std::vector<int> remap(node_count, -1);
+        std::vector<int> stack(1, headnode);
+        // Children are fixed up after the walk, they still hold the dnode_t indices until then.
+        while (!stack.empty())
+        {
+            int index = stack.back();
+            stack.pop_back();
+            const dnode_t &source = in_nodes[index];
+            if (remap[index] != -1 || source.planenum < 0 || (size_t)source.planenum >= plane_count)
+            {
+                nodes.clear();
+                return 1;
+            }
+            remap[index] = (int)nodes.size();
+
+            Node node;
+            const dplane_t &plane = planes[source.planenum];
+            node.normal[0] = plane.normal.x;
+            node.normal[1] = plane.normal.y;
+            node.normal[2] = plane.normal.z;
+            node.dist = plane.dist;
+            node.children[0] = source.children[0];
+            node.children[1] = source.children[1];
+            nodes.push_back(node);
+
+            for (int side = 1; side >= 0; side--)
+            {
+                int child = source.children[side];
+                if (child < 0)
+                    continue;
+                if ((size_t)child >= node_count)
+                {
+                    nodes.clear();
+                    return 1;
+                }
+                stack.push_back(child);
+            }
+        }
+
+        for (Node &node : nodes)
+        {
+            for (int side = 0; side < 2; side++)
+            {
+                if (node.children[side] >= 0)
+                    node.children[side] = remap[node.children[side]];
+            }
+        }
+        return 0;
+    }
+
+    // Builds the tree of the world model from a Bsp or BspSnapshot, compressed lumps included.
+    // Returns 0 on success, 1 if the tree is invalid.
+    template<typename Source>
+    int Build(Source &bsp) {
+        std::vector<char> node_data, plane_data, model_data;
+        std::vector<dleaf_t> leafs;
+        bsp.ReadLump(LUMP_NODES, node_data);
+        bsp.ReadLump(LUMP_PLANES, plane_data);
+        bsp.ReadLeafs(leafs);
+        bsp.ReadLump(LUMP_MODELS, model_data);
+
+        int headnode = 0;
+        if (model_data.size() >= sizeof(dmodel_t))
+            memcpy(&headnode, model_data.data() + offsetof(dmodel_t, headnode), sizeof(int));
+
+        std::vector<dnode_t> in_nodes(node_data.size() / sizeof(dnode_t));
+        std::vector<dplane_t> planes(plane_data.size() / sizeof(dplane_t));
+        memcpy((void *)in_nodes.data(), node_data.data(), in_nodes.size() * sizeof(dnode_t));
+        memcpy((void *)planes.data(), plane_data.data(), planes.size() * sizeof(dplane_t));
+
+        clusters.resize(leafs.size());
+        for (size_t i = 0; i < leafs.size(); i++)
+            clusters[i] = leafs[i].cluster;
+
+        return Build(in_nodes.data(), in_nodes.size(), planes.data(), planes.size(), headnode);
+    }
+
+    inline size_t GetNodeCount() const {
+        return nodes.size();
+    }
+
+    // Leaf the point is in, 0 (the solid leaf) if the tree is empty.
+    int FindLeaf(const Vector &point) const {
+        if (nodes.empty())
+            return 0;
+        const Node *tree = nodes.data();
+        int index = 0;
+        while (index >= 0)
+            index = tree[index].children[Side(tree[index], point.x, point.y, point.z)];
+        return -(index + 1);
+    }
+
+    // FindLeaf() for count points, several points are walked down the tree at once where SIMD is available.
+    void FindLeaves(const Vector *points, size_t count, int *out) const {
+        size_t i = 0;
+        if (!nodes.empty())
+        {
+#if defined(__AVX2__)
+            for (; i + 8 <= count; i += 8)
+            {
+                FindLeaves8(points + i, out + i);
+                for (int lane = 0; lane < 8; lane++)
+                    out[i + lane] = -(out[i + lane] + 1);
+            }
+#elif defined(__SSE2__)
+            for (; i + 4 <= count; i += 4)
+            {
+                FindLeaves4(points + i, out + i);
+                for (int lane = 0; lane < 4; lane++)
+                    out[i + lane] = -(out[i + lane] + 1);
+            }
+#endif
+        }
+        for (; i < count; i++)
+            out[i] = FindLeaf(points[i]);
+    }
+
+    // Cluster of the leaf, -1 if unknown (only filled in by Build() from a bsp).
+    inline int GetLeafCluster(int leaf) const {
+        if (leaf < 0 || (size_t)leaf >= clusters.size())
+            return -1;
+        return clusters[leaf];
+    }
+
+    inline int FindCluster(const Vector &point) const {
+        return GetLeafCluster(FindLeaf(point));
+    }
+
+    // FindLeaves() then the cluster of every leaf.
+    void FindClusters(const Vector *points, size_t count, int *out) const {
+        FindLeaves(points, count, out);
+        for (size_t i = 0; i < count; i++)
+            out[i] = GetLeafCluster(out[i]);
+    }
+};
+
+#endif // BSP_POINTLEAF_H
@@ -0,0 +1,269 @@
+#pragma once
+
+#ifndef BSP_RELAYOUT_H
+#define BSP_RELAYOUT_H
+
+#include "bsp.hpp"
+#include <algorithm>
+#include <vector>
+
+// Writes a copy of a bsp where any number of lumps have new contents, in one sequential pass.
+// Lumps keep their order in the file and get packed back to back (aligned), unchanged lumps
+// are streamed across in blocks of block_size so memory use doesn't depend on the map size.
+// Every lump_t and the game lump's dgamelump_t offsets are fixed up on the way.
+class BspRelayout
+{
+private:
+    struct Replacement
+    {
+        const char *data;
+        size_t size;
+        int version;
+        bool set;
+        bool compress;
+    };
+
+    Bsp &source;
+    Replacement replacements[HEADER_LUMPS];
+    std::vector<char> packed[HEADER_LUMPS]; // Compressed replacements, empty until Compress()
+    size_t block_size;
+    size_t alignment;
+
+    inline size_t Align(size_t offset) const {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    inline size_t GetNewSize(int n) const {
+        if (!packed[n].empty())
+            return packed[n].size();
+        return replacements[n].set ? replacements[n].size : source.GetLump(n).filelen;
+    }
+
+    inline const char* GetNewData(int n) const {
+        return packed[n].empty() ? replacements[n].data : packed[n].data();
+    }
+
+    // Writes count zero bytes.
+    static bool Pad(FILE *output, size_t count) {
+        static const char zeros[16] = {0};
+        while (count > 0)
+        {
+            size_t chunk = count < sizeof(zeros) ? count : sizeof(zeros);
+            if (fwrite(zeros, 1, chunk, output) != chunk)
+                return false;
+            count -= chunk;
+        }
+        return true;
+    }
+
+    // Streams length bytes at offset from the source to the output.
+    bool Copy(FILE *output, char *buffer, size_t offset, size_t length) const {
+        while (length > 0)
+        {
+            size_t chunk = length < block_size ? length : block_size;
+            size_t got = source.ReadAt<char>(buffer, chunk, offset);
+            if (got != chunk || fwrite(buffer, 1, chunk, output) != chunk)
+                return false;
+            offset += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+
+    // The game lump directory is at the start of the lump, it gets patched before the payload is streamed.
+    // Offsets of the original lump are absolute and shifted by how far the lump moved,
+    // replacement data has offsets relative to the start of the lump.
+    bool WriteGameLump(FILE *output, char *buffer, size_t new_offset) const {
+        const Replacement &replacement = replacements[LUMP_GAME_LUMP];
+        lump_t old_lump = source.GetLump(LUMP_GAME_LUMP);
+        size_t length = GetNewSize(LUMP_GAME_LUMP);
+        if (length < sizeof(int))
+            return replacement.set ? fwrite(replacement.data, 1, length, output) == length : Copy(output, buffer, old_lump.fileofs, length);
+
+        int count = 0;
+        if (replacement.set)
+            memcpy(&count, replacement.data, sizeof(int));
+        else
+            source.ReadAt(&count, 1, old_lump.fileofs);
+        count = CLAMP(count, 0, (int)((length - sizeof(int)) / sizeof(dgamelump_t)));
+
+        size_t directory_size = sizeof(int) + count * sizeof(dgamelump_t);
+        std::vector<char> directory(directory_size);
+        if (replacement.set)
+            memcpy(directory.data(), replacement.data, directory_size);
+        else if (source.ReadAt<char>(directory.data(), directory_size, old_lump.fileofs) != directory_size)
+            return false;
+
+        dgamelumpheader_t *gameheader = (dgamelumpheader_t *)directory.data();
+        for (int i = 0; i < count; i++)
+        {
+            int &fileofs = gameheader->gamelump[i].fileofs;
+            if (replacement.set)
+                fileofs += (int)new_offset;
+            else if (fileofs >= old_lump.fileofs && fileofs <= old_lump.fileofs + old_lump.filelen)
+                fileofs += (int)new_offset - old_lump.fileofs;
+            // Anything else is already relative to the lump (console maps), leave it alone.
+        }
+        if (fwrite(directory.data(), 1, directory_size, output) != directory_size)
+            return false;
+
+        if (replacement.set)
+            return fwrite(replacement.data + directory_size, 1, length - directory_size, output) == length - directory_size;
+        return Copy(output, buffer, old_lump.fileofs + directory_size, length - directory_size);
+    }
+
+public:
+    BspRelayout(Bsp &source, size_t block_size = 1 << 20, size_t alignment = 4) : source(source), block_size(block_size), alignment(alignment)
+    {
+        memset(replacements, 0, sizeof(replacements));
+        if (this->block_size == 0)
+            this->block_size = BUFSIZ;
+        if (this->alignment == 0)
+            this->alignment = 1;
+    }
+
+    // Replaces the contents of lump n, version -1 keeps the old lump version.
+    // With compress the lump is written lzma compressed (needs BSP_ENABLE_LZMA, it's written as is otherwise).
+    // The game lump itself is never compressed, only the game lumps inside it can be.
+    // The data isn't copied, it has to stay alive until Commit().
+    void SetLump(int n, const void *data, size_t size, int version = -1, bool compress = false) {
+        if (n < 0 || n >= HEADER_LUMPS)
+            return;
+        replacements[n].data = (const char *)data;
+        replacements[n].size = data == nullptr ? 0 : size;
+        replacements[n].version = version;
+        replacements[n].set = true;
+        replacements[n].compress = compress && n != LUMP_GAME_LUMP && replacements[n].size > 0;
+        std::vector<char>().swap(packed[n]);
+    }
+
+    // Compresses the replacements that asked for it, in parallel if a pool is given.
+    // Commit() calls this, call it before ComputeLayout() to see the compressed sizes.
+    void Compress(ThreadPool *pool = nullptr) {
+        std::vector<int> todo;
+        for (int n = 0; n < HEADER_LUMPS; n++)
+        {
+            if (replacements[n].set && replacements[n].compress && packed[n].empty())
+                todo.push_back(n);
+        }
+        auto compress = [this, &todo](size_t i) {
+            int n = todo[i];
+            if (!LzmaCompress(replacements[n].data, replacements[n].size, packed[n]))
+                packed[n].clear();
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, todo.size(), 1, compress);
+        else
+        {
+            for (size_t i = 0; i < todo.size(); i++)
+                compress(i);
+        }
+    }
+
+    // Empties lump n.
+    inline void RemoveLump(int n) {
+        SetLump(n, nullptr, 0);
+    }
+
+    // Drops the replacement of lump n, it will be copied as is.
+    inline void ResetLump(int n) {
+        if (n < 0 || n >= HEADER_LUMPS)
+            return;
+        memset(&replacements[n], 0, sizeof(Replacement));
+        std::vector<char>().swap(packed[n]);
+    }
+
+    // Returns the header the output file will have (as lump_t, whatever the version).
+    dheader_t ComputeLayout() const {
+        dheader_t result;
+        memset(&result, 0, sizeof(dheader_t));
+        result.ident = source.GetIdent();
+        result.version = source.GetBspVersion();
+        result.mapRevision = source.GetMapRevision();
+
+        // Keep the original order of the lumps in the file.
+        int order[HEADER_LUMPS];
+        for (int n = 0; n < HEADER_LUMPS; n++)
+            order[n] = n;
+        std::stable_sort(order, order + HEADER_LUMPS, [this](int a, int b) {
+            return source.GetLump(a).fileofs < source.GetLump(b).fileofs;
+        });
+
+        size_t offset = sizeof(dheader_t);
+        for (int i = 0; i < HEADER_LUMPS; i++)
+        {
+            int n = order[i];
+            lump_t &entry = result.lumps[n];
+            entry = source.GetLump(n);
+            if (replacements[n].set)
+            {
+                // fourCC holds the uncompressed size of compressed lumps.
+                entry.compressed = packed[n].empty() ? 0 : (int)replacements[n].size;
+                if (replacements[n].version != -1)
+                    entry.version = replacements[n].version;
+            }
+            entry.filelen = (int)GetNewSize(n);
+            if (entry.filelen == 0)
+            {
+                entry.fileofs = 0;
+                continue;
+            }
+            offset = Align(offset);
+            entry.fileofs = (int)offset;
+            offset += entry.filelen;
+        }
+        return result;
+    }
+
+    // Writes the new file, out_path has to be different from the source.
+    // Lumps that should be compressed are compressed first, on the pool if one is given.
+    // Returns 0 on success, 1 if out_path is the source, 2 if it can't be opened and 3 on a read or write error.
+    int Commit(const char *__restrict__ out_path, ThreadPool *pool = nullptr) {
+        if (strcmp(out_path, source.GetPath()) == 0)
+            return 1;
+        source.Flush();
+        Compress(pool);
+
+        FILE *output = fopen(out_path, "wb");
+        if (output == nullptr)
+            return 2;
+
+        dheader_t layout = ComputeLayout();
+        int order[HEADER_LUMPS];
+        for (int n = 0; n < HEADER_LUMPS; n++)
+            order[n] = n;
+        std::stable_sort(order, order + HEADER_LUMPS, [&layout](int a, int b) {
+            return layout.lumps[a].fileofs < layout.lumps[b].fileofs;
+        });
+
+        char *buffer = new char[block_size];
+        dheader_t encoded = layout;
+        EncodeBspHeader(encoded, source.GetProfile());
+        bool ok = fwrite(&encoded, sizeof(dheader_t), 1, output) == 1;
+        size_t position = sizeof(dheader_t);
+        for (int i = 0; i < HEADER_LUMPS && ok; i++)
+        {
+            int n = order[i];
+            const lump_t &entry = layout.lumps[n];
+            if (entry.filelen == 0)
+                continue;
+            ok = Pad(output, entry.fileofs - position);
+            if (!ok)
+                break;
+            if (n == LUMP_GAME_LUMP)
+                ok = WriteGameLump(output, buffer, entry.fileofs);
+            else if (replacements[n].set)
+                ok = fwrite(GetNewData(n), 1, entry.filelen, output) == (size_t)entry.filelen;
+            else
+                ok = Copy(output, buffer, source.GetLump(n).fileofs, entry.filelen);
+            position = entry.fileofs + entry.filelen;
+        }
+
+        delete[] buffer;
+        if (fclose(output) != 0)
+            ok = false;
+        return ok ? 0 : 3;
+    }
+};
+
+#endif // BSP_RELAYOUT_H
@@ -0,0 +1,221 @@
+#pragma once
+
+#ifndef BSP_SNAPSHOT_H
+#define BSP_SNAPSHOT_H
+
+#include <algorithm>
+#include "bsp.hpp"
+#include <vector>
+
+// Immutable, read-only copy of a bsp that any number of threads can query at once.
+// The header and game lump directory are read once, every lump read after that goes
+// through the mapping or positional I/O, so nothing is shared between callers.
+class BspSnapshot
+{
+private:
+    File file;
+    dheader_t header; // lump_t entries whatever the version
+    int profile;
+    std::vector<char> gamedata; // dgamelumpheader_t followed by its entries
+
+    static const char* FlushedPath(Bsp &bsp) {
+        bsp.Flush();
+        return bsp.GetPath();
+    }
+
+public:
+    BspSnapshot(const char *__restrict__ path) : file(path, File::BACKEND_MMAP_READ)
+    {
+        BSP_TRACE_SCOPE("BspSnapshot::BspSnapshot");
+        memset(&header, 0, sizeof(dheader_t));
+        file.ReadAt(&header, 1, 0);
+        profile = DetectBspProfile(header, file.GetSize());
+        NormalizeBspHeader(header, profile);
+
+        BSP_IO_LUMP(LUMP_GAME_LUMP);
+        // A directory outside the file is read as an empty one.
+        const lump_t &gamelump = header.lumps[LUMP_GAME_LUMP];
+        bool inside = gamelump.fileofs >= 0 && gamelump.filelen >= 0 && (size_t)gamelump.fileofs + (size_t)gamelump.filelen <= file.GetSize();
+        gamedata.resize(inside && gamelump.filelen > (int)sizeof(int) ? gamelump.filelen : sizeof(int));
+        if (inside)
+            file.ReadAt<char>(gamedata.data(), std::min(gamedata.size(), (size_t)gamelump.filelen), gamelump.fileofs);
+    }
+
+    // Snapshots the current on-disk state of an open bsp, pending writes are flushed first.
+    explicit BspSnapshot(Bsp &bsp) : BspSnapshot(FlushedPath(bsp)) {}
+
+    BspSnapshot(const BspSnapshot &other) = delete;
+    BspSnapshot& operator=(const BspSnapshot &other) = delete;
+
+    inline int GetIdent() const {
+        return header.ident;
+    }
+
+    inline int GetBspVersion() const {
+        return header.version;
+    }
+
+    // BSP_PROFILE_* detected from the header.
+    inline int GetProfile() const {
+        return profile;
+    }
+
+    inline int GetMapRevision() const {
+        return header.mapRevision;
+    }
+
+    inline const char* GetPath() const {
+        return file.GetPath();
+    }
+
+    inline size_t GetSize() const {
+        return file.GetSize();
+    }
+
+    // Returns the lump_t entry of lump n, zeroed if n is out of range.
+    lump_t GetLump(int n) const {
+        lump_t result;
+        memset(&result, 0, sizeof(lump_t));
+        if (n >= 0 && n < HEADER_LUMPS)
+            result = header.lumps[n];
+        return result;
+    }
+
+    // True if lump n is lzma compressed, whether or not lzma support is enabled.
+    bool IsLumpCompressed(int n) const {
+        if (n < 0 || n >= HEADER_LUMPS || header.lumps[n].compressed == 0)
+            return false;
+        return GetLzmaLumpSize(file, header.lumps[n].fileofs, header.lumps[n].filelen) != 0;
+    }
+
+    // Zero-copy view over lump n, invalid if the file couldn't be mapped or the lump is compressed.
+    template<typename T>
+    LumpView<T> GetLumpView(int n) const {
+        if (n < 0 || n >= HEADER_LUMPS || IsLumpCompressed(n))
+            return LumpView<T>();
+        const lump_t &target = header.lumps[n];
+        return LumpView<T>::FromBytes(file.GetMappedData(target.fileofs, target.filelen), target.filelen);
+    }
+
+    // Reads the whole lump n, decompressed if it's compressed.
+    // Returns false if it couldn't be decompressed, out then holds the raw bytes.
+    bool ReadLump(int n, std::vector<char> &out) const {
+        if (n < 0 || n >= HEADER_LUMPS)
+        {
+            out.clear();
+            return false;
+        }
+        BSP_TRACE_SCOPE_LUMP("BspSnapshot::ReadLump", n);
+        const lump_t &target = header.lumps[n];
+        bool compressed = target.compressed != 0;
+        return ReadLumpBytes(file, target.fileofs, target.filelen, compressed, out) || !compressed || !IsLumpCompressed(n);
+    }
+
+    // Reads the leafs whatever their layout, see ReadBspLeafs(). Returns false if the lump couldn't be read.
+    bool ReadLeafs(std::vector<dleaf_t> &leafs, std::vector<CompressedLightCube> *ambient = nullptr) const {
+        std::vector<char> data;
+        bool ok = ReadLump(LUMP_LEAFS, data);
+        ReadBspLeafs(data.data(), data.size(), profile, header.lumps[LUMP_LEAFS].version, leafs, ambient);
+        return ok;
+    }
+
+    // Reads the faces whatever their layout. Returns false if the lump couldn't be read.
+    bool ReadFaces(std::vector<dface_t> &faces) const {
+        std::vector<char> data;
+        bool ok = ReadLump(LUMP_FACES, data);
+        ReadBspFaces(data.data(), data.size(), profile, faces);
+        return ok;
+    }
+
+    // Offset and elements are in units of T, clamped to the lump.
+    // Compressed lumps have to be decompressed whole for this, prefer ReadLump() for them.
+    // Returns the amount of bytes read.
+    template<typename T>
+    size_t ReadLumpElements(int n, T *buffer, size_t elements = 1, size_t offset = 0) const {
+        if (n < 0 || n >= HEADER_LUMPS)
+            return 0;
+        BSP_IO_LUMP(n);
+        const lump_t &target = header.lumps[n];
+        if (IsLumpCompressed(n))
+        {
+            std::vector<char> data;
+            ReadLump(n, data);
+            size_t elem_count = data.size() / sizeof(T);
+            offset = std::min(offset, elem_count);
+            elements = std::min(elements, elem_count - offset);
+            memcpy((void *)buffer, data.data() + offset * sizeof(T), elements * sizeof(T));
+            return elements * sizeof(T);
+        }
+        size_t elem_count = ClampLumpLength(file, target.fileofs, target.filelen) / sizeof(T);
+        offset = std::min(offset, elem_count);
+        elements = std::min(elements, elem_count - offset);
+        return file.ReadAt(buffer, elements, target.fileofs + offset * sizeof(T));
+    }
+
+    // Returns a zeroed T if the index is out of range.
+    template<typename T>
+    T GetLumpElement(int n, size_t index) const {
+        T elem = T();
+        ReadLumpElements(n, &elem, 1, index);
+        return elem;
+    }
+
+    template<typename T>
+    std::vector<T> GetAllLumpElements(int n) const {
+        if (IsLumpCompressed(n))
+        {
+            std::vector<char> data;
+            ReadLump(n, data);
+            std::vector<T> result(data.size() / sizeof(T));
+            memcpy((void *)result.data(), data.data(), result.size() * sizeof(T));
+            return result;
+        }
+        std::vector<T> result(n >= 0 && n < HEADER_LUMPS ? ClampLumpLength(file, header.lumps[n].fileofs, header.lumps[n].filelen) / sizeof(T) : 0);
+        result.resize(ReadLumpElements(n, result.data(), result.size()) / sizeof(T));
+        return result;
+    }
+
+    // Returns the number of visclusters
+    int GetVisClusterCount() const {
+        return GetLumpElement<int>(LUMP_VISIBILITY, 0);
+    }
+
+    // Returns the number of gamelumps inside the bsp
+    int GetGameLumpCount() const {
+        int count = ((const dgamelumpheader_t *)gamedata.data())->lumpCount;
+        int stored = (gamedata.size() - sizeof(int)) / sizeof(dgamelump_t);
+        return CLAMP(count, 0, stored);
+    }
+
+    // Reads the contents of game lump index (into GetAllGameLumps()), decompressed if it's compressed.
+    // Returns false if the index is out of range or the game lump couldn't be read.
+    bool ReadGameLump(int index, std::vector<char> &out) const {
+        out.clear();
+        if (index < 0 || index >= GetGameLumpCount())
+            return false;
+        BSP_TRACE_SCOPE_LUMP("BspSnapshot::ReadGameLump", LUMP_GAME_LUMP);
+        const dgamelump_t &gamelump = ((const dgamelumpheader_t *)gamedata.data())->gamelump[index];
+        bool decompressed = ReadGameLumpBytes(file, gamelump, out);
+        return decompressed || !(gamelump.flags & GAMELUMPFLAG_COMPRESSED);
+    }
+
+    // Index of the game lump with id (PROP_STATIC, ...), -1 if there is none.
+    int FindGameLump(int id) const {
+        int count = GetGameLumpCount();
+        const dgamelumpheader_t *gameheader = (const dgamelumpheader_t *)gamedata.data();
+        for (int i = 0; i < count; i++)
+        {
+            if (gameheader->gamelump[i].id == id)
+                return i;
+        }
+        return -1;
+    }
+
+    // Returns all the gamelumps inside the bsp.
+    std::vector<dgamelump_t> GetAllGameLumps() const {
+        const dgamelumpheader_t *gameheader = (const dgamelumpheader_t *)gamedata.data();
+        return std::vector<dgamelump_t>(&gameheader->gamelump[0], &gameheader->gamelump[0] + GetGameLumpCount());
+    }
+};
+
+#endif // BSP_SNAPSHOT_H
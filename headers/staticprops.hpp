@@ -0,0 +1,205 @@
+#pragma once
+
+#ifndef BSP_STATICPROPS_H
+#define BSP_STATICPROPS_H
+
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include <string>
+#include <vector>
+
+// What a decoder needs to know about one static prop layout besides the shared fields.
+// Specialized for the layouts that differ.
+template<typename T>
+struct StaticPropTraits
+{
+    static inline unsigned int Flags(const T &prop) {
+        return prop.Flags;
+    }
+
+    static inline float Scale(const T &) {
+        return 1.0f;
+    }
+};
+
+template<>
+struct StaticPropTraits<StaticPropLumpV11_t>
+{
+    static inline unsigned int Flags(const StaticPropLumpV11_t &prop) {
+        return prop.Flags;
+    }
+
+    static inline float Scale(const StaticPropLumpV11_t &prop) {
+        return prop.UniformScale;
+    }
+};
+
+// The sprp game lump decoded into one array per field, whatever version it is.
+// The layout is picked from the game lump version when reading, so one build reads v4 through v11.
+class StaticProps
+{
+public:
+    int version;
+    std::vector<std::string> names;      // model dictionary
+    std::vector<unsigned short> leaves;  // leaf array
+
+    std::vector<Vector> origins;
+    std::vector<QAngle> angles;
+    std::vector<unsigned short> models;  // index into names
+    std::vector<unsigned short> firstleaf;
+    std::vector<unsigned short> leafcount;
+    std::vector<unsigned char> solid;
+    std::vector<unsigned int> flags;
+    std::vector<int> skins;
+    std::vector<float> fademin;
+    std::vector<float> fademax;
+    std::vector<Vector> lightingorigins;
+    std::vector<float> scales;           // 1 before v11
+
+private:
+    void Resize(size_t count) {
+        origins.resize(count);
+        angles.resize(count);
+        models.resize(count);
+        firstleaf.resize(count);
+        leafcount.resize(count);
+        solid.resize(count);
+        flags.resize(count);
+        skins.resize(count);
+        fademin.resize(count);
+        fademax.resize(count);
+        lightingorigins.resize(count);
+        scales.resize(count);
+    }
+
+    // One decoder per layout, records are stride bytes apart (at least sizeof(T)).
+    template<typename T>
+    void Decode(const char *records, size_t count, size_t stride) {
+        Resize(count);
+        T prop;
+        for (size_t i = 0; i < count; i++)
+        {
+            memcpy((void *)&prop, records + i * stride, sizeof(T));
+            origins[i] = prop.Origin;
+            angles[i] = prop.Angles;
+            models[i] = prop.PropType;
+            firstleaf[i] = prop.FirstLeaf;
+            leafcount[i] = prop.LeafCount;
+            solid[i] = prop.Solid;
+            flags[i] = StaticPropTraits<T>::Flags(prop);
+            skins[i] = prop.Skin;
+            fademin[i] = prop.FadeMinDist;
+            fademax[i] = prop.FadeMaxDist;
+            lightingorigins[i] = prop.LightingOrigin;
+            scales[i] = StaticPropTraits<T>::Scale(prop);
+        }
+    }
+
+    // Picks the decoder for the version. v7 has two layouts that only differ in size.
+    // Returns false if the version is unknown or the records are too small for it.
+    bool Dispatch(const char *records, size_t count, size_t stride) {
+        switch (version)
+        {
+        case 4:
+            return DecodeIfFits<StaticPropLumpV4_t>(records, count, stride);
+        case 5:
+            return DecodeIfFits<StaticPropLumpV5_t>(records, count, stride);
+        case 6:
+            return DecodeIfFits<StaticPropLumpV6_t>(records, count, stride);
+        case 7:
+            if (stride == sizeof(StaticPropLumpV7_star_t))
+                return DecodeIfFits<StaticPropLumpV7_star_t>(records, count, stride);
+            return DecodeIfFits<StaticPropLumpV7_t>(records, count, stride);
+        case 8:
+            return DecodeIfFits<StaticPropLumpV8_t>(records, count, stride);
+        case 9:
+            return DecodeIfFits<StaticPropLumpV9_t>(records, count, stride);
+        case 10:
+            return DecodeIfFits<StaticPropLumpV10_t>(records, count, stride);
+        case 11:
+            return DecodeIfFits<StaticPropLumpV11_t>(records, count, stride);
+        default:
+            return false;
+        }
+    }
+
+    template<typename T>
+    bool DecodeIfFits(const char *records, size_t count, size_t stride) {
+        if (count > 0 && stride < sizeof(T))
+            return false;
+        Decode<T>(records, count, stride);
+        return true;
+    }
+
+public:
+    StaticProps() : version(0) {}
+
+    inline size_t size() const {
+        return origins.size();
+    }
+
+    // Decodes a whole (decompressed) sprp game lump of the given version.
+    // Returns 0 on success, 1 if it's truncated and 2 if the version isn't supported.
+    int Read(const char *data, size_t size, int lump_version) {
+        BSP_TRACE_SCOPE("StaticProps::Read");
+        *this = StaticProps();
+        version = lump_version;
+        size_t offset = 0;
+        int count = 0;
+
+        if (size - offset < sizeof(int))
+            return 1;
+        memcpy(&count, data + offset, sizeof(int));
+        offset += sizeof(int);
+        if (count < 0 || (size - offset) / 128 < (size_t)count)
+            return 1;
+        names.resize(count);
+        for (int i = 0; i < count; i++, offset += 128)
+            names[i].assign(data + offset, strnlen(data + offset, 128));
+
+        if (size - offset < sizeof(int))
+            return 1;
+        memcpy(&count, data + offset, sizeof(int));
+        offset += sizeof(int);
+        if (count < 0 || (size - offset) / sizeof(unsigned short) < (size_t)count)
+            return 1;
+        leaves.resize(count);
+        memcpy(leaves.data(), data + offset, count * sizeof(unsigned short));
+        offset += count * sizeof(unsigned short);
+
+        if (size - offset < sizeof(int))
+            return 1;
+        memcpy(&count, data + offset, sizeof(int));
+        offset += sizeof(int);
+        if (count < 0)
+            return 1;
+        // The record size comes from the lump, so layouts that are padded differently still line up.
+        size_t stride = count > 0 ? (size - offset) / count : 0;
+        if (!Dispatch(data + offset, count, stride))
+            return count > 0 && stride == 0 ? 1 : 2;
+        return 0;
+    }
+
+    // Reads the sprp game lump of a Bsp or BspSnapshot, compressed game lumps included.
+    // Returns 0 on success, 1 if it's truncated or couldn't be read, 2 if the version isn't supported
+    // and 3 if there is no sprp game lump.
+    template<typename Source>
+    int Read(Source &bsp) {
+        int index = bsp.FindGameLump(PROP_STATIC);
+        if (index < 0)
+        {
+            *this = StaticProps();
+            return 3;
+        }
+        std::vector<char> data;
+        if (!bsp.ReadGameLump(index, data))
+        {
+            *this = StaticProps();
+            return 1;
+        }
+        return Read(data.data(), data.size(), bsp.GetAllGameLumps()[index].version);
+    }
+};
+
+#endif // BSP_STATICPROPS_H
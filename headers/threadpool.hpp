@@ -0,0 +1,214 @@
+#pragma once
+
+#ifndef BSP_THREADPOOL_H
+#define BSP_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size work-stealing pool.
+// Every worker has its own queue: tasks submitted from a worker go to the back of its queue and it takes them
+// from there (newest first, still warm in cache), idle workers steal the oldest task from the front of another queue.
+// Tasks from other threads are dealt out over the queues round robin.
+class ThreadPool
+{
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues; // One per worker
+    std::atomic<size_t> queued;                 // Tasks sitting in the queues
+    std::atomic<size_t> next_queue;             // Round robin for outside submits
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::condition_variable idle;
+    size_t pending; // Queued and running tasks
+    bool stopping;
+
+    // Worker index of the calling thread in this pool, -1 for other threads.
+    long CurrentWorker() const {
+        return CurrentPool() == this ? CurrentIndex() : -1;
+    }
+
+    static const ThreadPool*& CurrentPool() {
+        static thread_local const ThreadPool *pool = nullptr;
+        return pool;
+    }
+
+    static long& CurrentIndex() {
+        static thread_local long index = -1;
+        return index;
+    }
+
+    // Own queue from the back, then the others from the front.
+    bool TryTake(size_t self, std::function<void()> &task) {
+        size_t count = queues.size();
+        for (size_t k = 0; k < count; k++)
+        {
+            Queue &queue = *queues[(self + k) % count];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+                continue;
+            if (k == 0)
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void WorkerLoop(size_t index) {
+        CurrentPool() = this;
+        CurrentIndex() = (long)index;
+        for (;;)
+        {
+            std::function<void()> task;
+            if (!TryTake(index, task))
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeup.wait(guard, [this] { return stopping || queued > 0; });
+                if (stopping && queued == 0)
+                    return;
+                continue; // The task may be on its way into a queue still, or taken already
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (--pending == 0)
+                    idle.notify_all();
+            }
+        }
+    }
+
+public:
+    // 0 threads picks one per hardware thread.
+    ThreadPool(size_t threads = 0) : queued(0), next_queue(0), pending(0), stopping(false)
+    {
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+        for (size_t i = 0; i < threads; i++)
+            queues.emplace_back(new Queue());
+        for (size_t i = 0; i < threads; i++)
+            workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool &other) = delete;
+    ThreadPool& operator=(const ThreadPool &other) = delete;
+
+    inline size_t GetThreadCount() const {
+        return workers.size();
+    }
+
+    // Index of the calling worker of this pool in [0, GetThreadCount()), -1 if it isn't one.
+    inline long GetWorkerIndex() const {
+        return CurrentWorker();
+    }
+
+    void Submit(std::function<void()> task) {
+        long self = CurrentWorker();
+        size_t target = self >= 0 ? (size_t)self : next_queue.fetch_add(1) % queues.size();
+        {
+            // Counted first so a worker woken for it keeps looking until it's there.
+            std::lock_guard<std::mutex> guard(lock);
+            pending++;
+            queued++;
+        }
+        {
+            std::lock_guard<std::mutex> guard(queues[target]->lock);
+            queues[target]->tasks.push_back(std::move(task));
+        }
+        wakeup.notify_one();
+    }
+
+    // Blocks until every submitted task has finished. Don't call it from inside a task.
+    void Wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        idle.wait(guard, [this] { return pending == 0; });
+    }
+
+    // Calls func(i) for every i in [begin, end), handing out chunk indices at a time, and blocks until all are done.
+    // The calling thread works on chunks too, so this is safe to call from inside a task.
+    template<typename F>
+    void ParallelFor(size_t begin, size_t end, size_t chunk, F func) {
+        if (begin >= end)
+            return;
+        if (chunk == 0)
+            chunk = 1;
+
+        struct Range
+        {
+            std::atomic<size_t> next;
+            std::atomic<size_t> done;
+            size_t end;
+            size_t chunk;
+            std::mutex lock;
+            std::condition_variable finished;
+        };
+        std::shared_ptr<Range> range = std::make_shared<Range>();
+        range->next = begin;
+        range->done = 0;
+        range->end = end;
+        range->chunk = chunk;
+        size_t total = end - begin;
+
+        // Helpers that start after the range ran out just return, so the caller never waits on queued ones.
+        auto work = [range, total, &func]() {
+            for (;;)
+            {
+                size_t first = range->next.fetch_add(range->chunk);
+                if (first >= range->end)
+                    return;
+                size_t last = first + range->chunk < range->end ? first + range->chunk : range->end;
+                for (size_t i = first; i < last; i++)
+                    func(i);
+                if (range->done.fetch_add(last - first) + (last - first) == total)
+                {
+                    std::lock_guard<std::mutex> guard(range->lock);
+                    range->finished.notify_all();
+                }
+            }
+        };
+
+        size_t chunks = (total + chunk - 1) / chunk;
+        size_t helpers = chunks - 1 < workers.size() ? chunks - 1 : workers.size();
+        for (size_t i = 0; i < helpers; i++)
+            Submit(work);
+        work();
+
+        std::unique_lock<std::mutex> guard(range->lock);
+        range->finished.wait(guard, [&range, total] { return range->done == total; });
+    }
+};
+
+#endif // BSP_THREADPOOL_H
@@ -0,0 +1,402 @@
+#pragma once
+
+#ifndef BSP_TRACE_H
+#define BSP_TRACE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include "threadpool.hpp"
+#include <vector>
+
+// A line (mins = maxs = 0) or an axis aligned box swept from start to end.
+struct TraceRequest
+{
+    Vector start;
+    Vector end;
+    Vector mins; // box extents relative to start/end
+    Vector maxs;
+};
+
+struct TraceResult
+{
+    float   fraction;   // how far along start -> end the trace got, 1 if it hit nothing
+    Vector  endpos;     // where it stopped
+    Vector  normal;     // normal of the plane that was hit
+    int     brush;      // index of the brush that was hit, -1 if none
+    int     contents;   // contents of that brush
+    bool    startsolid; // started inside a brush
+    bool    allsolid;   // never left the brush it started in
+};
+
+// Traces lines and swept boxes against the brushes of a bsp.
+// Brushes are collided with their side planes (bevels included, they keep box traces from snagging
+// on edges), candidates come from a bounding volume hierarchy over the brush bounds.
+class BrushTracer
+{
+private:
+    // Distance kept from the surfaces that were hit, like the engine does.
+    static constexpr float DIST_EPSILON = 0.03125f;
+    // Bounds of brushes that aren't closed by axial planes.
+    static constexpr float WORLD_EXTENT = 65536.0f;
+    // Most brushes a leaf of the hierarchy holds.
+    static const int LEAF_BRUSHES = 4;
+
+    struct Plane
+    {
+        float normal[3];
+        float dist;
+    };
+
+    struct Brush
+    {
+        float mins[3];
+        float maxs[3];
+        int firstplane;
+        int numplanes;
+        int contents;
+        int index; // in LUMP_BRUSHES
+    };
+
+    // count > 0: leaf over brushes [first, first + count), otherwise children are first and first + 1.
+    struct BvhNode
+    {
+        float mins[3];
+        int first;
+        float maxs[3];
+        int count;
+    };
+
+    // A trace set up for clipping, start and end are moved to the box center.
+    struct Sweep
+    {
+        float start[3];
+        float end[3];
+        float extents[3];
+        float invdir[3];
+        bool isbox;
+    };
+
+    std::vector<Plane> planes;
+    std::vector<Brush> brushes;
+    std::vector<BvhNode> bvh;
+
+    static inline float Dot(const float *a, const float *b) {
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    }
+
+    void BuildNode(int node, int first, int count) {
+        BvhNode &target = bvh[node];
+        float cmins[3], cmaxs[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            target.mins[axis] = cmins[axis] = WORLD_EXTENT;
+            target.maxs[axis] = cmaxs[axis] = -WORLD_EXTENT;
+        }
+        for (int i = first; i < first + count; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float center = (brushes[i].mins[axis] + brushes[i].maxs[axis]) * 0.5f;
+                target.mins[axis] = std::min(target.mins[axis], brushes[i].mins[axis]);
+                target.maxs[axis] = std::max(target.maxs[axis], brushes[i].maxs[axis]);
+                cmins[axis] = std::min(cmins[axis], center);
+                cmaxs[axis] = std::max(cmaxs[axis], center);
+            }
+        }
+        if (count <= LEAF_BRUSHES)
+        {
+            target.first = first;
+            target.count = count;
+            return;
+        }
+
+        // Median split along the longest axis of the brush centers.
+        int axis = 0;
+        for (int i = 1; i < 3; i++)
+        {
+            if (cmaxs[i] - cmins[i] > cmaxs[axis] - cmins[axis])
+                axis = i;
+        }
+        int half = count / 2;
+        std::nth_element(brushes.begin() + first, brushes.begin() + first + half, brushes.begin() + first + count,
+            [axis](const Brush &a, const Brush &b) {
+                return a.mins[axis] + a.maxs[axis] < b.mins[axis] + b.maxs[axis];
+            });
+
+        int children = (int)bvh.size();
+        bvh.resize(bvh.size() + 2);
+        // bvh may have moved, don't use target after this.
+        bvh[node].first = children;
+        bvh[node].count = 0;
+        BuildNode(children, first, half);
+        BuildNode(children + 1, first + half, count - half);
+    }
+
+    // Slab test of the swept box against a node, only the part of the sweep before fraction counts.
+    inline bool HitsNode(const BvhNode &node, const Sweep &sweep, float fraction) const {
+        float tmin = 0.0f, tmax = fraction;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float lo = node.mins[axis] - sweep.extents[axis];
+            float hi = node.maxs[axis] + sweep.extents[axis];
+            if (sweep.invdir[axis] == INFINITY || sweep.invdir[axis] == -INFINITY)
+            {
+                if (sweep.start[axis] < lo || sweep.start[axis] > hi)
+                    return false;
+                continue;
+            }
+            float t0 = (lo - sweep.start[axis]) * sweep.invdir[axis];
+            float t1 = (hi - sweep.start[axis]) * sweep.invdir[axis];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            tmin = std::max(tmin, t0);
+            tmax = std::min(tmax, t1);
+            if (tmin > tmax)
+                return false;
+        }
+        return true;
+    }
+
+    // Clips the sweep against one brush, narrowing result if it hits it earlier.
+    void ClipToBrush(const Brush &brush, const Sweep &sweep, TraceResult &result) const {
+        float enter = -1.0f, leave = 1.0f;
+        const Plane *lead = nullptr;
+        bool startout = false, getout = false;
+
+        for (int i = 0; i < brush.numplanes; i++)
+        {
+            const Plane &plane = planes[brush.firstplane + i];
+            // Push the plane out by the box so the box becomes a point.
+            float dist = plane.dist;
+            if (sweep.isbox)
+                dist += fabsf(plane.normal[0]) * sweep.extents[0] + fabsf(plane.normal[1]) * sweep.extents[1] + fabsf(plane.normal[2]) * sweep.extents[2];
+
+            float d1 = Dot(sweep.start, plane.normal) - dist;
+            float d2 = Dot(sweep.end, plane.normal) - dist;
+            if (d2 > 0.0f)
+                getout = true;
+            if (d1 > 0.0f)
+                startout = true;
+            // Completely in front of this plane, the brush can't be hit.
+            if (d1 > 0.0f && (d2 >= DIST_EPSILON || d2 >= d1))
+                return;
+            if (d1 <= 0.0f && d2 <= 0.0f)
+                continue;
+
+            if (d1 > d2)
+            {
+                float f = std::max((d1 - DIST_EPSILON) / (d1 - d2), 0.0f);
+                if (f > enter)
+                {
+                    enter = f;
+                    lead = &plane;
+                }
+            }
+            else
+                leave = std::min(leave, (d1 + DIST_EPSILON) / (d1 - d2));
+        }
+
+        if (!startout)
+        {
+            result.startsolid = true;
+            if (!getout)
+            {
+                result.allsolid = true;
+                result.fraction = 0.0f;
+            }
+            result.brush = brush.index;
+            result.contents = brush.contents;
+            return;
+        }
+        if (enter < leave && enter > -1.0f && enter < result.fraction && lead != nullptr)
+        {
+            result.fraction = std::max(enter, 0.0f);
+            result.normal.x = lead->normal[0];
+            result.normal.y = lead->normal[1];
+            result.normal.z = lead->normal[2];
+            result.brush = brush.index;
+            result.contents = brush.contents;
+        }
+    }
+
+public:
+    // Builds from raw lump data. Brushes whose sides or planes are out of range are left out.
+    void Build(const dbrush_t *in_brushes, size_t brush_count, const dbrushside_t *sides, size_t side_count, const dplane_t *in_planes, size_t plane_count) {
+        BSP_TRACE_SCOPE("BrushTracer::Build");
+        planes.clear();
+        brushes.clear();
+        bvh.clear();
+        for (size_t b = 0; b < brush_count; b++)
+        {
+            const dbrush_t &source = in_brushes[b];
+            if (source.firstside < 0 || source.numsides <= 0 || (size_t)source.firstside + source.numsides > side_count)
+                continue;
+
+            Brush brush;
+            brush.firstplane = (int)planes.size();
+            brush.numplanes = 0;
+            brush.contents = source.contents;
+            brush.index = (int)b;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                brush.mins[axis] = -WORLD_EXTENT;
+                brush.maxs[axis] = WORLD_EXTENT;
+            }
+            bool valid = true;
+            for (int s = 0; s < source.numsides && valid; s++)
+            {
+                const dbrushside_t &side = sides[source.firstside + s];
+                if (side.planenum >= plane_count)
+                {
+                    valid = false;
+                    break;
+                }
+                const dplane_t &in = in_planes[side.planenum];
+                Plane plane = {{in.normal.x, in.normal.y, in.normal.z}, in.dist};
+                planes.push_back(plane);
+                brush.numplanes++;
+
+                // The axial sides give the bounds.
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    if (plane.normal[axis] == 1.0f)
+                        brush.maxs[axis] = std::min(brush.maxs[axis], plane.dist);
+                    else if (plane.normal[axis] == -1.0f)
+                        brush.mins[axis] = std::max(brush.mins[axis], -plane.dist);
+                }
+            }
+            if (!valid)
+            {
+                planes.resize(brush.firstplane);
+                continue;
+            }
+            brushes.push_back(brush);
+        }
+
+        if (brushes.empty())
+            return;
+        bvh.reserve(2 * (brushes.size() / LEAF_BRUSHES + 1));
+        bvh.resize(1);
+        BuildNode(0, 0, (int)brushes.size());
+    }
+
+    // Builds from a Bsp or BspSnapshot, compressed lumps included.
+    template<typename Source>
+    void Build(Source &bsp) {
+        std::vector<char> brush_data, side_data, plane_data;
+        bsp.ReadLump(LUMP_BRUSHES, brush_data);
+        bsp.ReadLump(LUMP_BRUSHSIDES, side_data);
+        bsp.ReadLump(LUMP_PLANES, plane_data);
+
+        std::vector<dbrush_t> in_brushes(brush_data.size() / sizeof(dbrush_t));
+        std::vector<dbrushside_t> sides(side_data.size() / sizeof(dbrushside_t));
+        std::vector<dplane_t> in_planes(plane_data.size() / sizeof(dplane_t));
+        memcpy((void *)in_brushes.data(), brush_data.data(), in_brushes.size() * sizeof(dbrush_t));
+        memcpy((void *)sides.data(), side_data.data(), sides.size() * sizeof(dbrushside_t));
+        memcpy((void *)in_planes.data(), plane_data.data(), in_planes.size() * sizeof(dplane_t));
+        Build(in_brushes.data(), in_brushes.size(), sides.data(), sides.size(), in_planes.data(), in_planes.size());
+    }
+
+    inline size_t GetBrushCount() const {
+        return brushes.size();
+    }
+
+    inline size_t GetNodeCount() const {
+        return bvh.size();
+    }
+
+    // Only brushes with contents in mask are hit. Safe to call from any number of threads.
+    TraceResult Trace(const TraceRequest &request, int mask = MASK_SOLID) const {
+        TraceResult result;
+        memset(&result, 0, sizeof(TraceResult));
+        result.fraction = 1.0f;
+        result.brush = -1;
+
+        Sweep sweep;
+        const float *mins = &request.mins.x, *maxs = &request.maxs.x;
+        const float *start = &request.start.x, *end = &request.end.x;
+        sweep.isbox = false;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float offset = (mins[axis] + maxs[axis]) * 0.5f;
+            sweep.extents[axis] = (maxs[axis] - mins[axis]) * 0.5f;
+            sweep.start[axis] = start[axis] + offset;
+            sweep.end[axis] = end[axis] + offset;
+            sweep.invdir[axis] = 1.0f / (sweep.end[axis] - sweep.start[axis]);
+            sweep.isbox |= sweep.extents[axis] != 0.0f;
+        }
+
+        if (!bvh.empty())
+        {
+            int stack[64];
+            int depth = 0;
+            stack[depth++] = 0;
+            while (depth > 0 && !result.allsolid)
+            {
+                const BvhNode &node = bvh[stack[--depth]];
+                if (!HitsNode(node, sweep, result.fraction))
+                    continue;
+                if (node.count > 0)
+                {
+                    for (int i = node.first; i < node.first + node.count; i++)
+                    {
+                        if (brushes[i].contents & mask)
+                            ClipToBrush(brushes[i], sweep, result);
+                    }
+                    continue;
+                }
+                if (depth + 2 > 64)
+                    continue;
+                // Visit the child nearer to the start first, it's more likely to shorten the trace.
+                int axis = 0;
+                float dir = sweep.end[0] - sweep.start[0];
+                for (int i = 1; i < 3; i++)
+                {
+                    if (fabsf(sweep.end[i] - sweep.start[i]) > fabsf(dir))
+                    {
+                        axis = i;
+                        dir = sweep.end[i] - sweep.start[i];
+                    }
+                }
+                const BvhNode &left = bvh[node.first];
+                const BvhNode &right = bvh[node.first + 1];
+                bool left_first = (dir >= 0.0f) == (left.mins[axis] + left.maxs[axis] <= right.mins[axis] + right.maxs[axis]);
+                stack[depth++] = left_first ? node.first + 1 : node.first;
+                stack[depth++] = left_first ? node.first : node.first + 1;
+            }
+        }
+
+        result.endpos.x = start[0] + result.fraction * (end[0] - start[0]);
+        result.endpos.y = start[1] + result.fraction * (end[1] - start[1]);
+        result.endpos.z = start[2] + result.fraction * (end[2] - start[2]);
+        return result;
+    }
+
+    inline TraceResult TraceLine(const Vector &start, const Vector &end, int mask = MASK_SOLID) const {
+        TraceRequest request = {start, end, {0, 0, 0}, {0, 0, 0}};
+        return Trace(request, mask);
+    }
+
+    inline TraceResult TraceBox(const Vector &start, const Vector &end, const Vector &mins, const Vector &maxs, int mask = MASK_SOLID) const {
+        TraceRequest request = {start, end, mins, maxs};
+        return Trace(request, mask);
+    }
+
+    // Runs count traces, spread over the pool if one is given.
+    void TraceBatch(const TraceRequest *requests, size_t count, TraceResult *results, int mask = MASK_SOLID, ThreadPool *pool = nullptr) const {
+        if (pool == nullptr)
+        {
+            for (size_t i = 0; i < count; i++)
+                results[i] = Trace(requests[i], mask);
+            return;
+        }
+        pool->ParallelFor(0, count, 256, [this, requests, results, mask](size_t i) {
+            results[i] = Trace(requests[i], mask);
+        });
+    }
+};
+
+#endif // BSP_TRACE_H
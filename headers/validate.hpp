@@ -0,0 +1,557 @@
+#pragma once
+
+#ifndef BSP_VALIDATE_H
+#define BSP_VALIDATE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "bsp.hpp"
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include "threadpool.hpp"
+#include <functional>
+#include <stdio.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Checks of BspValidator, every error is one of these.
+enum
+{
+    VALIDATE_LUMP_BOUNDS = 0,       // lump outside the file (index is the lump)
+    VALIDATE_LUMP_SIZE,             // lump length isn't a whole number of elements
+    VALIDATE_LUMP_COMPRESSED,       // compressed lump that couldn't be decompressed
+    VALIDATE_BRUSH_SIDES,           // brush sides outside the brushsides
+    VALIDATE_BRUSHSIDE_PLANE,
+    VALIDATE_BRUSHSIDE_TEXINFO,
+    VALIDATE_FACE_PLANE,
+    VALIDATE_FACE_EDGES,            // face edges outside the surfedges
+    VALIDATE_FACE_TEXINFO,
+    VALIDATE_FACE_DISPINFO,
+    VALIDATE_SURFEDGE_EDGE,
+    VALIDATE_EDGE_VERTEX,
+    VALIDATE_NODE_PLANE,
+    VALIDATE_NODE_CHILD,            // child node not after its parent, or child leaf out of range
+    VALIDATE_NODE_FACES,
+    VALIDATE_LEAF_FACES,            // leaf faces outside the leaffaces
+    VALIDATE_LEAF_BRUSHES,          // leaf brushes outside the leafbrushes
+    VALIDATE_LEAF_CLUSTER,
+    VALIDATE_LEAFFACE_FACE,
+    VALIDATE_LEAFBRUSH_BRUSH,
+    VALIDATE_DISPINFO_FACE,
+    VALIDATE_DISPINFO_POWER,
+    VALIDATE_DISPINFO_VERTS,        // displacement verts outside the disp verts
+    VALIDATE_DISPINFO_TRIS,         // displacement tris outside the disp tris
+    VALIDATE_MODEL_HEADNODE,
+    VALIDATE_MODEL_FACES,
+    VALIDATE_VIS_HEADER,            // cluster count negative or the offset table outside the lump
+    VALIDATE_VIS_OFFSET,            // PVS/PAS offset outside the row data (index is cluster * 2 + set)
+    VALIDATE_GAMELUMP_HEADER,       // game lump count negative or the directory outside the lump
+    VALIDATE_GAMELUMP_BOUNDS,       // game lump outside the file
+    VALIDATE_CHECKS,
+};
+
+// One broken reference: element index of the lump the check is about, the value it holds and the
+// limit it had to stay below.
+struct ValidationError
+{
+    int check;
+    unsigned int index;
+    long long value;
+    long long limit;
+};
+
+// Checks every index between lumps before anything else reads them, so a corrupted or malicious map can be
+// rejected without ever indexing out of bounds. The flat index lumps (brushsides, edges, surfedges, leaffaces,
+// leafbrushes, vis offsets) are range checked 8 or 4 indices at a time with SSE2 and only blocks with a bad
+// index are looked at one by one. Every check runs over chunks of its lump, spread over the pool if one is given.
+// Lumps are used straight from the mapping when possible (BspSnapshot, mmap backends).
+class BspValidator
+{
+private:
+    static constexpr size_t CHUNK = 1 << 16;
+
+    // Errors of one task, merged once all of them are done.
+    struct Sink
+    {
+        std::vector<ValidationError> errors;
+        size_t counts[VALIDATE_CHECKS];
+        size_t max_errors;
+
+        explicit Sink(size_t new_max_errors) : max_errors(new_max_errors) {
+            memset(counts, 0, sizeof(counts));
+        }
+
+        inline void Add(int check, size_t index, long long value, long long limit) {
+            counts[check]++;
+            if (errors.size() < max_errors)
+                errors.push_back(ValidationError{check, (unsigned int)index, value, limit});
+        }
+    };
+
+    // A lump as T, either straight from the source or copied into storage.
+    template<typename T>
+    struct Lump
+    {
+        std::vector<char> storage;
+        const T *data = nullptr;
+        size_t count = 0;
+    };
+
+    std::vector<ValidationError> errors;
+    size_t counts[VALIDATE_CHECKS];
+    size_t max_errors;
+
+    template<typename T, typename Source>
+    static void LoadLump(Source &bsp, int n, Lump<T> &out, Sink &sink) {
+        lump_t lump = bsp.GetLump(n);
+        if (lump.compressed == 0)
+        {
+            LumpView<T> view = bsp.template GetLumpView<T>(n);
+            if (view.IsValid() && view.size() * sizeof(T) == (size_t)std::max(lump.filelen, 0))
+            {
+                out.data = view.data();
+                out.count = view.size();
+                if (lump.filelen > 0 && out.data != nullptr)
+                    return;
+            }
+        }
+        if (!bsp.ReadLump(n, out.storage))
+        {
+            sink.Add(VALIDATE_LUMP_COMPRESSED, n, lump.filelen, 0);
+            out.storage.clear();
+        }
+        if (out.storage.size() % sizeof(T) != 0)
+            sink.Add(VALIDATE_LUMP_SIZE, n, (long long)out.storage.size(), sizeof(T));
+        // std::vector<char> storage is only char aligned in theory, new[] gives max_align_t in practice.
+        out.count = out.storage.size() / sizeof(T);
+        out.data = out.count > 0 ? (const T *)out.storage.data() : nullptr;
+    }
+
+    // Bias, mask and limit of a 16 bit lane that has to be below count (or -1 if allow_minus_one).
+    static inline void Limit16(size_t count, bool allow_minus_one, uint16_t &bias, uint16_t &mask, uint16_t &limit) {
+        size_t bound = count + (allow_minus_one ? 1 : 0);
+        bias = allow_minus_one ? 1 : 0;
+        mask = bound > 0xFFFF ? 0 : 0xFFFF;
+        limit = bound > 0xFFFF ? 1 : (uint16_t)bound;
+    }
+
+    // Calls bad(i) for every 16 bit value i with ((values[i] + bias[i % 8]) & mask[i % 8]) >= limit[i % 8].
+    template<typename Bad>
+    static void ScanRange16(const uint16_t *values, size_t count, const uint16_t *bias, const uint16_t *mask, const uint16_t *limit, Bad &&bad) {
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128i vbias = _mm_loadu_si128((const __m128i *)bias);
+        __m128i vmask = _mm_loadu_si128((const __m128i *)mask);
+        __m128i vlimit = _mm_loadu_si128((const __m128i *)limit);
+        __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i v = _mm_and_si128(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(values + i)), vbias), vmask);
+            // limit - v saturates to 0 exactly when v >= limit.
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(vlimit, v), zero)) == 0)
+                continue;
+            for (size_t k = i; k < i + 8; k++)
+            {
+                if ((uint16_t)((values[k] + bias[k & 7]) & mask[k & 7]) >= limit[k & 7])
+                    bad(k);
+            }
+        }
+#endif
+        for (; i < count; i++)
+        {
+            if ((uint16_t)((values[i] + bias[i & 7]) & mask[i & 7]) >= limit[i & 7])
+                bad(i);
+        }
+    }
+
+    // Calls bad(i) for every 32 bit value i with (uint32)(values[i] + bias[i % 4]) >= limit[i % 4].
+    template<typename Bad>
+    static void ScanRange32(const uint32_t *values, size_t count, const uint32_t *bias, const uint32_t *limit, Bad &&bad) {
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128i vbias = _mm_loadu_si128((const __m128i *)bias);
+        __m128i sign = _mm_set1_epi32((int)0x80000000u);
+        // Unsigned compare through the signed one with both sides shifted by 2^31.
+        __m128i vlimit = _mm_xor_si128(_mm_loadu_si128((const __m128i *)limit), sign);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i v = _mm_xor_si128(_mm_add_epi32(_mm_loadu_si128((const __m128i *)(values + i)), vbias), sign);
+            if (_mm_movemask_epi8(_mm_cmplt_epi32(v, vlimit)) == 0xFFFF)
+                continue;
+            for (size_t k = i; k < i + 4; k++)
+            {
+                if (values[k] + bias[k & 3] >= limit[k & 3])
+                    bad(k);
+            }
+        }
+#endif
+        for (; i < count; i++)
+        {
+            if (values[i] + bias[i & 3] >= limit[i & 3])
+                bad(i);
+        }
+    }
+
+    // Whether first + count stays inside [0, total].
+    static inline bool InRange(long long first, long long count, size_t total) {
+        return first >= 0 && count >= 0 && (unsigned long long)(first + count) <= total;
+    }
+
+    // Sums the counts of every sink and keeps the first max_errors errors by check and index.
+    int Merge(const std::vector<Sink> &sinks) {
+        for (const Sink &sink : sinks)
+        {
+            for (int check = 0; check < VALIDATE_CHECKS; check++)
+                counts[check] += sink.counts[check];
+            errors.insert(errors.end(), sink.errors.begin(), sink.errors.end());
+        }
+        std::sort(errors.begin(), errors.end(), [](const ValidationError &a, const ValidationError &b) {
+            return a.check != b.check ? a.check < b.check : a.index < b.index;
+        });
+        if (errors.size() > max_errors)
+            errors.resize(max_errors);
+        return GetErrorCount() == 0 ? 0 : 1;
+    }
+
+public:
+    // Only the first max_errors errors are kept, all of them are counted.
+    explicit BspValidator(size_t new_max_errors = 64) : max_errors(new_max_errors)
+    {
+        memset(counts, 0, sizeof(counts));
+    }
+
+    // Validates a Bsp or BspSnapshot. Returns 0 if every check passed, 1 if there are errors (GetErrors()).
+    template<typename Source>
+    int Validate(Source &bsp, ThreadPool *pool = nullptr) {
+        BSP_TRACE_SCOPE("BspValidator::Validate");
+        errors.clear();
+        memset(counts, 0, sizeof(counts));
+        Sink load(max_errors);
+
+        // Header first, every later read is clamped to the file anyway.
+        size_t file_size = bsp.GetSize();
+        for (int n = 0; n < HEADER_LUMPS; n++)
+        {
+            lump_t lump = bsp.GetLump(n);
+            if (lump.fileofs < 0 || lump.filelen < 0 || (size_t)lump.fileofs + (size_t)lump.filelen > file_size)
+                load.Add(VALIDATE_LUMP_BOUNDS, n, (long long)lump.fileofs + lump.filelen, (long long)file_size);
+        }
+        // Nothing is read through a broken lump table, every reference check would just fail along.
+        if (load.counts[VALIDATE_LUMP_BOUNDS] > 0)
+        {
+            std::vector<Sink> sinks(1, load);
+            return Merge(sinks);
+        }
+
+        Lump<dbrush_t> brushes;
+        Lump<dbrushside_t> brushsides;
+        Lump<int> surfedges;
+        Lump<dedge_t> edges;
+        Lump<dnode_t> nodes;
+        Lump<unsigned short> leaffaces, leafbrushes;
+        Lump<dmodel_t> models;
+        Lump<ddispinfo_t> dispinfos;
+        Lump<char> vis, gamelump;
+        LoadLump(bsp, LUMP_BRUSHES, brushes, load);
+        LoadLump(bsp, LUMP_BRUSHSIDES, brushsides, load);
+        LoadLump(bsp, LUMP_SURFEDGES, surfedges, load);
+        LoadLump(bsp, LUMP_EDGES, edges, load);
+        LoadLump(bsp, LUMP_NODES, nodes, load);
+        LoadLump(bsp, LUMP_LEAFFACES, leaffaces, load);
+        LoadLump(bsp, LUMP_LEAFBRUSHES, leafbrushes, load);
+        LoadLump(bsp, LUMP_MODELS, models, load);
+        LoadLump(bsp, LUMP_DISPINFO, dispinfos, load);
+        LoadLump(bsp, LUMP_VISIBILITY, vis, load);
+        LoadLump(bsp, LUMP_GAME_LUMP, gamelump, load);
+        // Faces and leafs have a few layouts, these are converted.
+        std::vector<dface_t> faces;
+        std::vector<dleaf_t> leafs;
+        if (!bsp.ReadFaces(faces))
+            load.Add(VALIDATE_LUMP_COMPRESSED, LUMP_FACES, bsp.GetLump(LUMP_FACES).filelen, 0);
+        if (!bsp.ReadLeafs(leafs))
+            load.Add(VALIDATE_LUMP_COMPRESSED, LUMP_LEAFS, bsp.GetLump(LUMP_LEAFS).filelen, 0);
+
+        // Lumps that are only indexed into, their element counts are enough.
+        auto element_count = [&](int n, size_t size) -> size_t {
+            lump_t lump = bsp.GetLump(n);
+            if (lump.compressed == 0)
+            {
+                size_t length = lump.filelen > 0 ? std::min((size_t)lump.filelen, lump.fileofs >= 0 && (size_t)lump.fileofs < file_size ? file_size - lump.fileofs : 0) : 0;
+                if (length % size != 0)
+                    load.Add(VALIDATE_LUMP_SIZE, n, (long long)length, (long long)size);
+                return length / size;
+            }
+            std::vector<char> data;
+            if (!bsp.ReadLump(n, data))
+            {
+                load.Add(VALIDATE_LUMP_COMPRESSED, n, lump.filelen, 0);
+                data.clear();
+            }
+            if (data.size() % size != 0)
+                load.Add(VALIDATE_LUMP_SIZE, n, (long long)data.size(), (long long)size);
+            return data.size() / size;
+        };
+        size_t planes = element_count(LUMP_PLANES, sizeof(dplane_t));
+        size_t texinfos = element_count(LUMP_TEXINFO, sizeof(texinfo_t));
+        size_t vertexes = element_count(LUMP_VERTEXES, sizeof(Vector));
+        size_t dispverts = element_count(LUMP_DISP_VERTS, sizeof(dDispVert));
+        size_t disptris = element_count(LUMP_DISP_TRIS, sizeof(CDispTri));
+
+        int clusters = 0;
+        if (vis.count >= sizeof(int))
+            memcpy(&clusters, vis.data, sizeof(int));
+        bool vis_table = clusters >= 0 && (vis.count - std::min(vis.count, sizeof(int))) / (2 * sizeof(int)) >= (size_t)clusters;
+        if (vis.count > 0 && !vis_table)
+            load.Add(VALIDATE_VIS_HEADER, 0, clusters, (long long)((vis.count - std::min(vis.count, sizeof(int))) / (2 * sizeof(int))));
+
+        int gamelump_count = 0;
+        if (gamelump.count >= sizeof(int))
+            memcpy(&gamelump_count, gamelump.data, sizeof(int));
+        bool gamelump_table = gamelump_count >= 0 && (gamelump.count - std::min(gamelump.count, sizeof(int))) / sizeof(dgamelump_t) >= (size_t)gamelump_count;
+        if (gamelump.count > 0 && !gamelump_table)
+            load.Add(VALIDATE_GAMELUMP_HEADER, 0, gamelump_count, (long long)((gamelump.count - std::min(gamelump.count, sizeof(int))) / sizeof(dgamelump_t)));
+
+        // Every check over chunks of its lump, each task with its own sink.
+        std::vector<std::function<void(Sink &)>> tasks;
+        auto chunked = [&](size_t count, std::function<void(Sink &, size_t, size_t)> check) {
+            for (size_t first = 0; first < count; first += CHUNK)
+            {
+                size_t last = std::min(count, first + CHUNK);
+                tasks.push_back([check, first, last](Sink &sink) { check(sink, first, last); });
+            }
+        };
+
+        chunked(brushes.count, [&](Sink &sink, size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+            {
+                if (!InRange(brushes.data[i].firstside, brushes.data[i].numsides, brushsides.count))
+                    sink.Add(VALIDATE_BRUSH_SIDES, i, (long long)brushes.data[i].firstside + brushes.data[i].numsides, (long long)brushsides.count);
+            }
+        });
+        // planenum, texinfo, dispinfo, bevel of 2 brushsides per 8 lanes, texinfo can be -1.
+        chunked(brushsides.count, [&](Sink &sink, size_t first, size_t last) {
+            uint16_t bias[8], mask[8], limit[8];
+            for (int side = 0; side < 2; side++)
+            {
+                Limit16(planes, false, bias[side * 4], mask[side * 4], limit[side * 4]);
+                Limit16(texinfos, true, bias[side * 4 + 1], mask[side * 4 + 1], limit[side * 4 + 1]);
+                for (int lane = 2; lane < 4; lane++)
+                {
+                    bias[side * 4 + lane] = mask[side * 4 + lane] = 0;
+                    limit[side * 4 + lane] = 1;
+                }
+            }
+            const uint16_t *values = (const uint16_t *)(brushsides.data + first);
+            ScanRange16(values, (last - first) * 4, bias, mask, limit, [&](size_t k) {
+                const dbrushside_t &side = brushsides.data[first + k / 4];
+                if (k % 4 == 0)
+                    sink.Add(VALIDATE_BRUSHSIDE_PLANE, first + k / 4, side.planenum, (long long)planes);
+                else
+                    sink.Add(VALIDATE_BRUSHSIDE_TEXINFO, first + k / 4, side.texinfo, (long long)texinfos);
+            });
+        });
+        chunked(faces.size(), [&](Sink &sink, size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+            {
+                const dface_t &face = faces[i];
+                if (face.planenum >= planes)
+                    sink.Add(VALIDATE_FACE_PLANE, i, face.planenum, (long long)planes);
+                if (!InRange(face.firstedge, face.numedges, surfedges.count))
+                    sink.Add(VALIDATE_FACE_EDGES, i, (long long)face.firstedge + face.numedges, (long long)surfedges.count);
+                if (face.texinfo < -1 || (face.texinfo >= 0 && (size_t)face.texinfo >= texinfos))
+                    sink.Add(VALIDATE_FACE_TEXINFO, i, face.texinfo, (long long)texinfos);
+                if (face.dispinfo < -1 || (face.dispinfo >= 0 && (size_t)face.dispinfo >= dispinfos.count))
+                    sink.Add(VALIDATE_FACE_DISPINFO, i, face.dispinfo, (long long)dispinfos.count);
+            }
+        });
+        // -edges < surfedge < edges, shifted to 0 <= surfedge + edges - 1 < 2 * edges - 1.
+        chunked(surfedges.count, [&](Sink &sink, size_t first, size_t last) {
+            uint32_t bias[4], limit[4];
+            for (int lane = 0; lane < 4; lane++)
+            {
+                bias[lane] = edges.count > 0 ? (uint32_t)(edges.count - 1) : 0;
+                limit[lane] = edges.count > 0 ? (uint32_t)std::min(edges.count * 2 - 1, (size_t)0xFFFFFFFFu) : 0;
+            }
+            ScanRange32((const uint32_t *)(surfedges.data + first), last - first, bias, limit, [&](size_t k) {
+                sink.Add(VALIDATE_SURFEDGE_EDGE, first + k, surfedges.data[first + k], (long long)edges.count);
+            });
+        });
+        chunked(edges.count, [&](Sink &sink, size_t first, size_t last) {
+            uint16_t bias[8], mask[8], limit[8];
+            for (int lane = 0; lane < 8; lane++)
+                Limit16(vertexes, false, bias[lane], mask[lane], limit[lane]);
+            ScanRange16((const uint16_t *)(edges.data + first), (last - first) * 2, bias, mask, limit, [&](size_t k) {
+                sink.Add(VALIDATE_EDGE_VERTEX, first + k / 2, edges.data[first + k / 2].v[k % 2], (long long)vertexes);
+            });
+        });
+        // Children come after their parent like vbsp writes them, which also rules out cycles.
+        chunked(nodes.count, [&](Sink &sink, size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+            {
+                const dnode_t &node = nodes.data[i];
+                if (node.planenum < 0 || (size_t)node.planenum >= planes)
+                    sink.Add(VALIDATE_NODE_PLANE, i, node.planenum, (long long)planes);
+                for (int side = 0; side < 2; side++)
+                {
+                    int child = node.children[side];
+                    if (child >= 0 ? (size_t)child <= i || (size_t)child >= nodes.count : (size_t)(-1LL - child) >= leafs.size())
+                        sink.Add(VALIDATE_NODE_CHILD, i, child, child >= 0 ? (long long)nodes.count : -(long long)leafs.size());
+                }
+                if (!InRange(node.firstface, node.numfaces, faces.size()))
+                    sink.Add(VALIDATE_NODE_FACES, i, (long long)node.firstface + node.numfaces, (long long)faces.size());
+            }
+        });
+        chunked(leafs.size(), [&](Sink &sink, size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+            {
+                const dleaf_t &leaf = leafs[i];
+                if (!InRange(leaf.firstleafface, leaf.numleaffaces, leaffaces.count))
+                    sink.Add(VALIDATE_LEAF_FACES, i, (long long)leaf.firstleafface + leaf.numleaffaces, (long long)leaffaces.count);
+                if (!InRange(leaf.firstleafbrush, leaf.numleafbrushes, leafbrushes.count))
+                    sink.Add(VALIDATE_LEAF_BRUSHES, i, (long long)leaf.firstleafbrush + leaf.numleafbrushes, (long long)leafbrushes.count);
+                // Without vis every cluster goes, there is nothing to index.
+                if (vis.count > 0 && (leaf.cluster < -1 || leaf.cluster >= clusters))
+                    sink.Add(VALIDATE_LEAF_CLUSTER, i, leaf.cluster, clusters);
+            }
+        });
+        chunked(leaffaces.count, [&](Sink &sink, size_t first, size_t last) {
+            uint16_t bias[8], mask[8], limit[8];
+            for (int lane = 0; lane < 8; lane++)
+                Limit16(faces.size(), false, bias[lane], mask[lane], limit[lane]);
+            ScanRange16(leaffaces.data + first, last - first, bias, mask, limit, [&](size_t k) {
+                sink.Add(VALIDATE_LEAFFACE_FACE, first + k, leaffaces.data[first + k], (long long)faces.size());
+            });
+        });
+        chunked(leafbrushes.count, [&](Sink &sink, size_t first, size_t last) {
+            uint16_t bias[8], mask[8], limit[8];
+            for (int lane = 0; lane < 8; lane++)
+                Limit16(brushes.count, false, bias[lane], mask[lane], limit[lane]);
+            ScanRange16(leafbrushes.data + first, last - first, bias, mask, limit, [&](size_t k) {
+                sink.Add(VALIDATE_LEAFBRUSH_BRUSH, first + k, leafbrushes.data[first + k], (long long)brushes.count);
+            });
+        });
+        chunked(dispinfos.count, [&](Sink &sink, size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+            {
+                const ddispinfo_t &info = dispinfos.data[i];
+                if (info.MapFace >= faces.size())
+                    sink.Add(VALIDATE_DISPINFO_FACE, i, info.MapFace, (long long)faces.size());
+                if (info.power < 2 || info.power > 4)
+                {
+                    sink.Add(VALIDATE_DISPINFO_POWER, i, info.power, 5);
+                    continue;
+                }
+                long long side = (1 << info.power) + 1, quads = 1LL << (info.power * 2);
+                if (!InRange(info.DispVertStart, side * side, dispverts))
+                    sink.Add(VALIDATE_DISPINFO_VERTS, i, (long long)info.DispVertStart + side * side, (long long)dispverts);
+                if (!InRange(info.DispTriStart, quads * 2, disptris))
+                    sink.Add(VALIDATE_DISPINFO_TRIS, i, (long long)info.DispTriStart + quads * 2, (long long)disptris);
+            }
+        });
+        chunked(models.count, [&](Sink &sink, size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+            {
+                const dmodel_t &model = models.data[i];
+                if (model.headnode < 0 || (size_t)model.headnode >= nodes.count)
+                    sink.Add(VALIDATE_MODEL_HEADNODE, i, model.headnode, (long long)nodes.count);
+                if (!InRange(model.firstface, model.numfaces, faces.size()))
+                    sink.Add(VALIDATE_MODEL_FACES, i, (long long)model.firstface + model.numfaces, (long long)faces.size());
+            }
+        });
+        // Every offset has to point past the table and inside the lump.
+        if (vis_table)
+        {
+            size_t table_end = sizeof(int) + (size_t)clusters * 2 * sizeof(int);
+            chunked((size_t)clusters * 2, [&, table_end](Sink &sink, size_t first, size_t last) {
+                uint32_t bias[4], limit[4];
+                for (int lane = 0; lane < 4; lane++)
+                {
+                    bias[lane] = (uint32_t)(0 - table_end);
+                    limit[lane] = (uint32_t)(vis.count - table_end);
+                }
+                // The table isn't necessarily aligned in the file.
+                std::vector<uint32_t> offsets(last - first);
+                memcpy(offsets.data(), vis.data + sizeof(int) + first * sizeof(uint32_t), offsets.size() * sizeof(uint32_t));
+                ScanRange32(offsets.data(), offsets.size(), bias, limit, [&](size_t k) {
+                    sink.Add(VALIDATE_VIS_OFFSET, first + k, (int)offsets[k], (long long)vis.count);
+                });
+            });
+        }
+        if (gamelump_table)
+        {
+            chunked((size_t)gamelump_count, [&](Sink &sink, size_t first, size_t last) {
+                for (size_t i = first; i < last; i++)
+                {
+                    dgamelump_t entry;
+                    memcpy(&entry, gamelump.data + sizeof(int) + i * sizeof(dgamelump_t), sizeof(dgamelump_t));
+                    // Compressed game lumps store their uncompressed size, only the start has to be in the file then.
+                    long long length = (entry.flags & GAMELUMPFLAG_COMPRESSED) ? 0 : entry.filelen;
+                    if (!InRange(entry.fileofs, length, file_size) || entry.filelen < 0)
+                        sink.Add(VALIDATE_GAMELUMP_BOUNDS, i, (long long)entry.fileofs + length, (long long)file_size);
+                }
+            });
+        }
+
+        // With lumps that can't be decompressed (no lzma support) every reference check would just fail along,
+        // only the lumps are reported.
+        if (load.counts[VALIDATE_LUMP_COMPRESSED] > 0)
+            tasks.clear();
+
+        std::vector<Sink> sinks(tasks.size(), Sink(max_errors));
+        if (pool != nullptr)
+            pool->ParallelFor(0, tasks.size(), 1, [&](size_t t) { tasks[t](sinks[t]); });
+        else
+        {
+            for (size_t t = 0; t < tasks.size(); t++)
+                tasks[t](sinks[t]);
+        }
+
+        sinks.push_back(load);
+        return Merge(sinks);
+    }
+
+    // The first max_errors errors, by check and index.
+    inline const std::vector<ValidationError>& GetErrors() const {
+        return errors;
+    }
+
+    // All errors found, including the ones that weren't kept.
+    size_t GetErrorCount() const {
+        size_t total = 0;
+        for (int check = 0; check < VALIDATE_CHECKS; check++)
+            total += counts[check];
+        return total;
+    }
+
+    inline size_t GetErrorCount(int check) const {
+        return check >= 0 && check < VALIDATE_CHECKS ? counts[check] : 0;
+    }
+
+    static const char* GetCheckName(int check) {
+        static const char *const names[VALIDATE_CHECKS] = {
+            "lump bounds", "lump size", "lump compression", "brush sides", "brushside plane", "brushside texinfo",
+            "face plane", "face edges", "face texinfo", "face dispinfo", "surfedge edge", "edge vertex",
+            "node plane", "node child", "node faces", "leaf faces", "leaf brushes", "leaf cluster",
+            "leafface face", "leafbrush brush", "dispinfo face", "dispinfo power", "dispinfo verts", "dispinfo tris",
+            "model headnode", "model faces", "vis header", "vis offset", "gamelump header", "gamelump bounds",
+        };
+        return check >= 0 && check < VALIDATE_CHECKS ? names[check] : "unknown";
+    }
+
+    // One line per kept error ("brushside plane 12: 70000 (limit 7000)"), then the totals of every failed check.
+    void PrintReport(FILE *output) const {
+        for (const ValidationError &error : errors)
+            fprintf(output, "%s %u: %lld (limit %lld)\n", GetCheckName(error.check), error.index, error.value, error.limit);
+        for (int check = 0; check < VALIDATE_CHECKS; check++)
+        {
+            if (counts[check] > 0)
+                fprintf(output, "%s: %zu errors\n", GetCheckName(check), counts[check]);
+        }
+    }
+};
+
+#endif // BSP_VALIDATE_H
@@ -0,0 +1,185 @@
+#pragma once
+
+#ifndef BSP_VISIBILITY_H
+#define BSP_VISIBILITY_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include "threadpool.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The PVS and PAS of every cluster decompressed into cluster x cluster bit matrices.
+// Bit b of row a is set if cluster b can be seen (PVS) or heard (PAS) from cluster a.
+// Rows are padded to a multiple of 64 bytes and the matrices are 64 byte aligned so a row never shares a cache line.
+class VisMatrix
+{
+public:
+    enum
+    {
+        VIS_PVS = 0,
+        VIS_PAS = 1,
+    };
+
+private:
+    uint8_t *bits[2];
+    int numclusters;
+    size_t rowbytes; // Bytes of a row that hold clusters
+    size_t stride;   // Bytes between rows
+
+    // Length of the run of non-zero bytes at the start of data, at most size.
+    static size_t LiteralRun(const uint8_t *data, size_t size) {
+        size_t run = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        while (run + 16 <= size)
+        {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(data + run));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+            if (mask != 0)
+                return run + __builtin_ctz(mask);
+            run += 16;
+        }
+#endif
+        while (run < size && data[run] != 0)
+            run++;
+        return run;
+    }
+
+    // Expands one run-length encoded row into row, which is already zeroed.
+    // A zero byte is followed by the amount of zero bytes it stands for, anything else is copied as is.
+    // Zero runs are just skipped and literal runs are copied in one go.
+    static void DecodeRow(const uint8_t *data, size_t size, uint8_t *row, size_t rowbytes) {
+        size_t in = 0, out = 0;
+        while (in < size && out < rowbytes)
+        {
+            if (data[in] == 0)
+            {
+                if (in + 1 >= size)
+                    return;
+                out += data[in + 1];
+                in += 2;
+                continue;
+            }
+            size_t run = LiteralRun(data + in, size - in);
+            if (run > rowbytes - out)
+                run = rowbytes - out;
+            memcpy(row + out, data + in, run);
+            in += run;
+            out += run;
+        }
+    }
+
+public:
+    VisMatrix() : numclusters(0), rowbytes(0), stride(0)
+    {
+        bits[VIS_PVS] = bits[VIS_PAS] = nullptr;
+    }
+
+    ~VisMatrix()
+    {
+        Clear();
+    }
+
+    VisMatrix(const VisMatrix &other) = delete;
+    VisMatrix& operator=(const VisMatrix &other) = delete;
+
+    void Clear() {
+        free(bits[VIS_PVS]);
+        free(bits[VIS_PAS]);
+        bits[VIS_PVS] = bits[VIS_PAS] = nullptr;
+        numclusters = 0;
+        rowbytes = stride = 0;
+    }
+
+    // Decodes a whole (uncompressed) vis lump, rows are decoded in parallel if a pool is given.
+    // Rows whose offsets point outside the lump stay empty.
+    // Returns 0 on success, 1 if the lump header is invalid and 2 if the matrices couldn't be allocated.
+    int Decode(const char *lump, size_t size, ThreadPool *pool = nullptr) {
+        BSP_TRACE_SCOPE("VisMatrix::Decode");
+        Clear();
+        int count = 0;
+        if (lump == nullptr || size < sizeof(int))
+            return size == 0 ? 0 : 1;
+        memcpy(&count, lump, sizeof(int));
+        if (count < 0 || (size - sizeof(int)) / (2 * sizeof(int)) < (size_t)count)
+            return 1;
+        if (count == 0)
+            return 0;
+
+        size_t row_bytes = ((size_t)count + 7) / 8;
+        size_t row_stride = (row_bytes + 63) & ~(size_t)63;
+        for (int set = VIS_PVS; set <= VIS_PAS; set++)
+        {
+            void *matrix = nullptr;
+            if (posix_memalign(&matrix, 64, row_stride * count) != 0)
+            {
+                Clear();
+                return 2;
+            }
+            memset(matrix, 0, row_stride * count);
+            bits[set] = (uint8_t *)matrix;
+        }
+        numclusters = count;
+        rowbytes = row_bytes;
+        stride = row_stride;
+
+        const uint8_t *data = (const uint8_t *)lump;
+        auto decode = [this, data, size](size_t cluster) {
+            for (int set = VIS_PVS; set <= VIS_PAS; set++)
+            {
+                int offset;
+                memcpy(&offset, data + sizeof(int) + (cluster * 2 + set) * sizeof(int), sizeof(int));
+                if (offset <= 0 || (size_t)offset >= size)
+                    continue;
+                DecodeRow(data + offset, size - offset, bits[set] + cluster * stride, rowbytes);
+            }
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, count, 64, decode);
+        else
+        {
+            for (int cluster = 0; cluster < count; cluster++)
+                decode(cluster);
+        }
+        return 0;
+    }
+
+    inline bool IsLoaded() const {
+        return bits[VIS_PVS] != nullptr;
+    }
+
+    inline int GetClusterCount() const {
+        return numclusters;
+    }
+
+    inline size_t GetRowStride() const {
+        return stride;
+    }
+
+    // Row of cluster in set (VIS_PVS or VIS_PAS), nullptr if out of range.
+    inline const uint8_t* GetRow(int set, int cluster) const {
+        if (set < VIS_PVS || set > VIS_PAS || cluster < 0 || cluster >= numclusters)
+            return nullptr;
+        return bits[set] + cluster * stride;
+    }
+
+    // False if either cluster is out of range (leafs outside the world have cluster -1).
+    inline bool IsClusterVisible(int from, int to) const {
+        if ((unsigned)from >= (unsigned)numclusters || (unsigned)to >= (unsigned)numclusters)
+            return false;
+        return (bits[VIS_PVS][from * stride + (to >> 3)] >> (to & 7)) & 1;
+    }
+
+    inline bool IsClusterAudible(int from, int to) const {
+        if ((unsigned)from >= (unsigned)numclusters || (unsigned)to >= (unsigned)numclusters)
+            return false;
+        return (bits[VIS_PAS][from * stride + (to >> 3)] >> (to & 7)) & 1;
+    }
+};
+
+#endif // BSP_VISIBILITY_H
@@ -0,0 +1,472 @@
+#pragma once
+
+#ifndef BSP_WORLDLIGHTS_H
+#define BSP_WORLDLIGHTS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "bspdefs.hpp"
+#include "instrument.hpp"
+#include "threadpool.hpp"
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Reads LUMP_WORLDLIGHTS(_HDR) of either lump version into dworldlight_t (version 1 drops shadow_cast_offset).
+inline void ReadWorldLights(const char *data, size_t size, int lump_version, std::vector<dworldlight_t> &lights) {
+    if (lump_version != 1)
+    {
+        lights.resize(size / sizeof(dworldlight_t));
+        memcpy((void *)lights.data(), data, lights.size() * sizeof(dworldlight_t));
+        return;
+    }
+    lights.resize(size / sizeof(dworldlight_v1_t));
+    for (size_t i = 0; i < lights.size(); i++)
+    {
+        dworldlight_v1_t in;
+        memcpy(&in, data + i * sizeof(dworldlight_v1_t), sizeof(dworldlight_v1_t));
+        dworldlight_t &out = lights[i];
+        out.origin = in.origin;
+        out.intensity = in.intensity;
+        out.normal = in.normal;
+        out.cluster = in.cluster;
+        out.type = in.type;
+        out.style = in.style;
+        out.stopdot = in.stopdot;
+        out.stopdot2 = in.stopdot2;
+        out.exponent = in.exponent;
+        out.radius = in.radius;
+        out.constant_attn = in.constant_attn;
+        out.linear_attn = in.linear_attn;
+        out.quadratic_attn = in.quadratic_attn;
+        out.flags = in.flags;
+        out.texinfo = in.texinfo;
+        out.owner = in.owner;
+    }
+}
+
+// A light that reaches a point and what its intensity is scaled by there.
+struct LightHit
+{
+    unsigned int light;
+    float attenuation;
+};
+
+// The worldlights with a cluster index and a uniform grid over the spheres they reach.
+// Attenuation follows the engine (Engine_WorldLightDistanceFalloff and the cone/surface part of
+// Engine_WorldLightAngle) without a receiver normal or visibility: it says how much of a light arrives, not whether
+// it's blocked. Lights without a cutoff (sky, radius 0) are checked for every point.
+// The lights of every cell are stored 4 at a time field by field, so a query evaluates them with SSE2 straight from the cell.
+class WorldLights
+{
+private:
+    // 4 lights, the engine falloff folded into one formula:
+    // quake ? max(0, linear - d) : 1 / max(min_den, constant + linear * d + quadratic * d^2),
+    // times 0 / (dot - stopdot2) * cone_scale / 1 for dot <= stopdot2 / <= stopdot / above, and 0 past radius2.
+    struct alignas(16) LightPack
+    {
+        float origin[3][4];
+        float normal[3][4];
+        float constant[4];
+        float linear[4];
+        float quadratic[4];
+        float min_den[4];
+        float radius2[4];
+        float stopdot2[4];
+        float stopdot[4];
+        float cone_scale[4];
+        float quake[4];           // 1 for emit_quakelight
+        unsigned int light[4];    // ~0 for unused lanes
+    };
+
+    std::vector<dworldlight_t> lights;
+    std::vector<unsigned int> cluster_first;   // first entry of every cluster in cluster_lights, cluster_count + 1
+    std::vector<unsigned int> cluster_lights;
+    std::vector<LightPack> packs;
+    std::vector<unsigned int> cell_packs;      // first pack of every cell, the unbounded lights after the last one
+    float grid_min[3];
+    float cell_size;
+    int dims[3];
+
+    // Sphere the light reaches, false if it has no cutoff.
+    static bool GetReach(const dworldlight_t &light, float &reach) {
+        switch (light.type)
+        {
+        case emit_surface:
+        case emit_point:
+        case emit_spotlight:
+            reach = light.radius;
+            return light.radius > 0.0f;
+        case emit_quakelight:
+            reach = light.linear_attn;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static void PackLight(LightPack &pack, int lane, const dworldlight_t &light, unsigned int index) {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            pack.origin[axis][lane] = (&light.origin.x)[axis];
+            pack.normal[axis][lane] = (&light.normal.x)[axis];
+        }
+        float constant = 1.0f, linear = 0.0f, quadratic = 0.0f, min_den = 0.0f, quake = 0.0f;
+        float stopdot2 = -2.0f, stopdot = -1.0f; // always 1
+        float reach = 0.0f;
+        bool bounded = GetReach(light, reach);
+        switch (light.type)
+        {
+        case emit_surface:
+            constant = 0.0f;
+            quadratic = 1.0f;
+            min_den = 1.0f;
+            stopdot2 = 0.0f; // the cosine to the surface normal
+            stopdot = 1.0f;
+            break;
+        case emit_spotlight:
+            stopdot2 = light.stopdot2;
+            stopdot = light.stopdot;
+            // fall through
+        case emit_point:
+            constant = light.constant_attn;
+            linear = light.linear_attn;
+            quadratic = light.quadratic_attn;
+            break;
+        case emit_quakelight:
+            linear = light.linear_attn;
+            quake = 1.0f;
+            break;
+        default:
+            break;
+        }
+        pack.constant[lane] = constant;
+        pack.linear[lane] = linear;
+        pack.quadratic[lane] = quadratic;
+        pack.min_den[lane] = min_den;
+        pack.radius2[lane] = bounded ? reach * reach : INFINITY;
+        pack.stopdot2[lane] = stopdot2;
+        pack.stopdot[lane] = stopdot;
+        pack.cone_scale[lane] = stopdot > stopdot2 ? 1.0f / (stopdot - stopdot2) : 0.0f;
+        pack.quake[lane] = quake;
+        pack.light[lane] = index;
+    }
+
+    static LightPack EmptyPack() {
+        LightPack pack;
+        memset(&pack, 0, sizeof(LightPack));
+        for (int lane = 0; lane < 4; lane++)
+        {
+            pack.radius2[lane] = -1.0f;
+            pack.light[lane] = ~0u;
+        }
+        return pack;
+    }
+
+    // Appends the packs of indices, returns where they start.
+    unsigned int AddPacks(const std::vector<unsigned int> &indices) {
+        unsigned int first = (unsigned int)packs.size();
+        for (size_t i = 0; i < indices.size(); i++)
+        {
+            if (i % 4 == 0)
+                packs.push_back(EmptyPack());
+            PackLight(packs.back(), i % 4, lights[indices[i]], indices[i]);
+        }
+        return first;
+    }
+
+    static inline float LaneAttenuation(const LightPack &pack, int lane, const Vector &point) {
+        float dx = point.x - pack.origin[0][lane], dy = point.y - pack.origin[1][lane], dz = point.z - pack.origin[2][lane];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        if (!(d2 <= pack.radius2[lane]))
+            return 0.0f;
+        float d = sqrtf(d2);
+        float inv = d > 0.0f ? 1.0f / d : 0.0f;
+        float dot = (dx * pack.normal[0][lane] + dy * pack.normal[1][lane] + dz * pack.normal[2][lane]) * inv;
+        float falloff = 1.0f / std::max(pack.min_den[lane], pack.constant[lane] + pack.linear[lane] * d + pack.quadratic[lane] * d2);
+        if (pack.quake[lane] != 0.0f)
+            falloff = std::max(0.0f, pack.linear[lane] - d);
+        float ratio = dot > pack.stopdot[lane] ? 1.0f : (dot - pack.stopdot2[lane]) * pack.cone_scale[lane];
+        if (dot <= pack.stopdot2[lane])
+            ratio = 0.0f;
+        return falloff * ratio;
+    }
+
+    // Attenuation of the 4 lights of a pack at a point.
+    static inline void PackAttenuation(const LightPack &pack, const Vector &point, float *out) {
+#ifdef __SSE2__
+        __m128 dx = _mm_sub_ps(_mm_set1_ps(point.x), _mm_load_ps(pack.origin[0]));
+        __m128 dy = _mm_sub_ps(_mm_set1_ps(point.y), _mm_load_ps(pack.origin[1]));
+        __m128 dz = _mm_sub_ps(_mm_set1_ps(point.z), _mm_load_ps(pack.origin[2]));
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 d = _mm_sqrt_ps(d2);
+        __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+        __m128 inv = _mm_and_ps(_mm_cmpgt_ps(d, zero), _mm_div_ps(one, d));
+        __m128 dot = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_load_ps(pack.normal[0])), _mm_mul_ps(dy, _mm_load_ps(pack.normal[1]))),
+            _mm_mul_ps(dz, _mm_load_ps(pack.normal[2]))), inv);
+        __m128 linear = _mm_load_ps(pack.linear);
+        __m128 den = _mm_add_ps(_mm_add_ps(_mm_load_ps(pack.constant), _mm_mul_ps(linear, d)), _mm_mul_ps(_mm_load_ps(pack.quadratic), d2));
+        __m128 falloff = _mm_div_ps(one, _mm_max_ps(_mm_load_ps(pack.min_den), den));
+        __m128 quake = _mm_cmpneq_ps(_mm_load_ps(pack.quake), zero);
+        falloff = _mm_or_ps(_mm_andnot_ps(quake, falloff), _mm_and_ps(quake, _mm_max_ps(zero, _mm_sub_ps(linear, d))));
+        __m128 stopdot2 = _mm_load_ps(pack.stopdot2);
+        __m128 ramp = _mm_mul_ps(_mm_sub_ps(dot, stopdot2), _mm_load_ps(pack.cone_scale));
+        __m128 full = _mm_cmpgt_ps(dot, _mm_load_ps(pack.stopdot));
+        __m128 ratio = _mm_or_ps(_mm_andnot_ps(full, ramp), _mm_and_ps(full, one));
+        ratio = _mm_andnot_ps(_mm_cmple_ps(dot, stopdot2), ratio);
+        __m128 inside = _mm_cmple_ps(d2, _mm_load_ps(pack.radius2));
+        _mm_storeu_ps(out, _mm_and_ps(inside, _mm_mul_ps(falloff, ratio)));
+#else
+        for (int lane = 0; lane < 4; lane++)
+            out[lane] = LaneAttenuation(pack, lane, point);
+#endif
+    }
+
+    void QueryPacks(unsigned int first, unsigned int last, const Vector &point, float threshold, std::vector<LightHit> &hits) const {
+        alignas(16) float attenuation[4];
+        for (unsigned int p = first; p < last; p++)
+        {
+            const LightPack &pack = packs[p];
+            PackAttenuation(pack, point, attenuation);
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if (attenuation[lane] > threshold && pack.light[lane] != ~0u)
+                    hits.push_back(LightHit{pack.light[lane], attenuation[lane]});
+            }
+        }
+    }
+
+    // Cell of a point, -1 outside the grid.
+    inline long long FindCell(const Vector &point) const {
+        long long cell = 0;
+        for (int axis = 2; axis >= 0; axis--)
+        {
+            float offset = ((&point.x)[axis] - grid_min[axis]) / cell_size;
+            if (!(offset >= 0.0f) || offset >= (float)dims[axis])
+                return -1;
+            cell = cell * dims[axis] + (int)offset;
+        }
+        return cell;
+    }
+
+public:
+    WorldLights() : cell_size(1.0f)
+    {
+        grid_min[0] = grid_min[1] = grid_min[2] = 0.0f;
+        dims[0] = dims[1] = dims[2] = 0;
+    }
+
+    // Indexes lights. cell_size 0 picks one from the average reach of the lights.
+    void Build(const dworldlight_t *in_lights, size_t count, float new_cell_size = 0.0f) {
+        BSP_TRACE_SCOPE("WorldLights::Build");
+        lights.assign(in_lights, in_lights + count);
+        packs.clear();
+
+        // Cluster buckets, lights outside the map (cluster -1) aren't in any.
+        int clusters = 0;
+        for (const dworldlight_t &light : lights)
+            clusters = std::max(clusters, light.cluster + 1);
+        cluster_first.assign(clusters + 1, 0);
+        for (const dworldlight_t &light : lights)
+        {
+            if (light.cluster >= 0)
+                cluster_first[light.cluster + 1]++;
+        }
+        for (int c = 0; c < clusters; c++)
+            cluster_first[c + 1] += cluster_first[c];
+        cluster_lights.resize(cluster_first[clusters]);
+        std::vector<unsigned int> fill(cluster_first.begin(), cluster_first.end() - 1);
+        for (size_t i = 0; i < lights.size(); i++)
+        {
+            if (lights[i].cluster >= 0)
+                cluster_lights[fill[lights[i].cluster]++] = (unsigned int)i;
+        }
+
+        // Grid over the spheres of the lights with a cutoff.
+        std::vector<unsigned int> bounded, unbounded;
+        float mins[3] = {INFINITY, INFINITY, INFINITY}, maxs[3] = {-INFINITY, -INFINITY, -INFINITY};
+        double total_reach = 0.0;
+        for (size_t i = 0; i < lights.size(); i++)
+        {
+            const dworldlight_t &light = lights[i];
+            float reach;
+            if (!GetReach(light, reach))
+            {
+                if (light.type >= emit_surface && light.type <= emit_skyambient)
+                    unbounded.push_back((unsigned int)i);
+                continue;
+            }
+            if (!(reach > 0.0f) || !std::isfinite(reach))
+                continue; // reaches nothing
+            bounded.push_back((unsigned int)i);
+            total_reach += reach;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                mins[axis] = std::min(mins[axis], (&light.origin.x)[axis] - reach);
+                maxs[axis] = std::max(maxs[axis], (&light.origin.x)[axis] + reach);
+            }
+        }
+
+        dims[0] = dims[1] = dims[2] = 0;
+        size_t cells = 0;
+        if (!bounded.empty())
+        {
+            float extent = std::max(maxs[0] - mins[0], std::max(maxs[1] - mins[1], maxs[2] - mins[2]));
+            cell_size = new_cell_size > 0.0f ? new_cell_size : std::max((float)(total_reach / bounded.size()), extent / 128.0f);
+            cell_size = std::max(cell_size, 1.0f);
+            for (;;)
+            {
+                cells = 1;
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    grid_min[axis] = mins[axis];
+                    dims[axis] = std::max(1, (int)std::ceil((maxs[axis] - mins[axis]) / cell_size));
+                    cells *= dims[axis];
+                }
+                if (cells <= (1u << 22))
+                    break;
+                cell_size *= 2.0f;
+            }
+        }
+
+        // Every light goes into the cells its sphere touches.
+        std::vector<std::vector<unsigned int>> cell_lights(cells);
+        for (unsigned int i : bounded)
+        {
+            const dworldlight_t &light = lights[i];
+            float reach = 0.0f;
+            GetReach(light, reach);
+            int low[3], high[3];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float origin = (&light.origin.x)[axis];
+                low[axis] = std::max(0, (int)((origin - reach - grid_min[axis]) / cell_size));
+                high[axis] = std::min(dims[axis] - 1, (int)((origin + reach - grid_min[axis]) / cell_size));
+            }
+            for (int z = low[2]; z <= high[2]; z++)
+            {
+                for (int y = low[1]; y <= high[1]; y++)
+                {
+                    for (int x = low[0]; x <= high[0]; x++)
+                    {
+                        // Distance from the center to the cell box.
+                        const int cell[3] = {x, y, z};
+                        float distance2 = 0.0f;
+                        for (int axis = 0; axis < 3; axis++)
+                        {
+                            float origin = (&light.origin.x)[axis];
+                            float lo = grid_min[axis] + cell[axis] * cell_size, hi = lo + cell_size;
+                            float gap = origin < lo ? lo - origin : origin > hi ? origin - hi : 0.0f;
+                            distance2 += gap * gap;
+                        }
+                        if (distance2 <= reach * reach)
+                            cell_lights[((size_t)z * dims[1] + y) * dims[0] + x].push_back(i);
+                    }
+                }
+            }
+        }
+
+        cell_packs.resize(cells + 2);
+        for (size_t c = 0; c < cells; c++)
+            cell_packs[c] = AddPacks(cell_lights[c]);
+        cell_packs[cells] = AddPacks(unbounded);
+        cell_packs[cells + 1] = (unsigned int)packs.size();
+    }
+
+    // Reads and indexes the worldlights of a Bsp or BspSnapshot, the HDR ones if hdr is set and there are any.
+    template<typename Source>
+    void Build(Source &bsp, bool hdr = false, float new_cell_size = 0.0f) {
+        std::vector<char> data;
+        int n = LUMP_WORLDLIGHTS;
+        if (hdr)
+        {
+            bsp.ReadLump(LUMP_WORLDLIGHTS_HDR, data);
+            n = LUMP_WORLDLIGHTS_HDR;
+        }
+        if (data.empty())
+        {
+            bsp.ReadLump(LUMP_WORLDLIGHTS, data);
+            n = LUMP_WORLDLIGHTS;
+        }
+        std::vector<dworldlight_t> decoded;
+        ReadWorldLights(data.data(), data.size(), bsp.GetLump(n).version, decoded);
+        Build(decoded.data(), decoded.size(), new_cell_size);
+    }
+
+    inline size_t size() const {
+        return lights.size();
+    }
+
+    inline const std::vector<dworldlight_t>& GetLights() const {
+        return lights;
+    }
+
+    inline size_t GetClusterCount() const {
+        return cluster_first.empty() ? 0 : cluster_first.size() - 1;
+    }
+
+    // Lights in a cluster, count is 0 for clusters without any.
+    inline const unsigned int* GetClusterLights(int cluster, size_t &count) const {
+        if (cluster < 0 || (size_t)cluster >= GetClusterCount())
+        {
+            count = 0;
+            return nullptr;
+        }
+        count = cluster_first[cluster + 1] - cluster_first[cluster];
+        return cluster_lights.data() + cluster_first[cluster];
+    }
+
+    // Attenuation of light index at point, exactly what the queries compute.
+    float GetAttenuation(size_t index, const Vector &point) const {
+        LightPack pack = EmptyPack();
+        PackLight(pack, 0, lights[index], (unsigned int)index);
+        return LaneAttenuation(pack, 0, point);
+    }
+
+    // Appends the lights reaching point with an attenuation above threshold to hits, in no particular order.
+    // Returns how many were added.
+    size_t FindLights(const Vector &point, std::vector<LightHit> &hits, float threshold = 0.0f) const {
+        size_t before = hits.size();
+        if (cell_packs.empty())
+            return 0;
+        size_t cells = cell_packs.size() - 2;
+        long long cell = cells > 0 ? FindCell(point) : -1;
+        if (cell >= 0)
+            QueryPacks(cell_packs[cell], cell_packs[cell + 1], point, threshold, hits);
+        QueryPacks(cell_packs[cells], cell_packs[cells + 1], point, threshold, hits);
+        return hits.size() - before;
+    }
+
+    // FindLights() for count points. The hits of point i end up in hits[first[i]] to hits[first[i + 1]],
+    // blocks of points are spread over the pool.
+    void FindLightsBatch(const Vector *points, size_t count, std::vector<size_t> &first, std::vector<LightHit> &hits, float threshold = 0.0f, ThreadPool *pool = nullptr) const {
+        const size_t block = 256;
+        size_t blocks = (count + block - 1) / block;
+        std::vector<std::vector<LightHit>> block_hits(blocks);
+        first.assign(count + 1, 0);
+        auto query = [&](size_t b) {
+            size_t end = std::min(count, (b + 1) * block);
+            for (size_t i = b * block; i < end; i++)
+                first[i + 1] = FindLights(points[i], block_hits[b], threshold);
+        };
+        if (pool != nullptr)
+            pool->ParallelFor(0, blocks, 1, query);
+        else
+        {
+            for (size_t b = 0; b < blocks; b++)
+                query(b);
+        }
+        for (size_t i = 0; i < count; i++)
+            first[i + 1] += first[i];
+        hits.resize(first[count]);
+        for (size_t b = 0; b < blocks; b++)
+        {
+            if (!block_hits[b].empty())
+                memcpy(&hits[first[b * block]], block_hits[b].data(), block_hits[b].size() * sizeof(LightHit));
+        }
+    }
+};
+
+#endif // BSP_WORLDLIGHTS_H